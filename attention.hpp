@@ -1,38 +1,102 @@
 #pragma once
 #include "layers.hpp"
+#include "flash_attention.hpp"
+#include "batch.hpp"
+
+// Per-layer key/value cache for incremental decoding. Keys and values are
+// stored head-major ([heads x capacity x head_dim]) so each head attends
+// over one contiguous block.
+struct KVCache {
+    int heads=0,head_dim=0,capacity=0,len=0;
+    std::vector<float> k,v;
+    void reserve(int h,int hd,int cap){
+        if(h==heads&&hd==head_dim&&cap<=capacity) return;
+        std::vector<float> nk((size_t)h*cap*hd,0.0f),nv((size_t)h*cap*hd,0.0f);
+        if(h==heads&&hd==head_dim)
+            for(int head=0;head<h;head++){
+                std::copy_n(&k[(size_t)head*capacity*hd],(size_t)len*hd,&nk[(size_t)head*cap*hd]);
+                std::copy_n(&v[(size_t)head*capacity*hd],(size_t)len*hd,&nv[(size_t)head*cap*hd]);
+            }
+        else len=0;
+        k.swap(nk);v.swap(nv);heads=h;head_dim=hd;capacity=cap;
+    }
+    float* key(int head,int t){return &k[((size_t)head*capacity+t)*head_dim];}
+    float* value(int head,int t){return &v[((size_t)head*capacity+t)*head_dim];}
+    void clear(){len=0;}
+};
 
 struct MultiHeadAttention {
     int dim, heads, head_dim;
+    bool causal=true;
     Linear q_proj,k_proj,v_proj,o_proj;
     Tensor Q,K,V;
+    std::vector<float> lse;           // [heads x rows] softmax log-sum-exp, kept for backward
+    std::vector<int> offsets_cache;
     MultiHeadAttention(int d,int h):dim(d),heads(h),head_dim(d/h),
         q_proj(d,d),k_proj(d,d),v_proj(d,d),o_proj(d,d){}
-    Tensor forward(const Tensor&x){
-        Q=q_proj.forward(x); K=k_proj.forward(x); V=v_proj.forward(x);
+    // Scores are never materialized: flash_attention streams K/V tiles per
+    // (head, query block) with an online softmax, skipping future tiles
+    // when causal.
+    Tensor forward(const Tensor&x){return forward(x,single_sequence(x.rows));}
+    // Packed batch: rows [offsets[b], offsets[b+1]) form one sequence. The
+    // projections run as one tall GEMM, attention stays per sequence.
+    Tensor forward(const Tensor&x,const std::vector<int>&offsets){
+        Tensor q=q_proj.forward(x),k=k_proj.forward(x),v=v_proj.forward(x);
         Tensor out(x.rows,dim);
-        for(int head=0;head<heads;head++){
-            int offset=head*head_dim;
-            Tensor scores(x.rows,x.rows);
-            for(int i=0;i<x.rows;i++)
-                for(int j=0;j<x.rows;j++)
-                    scores(i,j)=Tensor::dot_simd(&Q.val[i*dim+offset],&K.val[j*dim+offset],head_dim)/std::sqrt((float)head_dim);
-            for(int i=0;i<scores.rows;i++){
-                float maxv=-1e9,sum=0;
-                for(int j=0;j<scores.cols;j++) maxv=std::max(maxv,scores(i,j));
-                for(int j=0;j<scores.cols;j++){scores(i,j)=exp(scores(i,j)-maxv);sum+=scores(i,j);}
-                for(int j=0;j<scores.cols;j++) scores(i,j)/=sum;
+        const bool cache=grad_enabled();
+        if(cache){lse.resize((size_t)heads*x.rows);offsets_cache=offsets;}
+        flash_attention(q.val.data(),k.val.data(),v.val.data(),out.val.data(),offsets,dim,heads,head_dim,causal,
+                        cache?lse.data():nullptr);
+        if(cache){Q=std::move(q);K=std::move(k);V=std::move(v);}
+        return o_proj.forward(out);  // o_proj.x_cache keeps the attention output
+    }
+    // Incremental causal attention: x holds only the new positions. Their
+    // keys/values are appended to the cache and each new query attends over
+    // everything cached so far, so past positions are never re-projected.
+    Tensor decode(const Tensor&x,KVCache&cache){
+        // Doubles when full, so appending without reset_cache is amortized O(1).
+        const int need=cache.len+x.rows;
+        cache.reserve(heads,head_dim,need>cache.capacity?std::max(need,2*cache.capacity):cache.capacity);
+        Tensor q=q_proj.forward(x),k=k_proj.forward(x),v=v_proj.forward(x);
+        int base=cache.len;
+        for(int i=0;i<x.rows;i++)
+            for(int head=0;head<heads;head++){
+                std::copy_n(&k.val[i*dim+head*head_dim],head_dim,cache.key(head,base+i));
+                std::copy_n(&v.val[i*dim+head*head_dim],head_dim,cache.value(head,base+i));
             }
-            for(int i=0;i<x.rows;i++)
-                for(int j=0;j<head_dim;j++){
-                    float s=0;
-                    for(int k=0;k<x.rows;k++) s+=scores(i,k)*V(k,offset+j);
-                    out(i,offset+j)=s;
-                }
-        }
+        cache.len+=x.rows;
+        Tensor out(x.rows,dim);
+        float scale=1.0f/std::sqrt((float)head_dim);
+        for(int head=0;head<heads;head++)
+            for(int i0=0;i0<x.rows;i0+=ATTN_BR)
+                flash_attention_block(&q.val[i0*dim+head*head_dim],dim,std::min(ATTN_BR,x.rows-i0),base+i0,
+                    cache.key(head,0),cache.value(head,0),head_dim,cache.len,
+                    &out.val[i0*dim+head*head_dim],dim,head_dim,scale,true);
         return o_proj.forward(out);
     }
-    Tensor backward(const Tensor&grad_out){return o_proj.backward(grad_out);}
+    // dL/dx for the last grad-enabled forward (upstream gradient in .val).
+    // Attention is recomputed tile by tile from Q, K, V and lse.
+    Tensor backward(const Tensor&grad_out){
+        Tensor dA=o_proj.backward(grad_out);
+        Tensor dQ=Tensor::uninit(Q.rows,dim),dK=Tensor::uninit(Q.rows,dim),dV=Tensor::uninit(Q.rows,dim);
+        flash_attention_backward(Q.val.data(),K.val.data(),V.val.data(),o_proj.x_cache.val.data(),dA.val.data(),lse.data(),
+                                 dQ.val.data(),dK.val.data(),dV.val.data(),offsets_cache,dim,heads,head_dim,causal);
+        Tensor dx=q_proj.backward(dQ),dk=k_proj.backward(dK),dv=v_proj.backward(dV);
+        for(size_t i=0;i<dx.val.size();i++) dx.val[i]+=dk.val[i]+dv.val[i];
+        return dx;
+    }
+    void release(){
+        Q=Tensor();K=Tensor();V=Tensor();std::vector<float>().swap(lse);
+        q_proj.release();k_proj.release();v_proj.release();o_proj.release();
+    }
     void step(float lr){q_proj.step(lr);k_proj.step(lr);v_proj.step(lr);o_proj.step(lr);}
+    template<typename F> void parameters(const std::string&prefix,F&&f){
+        q_proj.parameters(prefix+"q_proj.",f);k_proj.parameters(prefix+"k_proj.",f);
+        v_proj.parameters(prefix+"v_proj.",f);o_proj.parameters(prefix+"o_proj.",f);
+    }
+    template<typename F> void linears(const std::string&prefix,F&&f){
+        f(prefix+"q_proj.",q_proj);f(prefix+"k_proj.",k_proj);f(prefix+"v_proj.",v_proj);f(prefix+"o_proj.",o_proj);
+    }
     void save(std::ofstream&f)const{q_proj.save(f);k_proj.save(f);v_proj.save(f);o_proj.save(f);}
     void load(std::ifstream&f){q_proj.load(f);k_proj.load(f);v_proj.load(f);o_proj.load(f);}
 };
@@ -0,0 +1,56 @@
+#pragma once
+#include <vector>
+#include <cassert>
+
+// Offsets describing a single sequence of n rows. Returns a thread-local
+// vector so per-step forward calls don't allocate.
+inline const std::vector<int>& single_sequence(int n) {
+    thread_local std::vector<int> offsets{0, 0};
+    offsets[1] = n;
+    return offsets;
+}
+
+// A batch of token sequences packed back to back. Sequence b occupies rows
+// [offsets[b], offsets[b + 1]) of every activation, so Linear/LayerNorm/
+// FeedForward see one tall [total x dim] matrix while attention uses the
+// offsets to keep each sequence isolated. No padding rows are ever computed.
+struct TokenBatch {
+    std::vector<int> tokens;
+    std::vector<int> offsets{0};
+
+    int size() const { return static_cast<int>(offsets.size()) - 1; }
+    int total() const { return offsets.back(); }
+    int length(int b) const { return offsets[b + 1] - offsets[b]; }
+    // Packed row index of position t in sequence b.
+    int row(int b, int t) const { return offsets[b] + t; }
+
+    void add(const std::vector<int>& seq) {
+        tokens.insert(tokens.end(), seq.begin(), seq.end());
+        offsets.push_back(static_cast<int>(tokens.size()));
+    }
+
+    static TokenBatch pack(const std::vector<std::vector<int>>& seqs) {
+        TokenBatch b;
+        size_t n = 0;
+        for (const auto& s : seqs) n += s.size();
+        b.tokens.reserve(n);
+        b.offsets.reserve(seqs.size() + 1);
+        for (const auto& s : seqs) b.add(s);
+        return b;
+    }
+
+    // Right-padded [batch x seq] ids; lengths[b] is the number of real
+    // tokens in row b (the padding mask). Padding is dropped.
+    static TokenBatch from_padded(const std::vector<int>& ids, int batch, int seq,
+                                  const std::vector<int>& lengths) {
+        assert(static_cast<int>(ids.size()) == batch * seq && static_cast<int>(lengths.size()) == batch);
+        TokenBatch b;
+        b.offsets.reserve(batch + 1);
+        for (int i = 0; i < batch; i++) {
+            assert(lengths[i] >= 0 && lengths[i] <= seq);
+            b.tokens.insert(b.tokens.end(), ids.begin() + (size_t)i * seq, ids.begin() + (size_t)i * seq + lengths[i]);
+            b.offsets.push_back(static_cast<int>(b.tokens.size()));
+        }
+        return b;
+    }
+};
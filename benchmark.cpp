@@ -0,0 +1,2181 @@
+#include "model.hpp"
+#include "corpus.hpp"
+#include "dataset.hpp"
+#include "optimizer.hpp"
+#include "trainer.hpp"
+#include <chrono>
+#include <cstdio>
+#include <malloc.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#include <atomic>
+#include <functional>
+#include <cstdlib>
+#include <new>
+#include <iomanip>
+#include <iostream>
+#include <string>
+
+static bool bench_ok = true;  // cleared by any failed correctness check
+
+// ===== Allocation counting =====
+// Replacement global operator new/delete; every heap allocation in the
+// process bumps g_heap_allocs. (GCC cannot see that new and delete are
+// replaced as a pair and flags the free() calls.)
+#pragma GCC diagnostic ignored "-Wmismatched-new-delete"
+static std::atomic<size_t> g_heap_allocs{0};
+
+void* operator new(std::size_t n) {
+    ++g_heap_allocs;
+    if (void* p = std::malloc(n ? n : 1)) return p;
+    throw std::bad_alloc();
+}
+void* operator new(std::size_t n, std::align_val_t al) {
+    ++g_heap_allocs;
+    const size_t a = static_cast<size_t>(al);
+    if (void* p = std::aligned_alloc(a, (std::max<size_t>(n, 1) + a - 1) / a * a)) return p;
+    throw std::bad_alloc();
+}
+void operator delete(void* p) noexcept { std::free(p); }
+void operator delete(void* p, std::size_t) noexcept { std::free(p); }
+void operator delete(void* p, std::align_val_t) noexcept { std::free(p); }
+void operator delete(void* p, std::size_t, std::align_val_t) noexcept { std::free(p); }
+
+// Runs fn until at least min_sec has elapsed and returns seconds per call.
+template <typename F>
+static double time_it(F&& fn, double min_sec = 0.3) {
+    using clock = std::chrono::steady_clock;
+    fn();  // warm-up
+    int reps = 0;
+    auto t0 = clock::now();
+    double el = 0;
+    do {
+        fn();
+        ++reps;
+        el = std::chrono::duration<double>(clock::now() - t0).count();
+    } while (el < min_sec);
+    return el / reps;
+}
+
+// Per-call latency distribution: fn runs (after a warm-up) until min_sec
+// has elapsed and at least min_reps samples exist. Each sample times
+// `inner` back-to-back calls, for kernels too short to time one by one.
+struct Latency {
+    double p50 = 0, p90 = 0, p99 = 0, mean = 0;  // seconds per call
+    int samples = 0;
+};
+
+template <typename F>
+static Latency sample_it(F&& fn, double min_sec = 0.3, int min_reps = 10, int inner = 1) {
+    using clock = std::chrono::steady_clock;
+    fn();  // warm-up
+    std::vector<double> t;
+    double total = 0;
+    while (total < min_sec || (int)t.size() < min_reps) {
+        const auto t0 = clock::now();
+        for (int i = 0; i < inner; ++i) fn();
+        const double el = std::chrono::duration<double>(clock::now() - t0).count();
+        t.push_back(el / inner);
+        total += el;
+    }
+    std::sort(t.begin(), t.end());
+    auto pct = [&](double p) { return t[std::min(t.size() - 1, (size_t)(p * t.size()))]; };  // nearest rank
+    Latency l;
+    l.p50 = pct(0.50);
+    l.p90 = pct(0.90);
+    l.p99 = pct(0.99);
+    l.mean = total / (t.size() * (double)inner);
+    l.samples = (int)t.size();
+    return l;
+}
+
+// ===== GEMM =====
+// The pre-GEMM Tensor::matmul: full transpose of B, then one dot_simd per output.
+static Tensor matmul_reference(const Tensor& A, const Tensor& B) {
+    Tensor Bt = Tensor::transpose(B);
+    Tensor C(A.rows, B.cols);
+    for (int i = 0; i < A.rows; ++i)
+        for (int j = 0; j < B.cols; ++j)
+            C(i, j) = Tensor::dot_simd(&A.val[i * A.cols], &Bt.val[j * Bt.cols], A.cols);
+    return C;
+}
+
+static void bench_gemm() {
+    // (M, K, N): main.cpp (dim 256, hidden 512) and training.cpp (dim 1024, hidden 4096)
+    struct Shape { int M, K, N; const char* what; };
+    const Shape shapes[] = {
+        {64, 256, 256, "main qkv/o proj"},
+        {64, 256, 512, "main ffn up"},
+        {64, 512, 256, "main ffn down"},
+        {256, 1024, 1024, "train qkv/o proj"},
+        {256, 1024, 4096, "train ffn up"},
+        {256, 4096, 1024, "train ffn down"},
+        {1024, 1024, 4096, "train ffn up, 1k tokens"},
+        {32, 1024, 50000, "train lm_head"},
+    };
+
+    std::cout << "== gemm ==\n"
+              << std::left << std::setw(26) << "shape" << std::setw(24) << "M x K x N"
+              << std::right << std::setw(12) << "ref GF/s" << std::setw(12) << "gemm GF/s"
+              << std::setw(10) << "speedup" << std::setw(12) << "max|err|" << "\n";
+    for (const auto& s : shapes) {
+        Tensor A(s.M, s.K), B(s.K, s.N);
+        A.randomize(1.0f);
+        B.randomize(1.0f);
+        const double flops = 2.0 * s.M * s.K * s.N;
+
+        Tensor ref = matmul_reference(A, B), out = Tensor::matmul(A, B);
+        float err = 0;
+        for (size_t i = 0; i < ref.val.size(); ++i) err = std::max(err, std::fabs(ref.val[i] - out.val[i]));
+
+        double t_ref = time_it([&] { matmul_reference(A, B); });
+        double t_new = time_it([&] { Tensor::matmul(A, B); });
+        std::string dims = std::to_string(s.M) + "x" + std::to_string(s.K) + "x" + std::to_string(s.N);
+        std::cout << std::left << std::setw(26) << s.what << std::setw(24) << dims << std::right
+                  << std::fixed << std::setprecision(1)
+                  << std::setw(12) << flops / t_ref * 1e-9 << std::setw(12) << flops / t_new * 1e-9
+                  << std::setw(9) << t_ref / t_new << "x"
+                  << std::scientific << std::setprecision(1) << std::setw(12) << err << "\n"
+                  << std::defaultfloat;
+        if (err > 1e-3f) bench_ok = false;
+    }
+}
+
+// ===== Linear::backward =====
+// The pre-GEMM backward: scalar triple loop walking W column-wise.
+static Tensor linear_backward_reference(Linear& l, const Tensor& grad_out) {
+    Tensor grad_in(l.x_cache.rows, l.W.rows);
+    for (int i = 0; i < l.x_cache.rows; ++i)
+        for (int j = 0; j < l.W.cols; ++j) {
+            float go = grad_out.val[i * grad_out.cols + j];
+            for (int k = 0; k < l.W.rows; ++k) {
+                l.W.grad[k * l.W.cols + j] += l.x_cache(i, k) * go;
+                grad_in.val[i * l.W.rows + k] += go * l.W.val[k * l.W.cols + j];
+            }
+        }
+    for (int j = 0; j < l.b.cols; ++j) {
+        float sum = 0.0f;
+        for (int i = 0; i < grad_out.rows; ++i) sum += grad_out.val[i * grad_out.cols + j];
+        l.b.grad[j] += sum;
+    }
+    return grad_in;
+}
+
+static float max_rel_err(const Buffer& ref, const Buffer& out) {
+    float err = 0, scale = 1e-6f;
+    for (size_t i = 0; i < ref.size(); ++i) {
+        err = std::max(err, std::fabs(ref[i] - out[i]));
+        scale = std::max(scale, std::fabs(ref[i]));
+    }
+    return err / scale;
+}
+
+static void bench_linear_backward() {
+    struct Shape { int rows, in, out; const char* what; };
+    const Shape shapes[] = {
+        {64, 256, 512, "main ffn up"},
+        {64, 512, 256, "main ffn down"},
+        {128, 1024, 1024, "train qkv/o proj"},
+        {128, 1024, 4096, "train ffn up"},
+        {128, 4096, 1024, "train ffn down"},
+    };
+
+    std::cout << "== linear_backward ==\n"
+              << std::left << std::setw(20) << "shape" << std::setw(18) << "rows x in x out"
+              << std::right << std::setw(10) << "ref ms" << std::setw(10) << "gemm ms"
+              << std::setw(10) << "speedup" << std::setw(10) << "dW err" << std::setw(10) << "dX err"
+              << std::setw(10) << "db err" << "\n";
+    for (const auto& s : shapes) {
+        Linear l(s.in, s.out);
+        Tensor x(s.rows, s.in), g(s.rows, s.out);
+        x.randomize(1.0f);
+        g.randomize(1.0f);
+        l.forward(x);
+
+        Tensor dx_ref = linear_backward_reference(l, g);
+        Buffer dw_ref = l.W.grad, db_ref = l.b.grad;
+        l.W.zero_grad();
+        l.b.zero_grad();
+        Tensor dx = l.backward(g);
+        float e_w = max_rel_err(dw_ref, l.W.grad), e_x = max_rel_err(dx_ref.val, dx.val);
+        float e_b = max_rel_err(db_ref, l.b.grad);
+
+        double t_ref = time_it([&] { linear_backward_reference(l, g); });
+        double t_new = time_it([&] { l.backward(g); });
+        std::string dims = std::to_string(s.rows) + "x" + std::to_string(s.in) + "x" + std::to_string(s.out);
+        std::cout << std::left << std::setw(20) << s.what << std::setw(18) << dims << std::right
+                  << std::fixed << std::setprecision(2)
+                  << std::setw(10) << t_ref * 1e3 << std::setw(10) << t_new * 1e3
+                  << std::setw(9) << t_ref / t_new << "x"
+                  << std::scientific << std::setprecision(1)
+                  << std::setw(10) << e_w << std::setw(10) << e_x << std::setw(10) << e_b << "\n"
+                  << std::defaultfloat;
+        if (e_w > 1e-4f || e_x > 1e-4f || e_b > 1e-4f) bench_ok = false;
+    }
+}
+
+// ===== KV-cache decoding =====
+static void bench_decode() {
+    const int vocab = 4096, dim = 256, hidden = 1024, layers = 4, heads = 4;
+    Model model(vocab, dim, hidden, layers, heads);
+    std::mt19937 rng(42);
+    auto tokens_of = [&](int n) {
+        std::vector<int> t(n);
+        for (auto& x : t) x = static_cast<int>(rng() % vocab);
+        return t;
+    };
+
+    // Cached decoding must reproduce the last row of a full forward.
+    std::vector<int> check = tokens_of(24);
+    Tensor probs = model.forward(check);
+    model.reset_cache(32);
+    model.decode_step(std::vector<int>(check.begin(), check.end() - 4));
+    Tensor logits;
+    for (int i = 4; i > 0; --i) logits = model.decode_step({check[check.size() - i]});
+    Tensor p = softmax(logits);
+    float err = 0;
+    for (int j = 0; j < vocab; ++j) err = std::max(err, std::fabs(p.val[j] - probs(probs.rows - 1, j)));
+    if (err > 1e-5f) bench_ok = false;
+
+    std::cout << "== decode (vocab " << vocab << ", dim " << dim << ", " << layers
+              << " layers) max|dp| vs forward = " << std::scientific << std::setprecision(1) << err
+              << std::defaultfloat << " ==\n"
+              << std::setw(8) << "prefix" << std::setw(16) << "recompute tok/s"
+              << std::setw(16) << "kv-cache tok/s" << std::setw(14) << "ms/token" << "\n";
+    const int steps = 32;
+    for (int prefix : {16, 64, 256, 1024, 2048}) {
+        std::vector<int> prompt = tokens_of(prefix);
+        double t_full = time_it([&] { model.predict_next(prompt); }, 0.0);
+
+        model.reset_cache(prefix + steps);
+        model.decode_step(prompt);
+        auto t0 = std::chrono::steady_clock::now();
+        for (int s = 0; s < steps; ++s) model.decode_step({static_cast<int>(rng() % vocab)});
+        double t_kv = std::chrono::duration<double>(std::chrono::steady_clock::now() - t0).count() / steps;
+
+        std::cout << std::fixed << std::setprecision(1) << std::setw(8) << prefix
+                  << std::setw(16) << 1.0 / t_full << std::setw(16) << 1.0 / t_kv
+                  << std::setprecision(2) << std::setw(14) << t_kv * 1e3 << "\n" << std::defaultfloat;
+    }
+}
+
+// ===== Attention =====
+// The pre-fused attention core: one seq x seq scores Tensor per head,
+// scalar exp, strided V access (causal).
+static Tensor attention_reference(const Tensor& Q, const Tensor& K, const Tensor& V, int heads) {
+    const int seq = Q.rows, dim = Q.cols, hd = dim / heads;
+    Tensor out(seq, dim);
+    for (int h = 0; h < heads; ++h) {
+        const int off = h * hd;
+        Tensor scores(seq, seq);
+        for (int i = 0; i < seq; ++i)
+            for (int j = 0; j <= i; ++j)
+                scores(i, j) = Tensor::dot_simd(&Q.val[i * dim + off], &K.val[j * dim + off], hd) / std::sqrt((float)hd);
+        for (int i = 0; i < seq; ++i) {
+            float maxv = -1e9, sum = 0;
+            for (int j = 0; j <= i; ++j) maxv = std::max(maxv, scores(i, j));
+            for (int j = 0; j <= i; ++j) { scores(i, j) = std::exp(scores(i, j) - maxv); sum += scores(i, j); }
+            for (int j = 0; j <= i; ++j) scores(i, j) /= sum;
+        }
+        for (int i = 0; i < seq; ++i)
+            for (int j = 0; j < hd; ++j) {
+                float s = 0;
+                for (int k = 0; k <= i; ++k) s += scores(i, k) * V(k, off + j);
+                out(i, off + j) = s;
+            }
+    }
+    return out;
+}
+
+static void bench_attention() {
+    const int dim = 1024, heads = 16;
+    std::cout << "== attention core (dim " << dim << ", " << heads << " heads, causal) ==\n"
+              << std::setw(8) << "seq" << std::setw(12) << "ref ms" << std::setw(12) << "fused ms"
+              << std::setw(10) << "speedup" << std::setw(14) << "ref scores MB" << std::setw(12) << "max|err|" << "\n";
+    for (int seq : {256, 512, 1024, 2048, 4096, 8192}) {
+        Tensor Q(seq, dim), K(seq, dim), V(seq, dim), O(seq, dim);
+        Q.randomize(1.0f);
+        K.randomize(1.0f);
+        V.randomize(1.0f);
+        auto fused = [&] { flash_attention(Q.val.data(), K.val.data(), V.val.data(), O.val.data(), seq, dim, heads, dim / heads, true); };
+        double t_new = time_it(fused, 0.0);
+        std::cout << std::fixed << std::setw(8) << seq;
+        if (seq <= 2048) {
+            Tensor ref = attention_reference(Q, K, V, heads);
+            float err = 0;
+            for (size_t i = 0; i < ref.val.size(); ++i) err = std::max(err, std::fabs(ref.val[i] - O.val[i]));
+            if (err > 1e-4f) bench_ok = false;
+            double t_ref = time_it([&] { attention_reference(Q, K, V, heads); }, 0.0);
+            std::cout << std::setprecision(1) << std::setw(12) << t_ref * 1e3 << std::setw(12) << t_new * 1e3
+                      << std::setw(9) << t_ref / t_new << "x";
+            std::cout << std::setw(14) << 2.0 * seq * seq * sizeof(float) / 1e6  // val + grad
+                      << std::scientific << std::setprecision(1) << std::setw(12) << err;
+        } else {
+            std::cout << std::setw(12) << "-" << std::setprecision(1) << std::setw(12) << t_new * 1e3
+                      << std::setw(10) << "-" << std::setw(14) << 2.0 * seq * seq * sizeof(float) / 1e6
+                      << std::setw(12) << "-";
+        }
+        std::cout << "\n" << std::defaultfloat;
+    }
+}
+
+// ===== Batched forward =====
+// Bytes of Linear weight storage (fp32, or int8 + scales once quantized).
+static size_t dense_weight_bytes(const Model& m) {
+    auto bytes = [](const Linear& l) { return l.W.val.size() * sizeof(float) + (l.quantized() ? l.qW.bytes() : 0); };
+    size_t n = bytes(m.lm_head);
+    for (const auto& b : m.blocks) {
+        const auto& a = b.attn;
+        n += bytes(a.q_proj) + bytes(a.k_proj) + bytes(a.v_proj) + bytes(a.o_proj);
+        n += bytes(b.ff.l1) + bytes(b.ff.l2);
+    }
+    return n;
+}
+
+static void bench_batch() {
+    const int vocab = 4096, dim = 256, hidden = 1024, layers = 4, heads = 4;
+    Model model(vocab, dim, hidden, layers, heads);
+    std::mt19937 rng(7);
+    auto ragged = [&](int batch) {
+        std::vector<std::vector<int>> seqs(batch);
+        for (auto& s : seqs) {
+            s.resize(4 + rng() % 29);  // 4..32 tokens
+            for (auto& t : s) t = static_cast<int>(rng() % vocab);
+        }
+        return seqs;
+    };
+
+    // Packed rows must equal running each sequence on its own.
+    auto check = ragged(5);
+    TokenBatch cb = TokenBatch::pack(check);
+    Tensor packed = model.forward(cb);
+    float err = 0;
+    for (int b = 0; b < cb.size(); ++b) {
+        Tensor single = model.forward(check[b]);
+        for (int t = 0; t < cb.length(b); ++t)
+            for (int j = 0; j < vocab; ++j)
+                err = std::max(err, std::fabs(single(t, j) - packed(cb.row(b, t), j)));
+    }
+    if (err > 1e-5f) bench_ok = false;
+
+    const double wmb = dense_weight_bytes(model) / 1e6;
+    std::cout << "== batch (dim " << dim << ", " << layers << " layers, " << std::fixed << std::setprecision(1)
+              << wmb << " MB dense weights) max|dp| vs per-sequence = " << std::scientific << err
+              << std::defaultfloat << " ==\n"
+              << std::setw(6) << "batch" << std::setw(8) << "tokens" << std::setw(16) << "per-seq tok/s"
+              << std::setw(14) << "batched tok/s" << std::setw(10) << "speedup" << std::setw(18) << "tokens/weight-MB" << "\n";
+    for (int batch : {1, 4, 16, 64}) {
+        auto seqs = ragged(batch);
+        TokenBatch tb = TokenBatch::pack(seqs);
+        double t_seq = time_it([&] { for (const auto& s : seqs) model.forward(s); }, 0.5);
+        double t_bat = time_it([&] { model.forward(tb); }, 0.5);
+        std::cout << std::fixed << std::setprecision(1) << std::setw(6) << batch << std::setw(8) << tb.total()
+                  << std::setw(16) << tb.total() / t_seq << std::setw(14) << tb.total() / t_bat
+                  << std::setw(9) << t_seq / t_bat << "x" << std::setw(18) << tb.total() / wmb << "\n"
+                  << std::defaultfloat;
+    }
+}
+
+// ===== Inference memory =====
+// Each configuration runs in a forked child so ru_maxrss is its own peak.
+template <typename F>
+static void report_peak_rss(const char* label, F&& fn) {
+    std::cout.flush();
+    pid_t pid = fork();
+    if (pid == 0) {
+        fn();
+        rusage ru{};
+        getrusage(RUSAGE_SELF, &ru);
+        std::cout << std::left << std::setw(34) << label << std::right << std::fixed << std::setprecision(1)
+                  << std::setw(10) << ru.ru_maxrss / 1024.0 << " MB\n";
+        std::cout.flush();
+        _exit(0);
+    }
+    int status = 0;
+    waitpid(pid, &status, 0);
+}
+
+static void bench_memory() {
+    // training.cpp shape at 8 of its 24 layers to fit small hosts; RSS scales linearly in layers.
+    const int vocab = 32000, dim = 1024, hidden = 4096, layers = 8, heads = 16, seq = 256;
+    std::vector<int> tokens(seq);
+    for (int i = 0; i < seq; ++i) tokens[i] = (i * 7919) % vocab;
+    std::cout << "== memory (peak RSS, vocab " << vocab << ", dim " << dim << ", " << layers
+              << " layers, seq " << seq << ") ==\n";
+    report_peak_rss("grad mode: build + forward", [&] {
+        Model model(vocab, dim, hidden, layers, heads);
+        model.forward(tokens);
+    });
+    report_peak_rss("NoGradGuard: build + forward", [&] {
+        NoGradGuard no_grad;
+        Model model(vocab, dim, hidden, layers, heads);
+        model.forward(tokens);
+    });
+}
+
+// ===== Dense cross-entropy =====
+// The pre-fusion loss over full [rows x vocab] probabilities: mean loss,
+// softmax - onehot in grad_out.grad. Reference for the fused LM-head loss.
+static float cross_entropy(const Tensor& pred, const std::vector<int>& target, Tensor& grad_out) {
+    float loss = 0;
+    for (int i = 0; i < pred.rows; i++) {
+        int t = target[i];
+        for (int j = 0; j < pred.cols; j++) {
+            float p = pred(i, j);
+            grad_out.grad[i * pred.cols + j] = p - (j == t ? 1.0f : 0.0f);
+        }
+        loss += -log(std::max(pred(i, t), 1e-9f));
+    }
+    return loss / pred.rows;
+}
+
+// ===== Workspace =====
+static void bench_workspace() {
+    const int vocab = 4096, dim = 256, hidden = 1024, layers = 4, heads = 4, seq = 64;
+    Model model(vocab, dim, hidden, layers, heads);
+    std::vector<int> tokens(seq), target(seq);
+    for (int i = 0; i < seq; ++i) { tokens[i] = (i * 131) % vocab; target[i] = (tokens[i] + 1) % vocab; }
+
+    auto train_step = [&] {
+        Tensor pred = model.forward(tokens);
+        Tensor grad(pred.rows, pred.cols);
+        cross_entropy(pred, target, grad);
+        model.step(1e-4f);
+    };
+
+    Workspace ws;
+    auto arena_step = [&] {
+        ws.reset();
+        WorkspaceScope scope(ws);
+        train_step();
+    };
+    for (int i = 0; i < 3; ++i) arena_step();  // warm-up sizes the arena
+    const size_t before = g_heap_allocs;
+    const int steps = 10;
+    for (int i = 0; i < steps; ++i) arena_step();
+    const size_t arena_allocs = g_heap_allocs - before;
+
+    const size_t before_heap = g_heap_allocs;
+    train_step();
+    const size_t heap_allocs = g_heap_allocs - before_heap;
+
+    double t_heap = time_it(train_step, 1.0), t_arena = time_it(arena_step, 1.0);
+
+    std::cout << "== workspace (dim " << dim << ", " << layers << " layers, seq " << seq << ", train step) ==\n"
+              << "heap allocations per step:  " << heap_allocs << " without workspace, "
+              << arena_allocs / steps << " with (" << arena_allocs << " over " << steps << " steps)\n"
+              << "arena high-water: " << std::fixed << std::setprecision(1) << ws.high_water / 1e6 << " MB in "
+              << ws.blocks.size() << " block(s)\n"
+              << "step time: " << std::setprecision(2) << t_heap * 1e3 << " ms heap, " << t_arena * 1e3
+              << " ms workspace\n" << std::defaultfloat
+              << "zero-allocation steady state: " << (arena_allocs == 0 ? "PASS" : "FAIL") << "\n";
+    if (arena_allocs != 0) bench_ok = false;
+}
+
+// ===== Checkpoint =====
+// The v1 writer: raw (rows, cols, floats) records through iostreams.
+static void save_legacy(Model& m, const std::string& path) {
+    std::ofstream f(path, std::ios::binary);
+    m.emb.save(f);
+    for (auto& b : m.blocks) b.save(f);
+    m.lm_head.save(f);
+}
+
+static void bench_checkpoint() {
+    const int vocab = 32000, dim = 1024, hidden = 4096, layers = 8, heads = 16;
+    const std::string v1 = "/tmp/carbon_bench_v1.cb", v1conv = "/tmp/carbon_bench_conv.cb", v2 = "/tmp/carbon_bench_v2.cb";
+    using clock = std::chrono::steady_clock;
+    auto secs = [](clock::time_point t0) { return std::chrono::duration<double>(clock::now() - t0).count(); };
+    std::vector<int> tokens{1, 2, 3, 4, 5, 6, 7, 8};
+
+    Tensor ref;
+    {
+        NoGradGuard no_grad;
+        Model model(vocab, dim, hidden, layers, heads);
+        save_legacy(model, v1);
+        model.save(v2);
+        ref = model.forward(tokens);
+    }
+    convert_legacy_checkpoint(v1, v1conv, heads);
+
+    NoGradGuard no_grad;
+    auto t0 = clock::now();
+    Model legacy(vocab, dim, hidden, layers, heads);
+    legacy.load(v1);
+    double t_legacy = secs(t0);
+    Tensor out_legacy = legacy.forward(tokens);
+
+    t0 = clock::now();
+    auto mapped = Model::open(v2);
+    double t_open = secs(t0);
+    t0 = clock::now();
+    Tensor out_mapped = mapped->forward(tokens);
+    double t_first = secs(t0);
+    auto converted = Model::open(v1conv);
+    Tensor out_conv = converted->forward(tokens);
+
+    float err = 0;
+    for (size_t i = 0; i < ref.val.size(); ++i)
+        err = std::max({err, std::fabs(ref.val[i] - out_legacy.val[i]), std::fabs(ref.val[i] - out_mapped.val[i]),
+                        std::fabs(ref.val[i] - out_conv.val[i])});
+    std::cout << "== checkpoint (vocab " << vocab << ", dim " << dim << ", " << layers << " layers, "
+              << std::fixed << std::setprecision(0) << dense_weight_bytes(*mapped) / 1e6 << " MB dense weights, warm page cache) ==\n"
+              << std::setprecision(1)
+              << "v1 construct + stream load:  " << std::setw(8) << t_legacy * 1e3 << " ms\n"
+              << "v2 Model::open (mmap):       " << std::setw(8) << t_open * 1e3 << " ms\n"
+              << "v2 first forward (faults in):" << std::setw(8) << t_first * 1e3 << " ms\n"
+              << "max|dp| v1 / v2 / converted vs saved model: " << std::scientific << std::setprecision(1) << err
+              << std::defaultfloat << "\n";
+    if (err > 0) bench_ok = false;
+    std::remove(v1.c_str());
+    std::remove(v1conv.c_str());
+    std::remove(v2.c_str());
+}
+
+// ===== Int8 quantization =====
+static void bench_quant() {
+    const int vocab = 32000, dim = 1024, hidden = 4096, layers = 8, heads = 16;
+    const std::string path = "/tmp/carbon_bench_q8.cb";
+    NoGradGuard no_grad;
+    Model model(vocab, dim, hidden, layers, heads);
+    std::mt19937 rng(7);
+    std::vector<int> text(129);
+    for (auto& t : text) t = static_cast<int>(rng() % vocab);
+    const std::vector<int> input(text.begin(), text.end() - 1);
+
+    auto decode_tps = [&](Model& m) {
+        const int prefix = 16, steps = 32;
+        m.reset_cache(prefix + steps);
+        m.decode_step(std::vector<int>(input.begin(), input.begin() + prefix));
+        auto t0 = std::chrono::steady_clock::now();
+        for (int s = 0; s < steps; ++s) m.decode_step({static_cast<int>(rng() % vocab)});
+        return steps / std::chrono::duration<double>(std::chrono::steady_clock::now() - t0).count();
+    };
+    // Teacher-forced mean NLL of text under m.
+    auto nll = [&](const Tensor& probs) {
+        double sum = 0;
+        for (int i = 0; i < probs.rows; ++i) sum -= std::log(std::max(probs(i, text[i + 1]), 1e-30f));
+        return sum / probs.rows;
+    };
+
+    const double fp32_mb = dense_weight_bytes(model) / 1e6;
+    const double fp32_tps = decode_tps(model);
+    const Tensor p32 = model.forward(input);
+
+    model.quantize();
+    const double q8_mb = dense_weight_bytes(model) / 1e6;
+    const double q8_tps = decode_tps(model);
+    const Tensor p8 = model.forward(input);
+
+    // KL(fp32 || int8) and top-1 agreement per position
+    double kl = 0;
+    int agree = 0;
+    for (int i = 0; i < p32.rows; ++i) {
+        int a32 = 0, a8 = 0;
+        for (int j = 0; j < vocab; ++j) {
+            const float p = p32(i, j), q = std::max(p8(i, j), 1e-30f);
+            if (p > 0) kl += p * std::log(p / q);
+            if (p > p32(i, a32)) a32 = j;
+            if (p8(i, j) > p8(i, a8)) a8 = j;
+        }
+        agree += a32 == a8;
+    }
+    kl /= p32.rows;
+
+    model.save(path);
+    auto reopened = Model::open(path);
+    const Tensor pr = reopened ? reopened->forward(input) : Tensor();
+    float err = reopened ? 0.0f : 1.0f;
+    for (size_t i = 0; reopened && i < pr.val.size(); ++i) err = std::max(err, std::fabs(pr.val[i] - p8.val[i]));
+
+    const double ppl32 = std::exp(nll(p32)), ppl8 = std::exp(nll(p8));
+    std::cout << "== quant (vocab " << vocab << ", dim " << dim << ", " << layers << " layers, int8 group "
+              << QUANT_GROUP << ") ==\n"
+              << std::setw(8) << "" << std::setw(14) << "weights MB" << std::setw(14) << "decode tok/s"
+              << std::setw(14) << "perplexity" << "\n" << std::fixed
+              << std::setw(8) << "fp32" << std::setprecision(1) << std::setw(14) << fp32_mb << std::setw(14) << fp32_tps
+              << std::setprecision(2) << std::setw(14) << ppl32 << "\n"
+              << std::setw(8) << "int8" << std::setprecision(1) << std::setw(14) << q8_mb << std::setw(14) << q8_tps
+              << std::setprecision(2) << std::setw(14) << ppl8 << "\n"
+              << "weights " << std::setprecision(2) << fp32_mb / q8_mb << "x smaller, decode " << q8_tps / fp32_tps
+              << "x faster; ppl delta " << std::showpos << (ppl8 - ppl32) / ppl32 * 100 << std::noshowpos
+              << "%, KL " << std::scientific << std::setprecision(2) << kl << std::fixed << ", top-1 agreement "
+              << std::setprecision(1) << 100.0 * agree / p32.rows << "%\n"
+              << "q8 checkpoint round trip max|dp|: " << std::scientific << std::setprecision(1) << err
+              << std::defaultfloat << "\n";
+    if (err > 0) bench_ok = false;
+    std::remove(path.c_str());
+}
+
+// ===== Fused LM-head loss =====
+// The unfused path: full logits, softmax, dense cross_entropy gradient,
+// then Linear::backward. Returns the loss; dx in dx.val.
+static float lm_loss_reference(const Tensor& x, Linear& head, const std::vector<int>& targets, Tensor& dx) {
+    Tensor pred = softmax(head.forward(x));
+    Tensor grad(pred.rows, pred.cols);
+    const float loss = cross_entropy(pred, targets, grad);
+    for (size_t i = 0; i < grad.val.size(); ++i) grad.val[i] = grad.grad[i] / pred.rows;
+    dx = head.backward(grad);
+    return loss;
+}
+
+static void bench_loss() {
+    const int dim = 1024, vocab = 50000;
+    std::mt19937 rng(3);
+    auto make = [&](int rows, Tensor& x, std::vector<int>& targets) {
+        x = Tensor(rows, dim);
+        x.randomize(1.0f);
+        targets.resize(rows);
+        for (auto& t : targets) t = static_cast<int>(rng() % vocab);
+    };
+
+    // correctness on a small problem, in row blocks of 24 (the last one partial)
+    Linear head(dim, vocab);
+    head.W.randomize(0.1f);
+    Tensor x, dx_ref, dx;
+    std::vector<int> targets;
+    make(64, x, targets);
+    const float loss_ref = lm_loss_reference(x, head, targets, dx_ref);
+    Buffer dW_ref = head.W.grad, db_ref = head.b.grad;
+    head.W.zero_grad();
+    head.b.zero_grad();
+    const float loss = lm_head_cross_entropy(x, head, targets, &dx, 24);
+    const float err_w = max_rel_err(dW_ref, head.W.grad), err_b = max_rel_err(db_ref, head.b.grad);
+    const float err_x = max_rel_err(dx_ref.val, dx.val);
+    const float err_l = std::fabs(loss - loss_ref) / loss_ref;
+
+    std::cout << "== loss (dim " << dim << ", vocab " << vocab << ", lm_head + softmax + cross-entropy + backward) ==\n"
+              << "fused vs reference rel err: loss " << std::scientific << std::setprecision(1) << err_l
+              << ", dW " << err_w << ", db " << err_b << ", dx " << err_x << std::defaultfloat << "\n";
+    if (!(err_l < 1e-4f && err_w < 1e-3f && err_b < 1e-3f && err_x < 1e-3f)) bench_ok = false;
+
+    std::cout << std::setw(6) << "rows" << std::setw(14) << "reference ms" << std::setw(12) << "fused ms"
+              << std::setw(18) << "reference MB" << std::setw(12) << "fused MB" << "\n";
+    for (int rows : {256, 1024}) {
+        make(rows, x, targets);
+        const double t_ref = time_it([&] { lm_loss_reference(x, head, targets, dx_ref); }, 0.0);
+        const double t_fused = time_it([&] { lm_head_cross_entropy(x, head, targets, &dx); }, 0.0);
+        // bytes handed out by a workspace = peak activation memory of the call
+        auto peak = [&](auto&& fn) {
+            Workspace ws;
+            WorkspaceScope scope(ws);
+            fn();
+            return ws.high_water / 1e6;
+        };
+        const double m_ref = peak([&] { Tensor d; lm_loss_reference(x, head, targets, d); });
+        const double m_fused = peak([&] { Tensor d; lm_head_cross_entropy(x, head, targets, &d); });
+        std::cout << std::fixed << std::setprecision(1) << std::setw(6) << rows << std::setw(14) << t_ref * 1e3
+                  << std::setw(12) << t_fused * 1e3 << std::setw(18) << m_ref << std::setw(12) << m_fused << "\n"
+                  << std::defaultfloat;
+    }
+}
+
+// ===== Sampling =====
+// Exact nucleus (top-k then top-p) probabilities by full sort, for checks.
+static std::vector<double> nucleus_reference(const std::vector<float>& logits, float temp, int top_k, float top_p) {
+    const int n = (int)logits.size();
+    std::vector<int> order(n);
+    for (int i = 0; i < n; ++i) order[i] = i;
+    std::sort(order.begin(), order.end(), [&](int a, int b) { return logits[a] > logits[b]; });
+    if (top_k > 0) order.resize(std::min(n, top_k));
+    std::vector<double> w(order.size());
+    double total = 0;
+    for (size_t i = 0; i < order.size(); ++i) total += w[i] = std::exp((logits[order[i]] - logits[order[0]]) / temp);
+    std::vector<double> p(n, 0.0);
+    double cum = 0, kept = 0;
+    size_t keep = 0;
+    while (keep < order.size()) {
+        cum += w[keep++];
+        if (cum >= top_p * total) break;
+    }
+    for (size_t i = 0; i < keep; ++i) kept += w[i];
+    for (size_t i = 0; i < keep; ++i) p[order[i]] = w[i] / kept;
+    return p;
+}
+
+static void bench_sampler() {
+    const int vocab = 50000;
+    std::mt19937 rng(11);
+    std::normal_distribution<float> nd(0.0f, 3.0f);
+    std::vector<float> logits(vocab);
+    for (auto& x : logits) x = nd(rng);
+
+    struct Cfg { const char* name; float temp; int top_k; float top_p; float penalty; };
+    const Cfg cfgs[] = {
+        {"greedy", 0.0f, 0, 1.0f, 1.0f},
+        {"temperature 0.8", 0.8f, 0, 1.0f, 1.0f},
+        {"top-k 40", 1.0f, 40, 1.0f, 1.0f},
+        {"top-p 0.9", 1.0f, 0, 0.9f, 1.0f},
+        {"top-k 50 + top-p 0.95 + rep 1.3", 0.8f, 50, 0.95f, 1.3f},
+    };
+    auto config = [](const Cfg& c, uint64_t seed) {
+        SamplerConfig sc;
+        sc.temperature = c.temp;
+        sc.top_k = c.top_k;
+        sc.top_p = c.top_p;
+        sc.repetition_penalty = c.penalty;
+        sc.seed = seed;
+        return sc;
+    };
+
+    // Distribution checks on a small vocab: empirical frequencies against
+    // the exact (fully sorted) nucleus distribution, and seed determinism.
+    const int small = 200, draws = 200000;
+    std::vector<float> small_logits(logits.begin(), logits.begin() + small);
+    float worst = 0;
+    bool deterministic = true;
+    for (const Cfg& c : cfgs) {
+        if (c.temp <= 0 || c.penalty != 1.0f) continue;
+        std::vector<double> ref = nucleus_reference(small_logits, c.temp, c.top_k, c.top_p);
+        Sampler a(config(c, 5)), b(config(c, 5));
+        std::vector<double> freq(small, 0.0);
+        std::vector<float> buf;
+        for (int d = 0; d < draws; ++d) {
+            buf = small_logits;
+            const int t = a.sample(buf.data(), small);
+            buf = small_logits;
+            deterministic &= b.sample(buf.data(), small) == t;
+            freq[t] += 1.0 / draws;
+        }
+        for (int j = 0; j < small; ++j) worst = std::max(worst, (float)std::fabs(freq[j] - ref[j]));
+    }
+
+    std::cout << "== sampler (vocab " << vocab << ") max|freq - p| = " << std::scientific << std::setprecision(1) << worst
+              << std::defaultfloat << " over " << draws << " draws, seeded runs " << (deterministic ? "identical" : "DIFFER")
+              << " ==\n";
+    if (worst > 5e-3f || !deterministic) bench_ok = false;
+
+    const int dim = 512, layers = 4;
+    NoGradGuard no_grad;
+    Model model(vocab, dim, 4 * dim, layers, 8);
+    std::vector<int> prompt(64);
+    for (int i = 0; i < 64; ++i) prompt[i] = (i * 7919) % vocab;
+    model.reset_cache(1024);
+    model.decode_step(prompt);
+    const double t_step = time_it([&] {
+        if (model.cached_len() >= 1000) { model.reset_cache(1024); model.decode_step(prompt); }
+        model.decode_step({1});
+    });
+    const double t_old = time_it([&] {
+        Tensor probs = model.forward(prompt);
+        std::max_element(probs.val.end() - vocab, probs.val.end());
+    });
+    const double t_new = time_it([&] { model.predict_next(prompt); });
+    std::cout << "predict_next (" << prompt.size() << " tokens): " << std::fixed << std::setprecision(2) << t_old * 1e3
+              << " ms full softmax -> " << t_new * 1e3 << " ms last-row logits\n"
+              << std::setw(34) << std::left << "config" << std::right << std::setw(12) << "us/token"
+              << std::setw(22) << "% of decode step" << "\n";
+    for (const Cfg& c : cfgs) {
+        Sampler smp(config(c, 1));
+        for (int i = 0; i < 64; ++i) smp.accept(prompt[i]);
+        std::vector<float> buf = logits;
+        volatile int sink = 0;
+        const double t = time_it([&] { sink = smp.sample(buf.data(), vocab); }, 0.2);
+        (void)sink;
+        std::cout << std::setw(34) << std::left << c.name << std::right << std::setprecision(1) << std::setw(12) << t * 1e6
+                  << std::setprecision(3) << std::setw(21) << 100.0 * t / t_step << "%\n";
+    }
+    std::cout << "(decode step: dim " << dim << ", " << layers << " layers, " << std::setprecision(2) << t_step * 1e3
+              << " ms)\n" << std::defaultfloat;
+}
+
+// ===== BPE training =====
+// The pre-incremental loop: recount every pair of every word, scan the
+// whole pair map, and rebuild every word, once per merge. Expects t.freq
+// filled the way BPETokenizer::train fills it.
+static void bpe_train_reference(BPETokenizer& t, int vocab_size) {
+    std::vector<std::vector<std::string>> corpus;
+    for (const auto& [w, _] : t.freq) corpus.push_back(BPETokenizer::split_chars(w));
+    t.vocab.clear();
+    t.rev_vocab.clear();
+    t.merges.clear();
+    for (const auto& s : t.special_tokens) {
+        t.vocab[s] = static_cast<int>(t.vocab.size());
+        t.rev_vocab.push_back(s);
+    }
+    std::set<std::string> symbols;
+    for (const auto& [w, _] : t.freq)
+        for (const auto& c : BPETokenizer::split_chars(w)) symbols.insert(c);
+    for (const auto& s : symbols) {
+        t.vocab[s] = static_cast<int>(t.vocab.size());
+        t.rev_vocab.push_back(s);
+    }
+    while (static_cast<int>(t.vocab.size()) < vocab_size) {
+        t.count_pairs(corpus);
+        auto best = t.most_frequent_pair();
+        if (t.pair_freq.empty() || t.pair_freq[best] < 2) break;
+        BPETokenizer::merge_pair(corpus, best);
+        const std::string merged = best.first + best.second;
+        t.vocab[merged] = static_cast<int>(t.vocab.size());
+        t.rev_vocab.push_back(merged);
+        t.merges.push_back(best);
+    }
+}
+
+// Zipf-distributed words over a 40k-word lexicon (ASCII plus some
+// multi-byte UTF-8), written as whitespace-separated text.
+static void write_corpus(const std::string& path, size_t bytes) {
+    std::mt19937 rng(17);
+    const char* extra[] = {"é", "ü", "ß", "ж", "я", "日", "本"};
+    std::vector<std::string> lexicon(40000);
+    for (auto& w : lexicon) {
+        const int len = 2 + static_cast<int>(rng() % 10);
+        for (int i = 0; i < len; ++i) {
+            if (rng() % 40 == 0) w += extra[rng() % 7];
+            else w += static_cast<char>('a' + std::min<int>(25, static_cast<int>(std::abs(std::normal_distribution<float>(0, 7)(rng)))));
+        }
+    }
+    std::vector<double> cdf(lexicon.size());
+    double acc = 0;
+    for (size_t i = 0; i < cdf.size(); ++i) cdf[i] = acc += 1.0 / (i + 1);
+    std::uniform_real_distribution<double> u(0, acc);
+    std::ofstream f(path);
+    size_t written = 0;
+    while (written < bytes) {
+        const std::string& w = lexicon[std::lower_bound(cdf.begin(), cdf.end(), u(rng)) - cdf.begin()];
+        f << w << (rng() % 12 ? ' ' : '\n');
+        written += w.size() + 1;
+    }
+}
+
+static void bench_bpe() {
+    using clock = std::chrono::steady_clock;
+    auto secs = [](clock::time_point t0) { return std::chrono::duration<double>(clock::now() - t0).count(); };
+    const std::string small = "/tmp/carbon_bpe_small.txt", large = "/tmp/carbon_bpe_large.txt";
+    const size_t small_mb = 1, large_mb = 32;
+    const int small_vocab = 600, large_vocab = 50000;
+    write_corpus(small, small_mb << 20);
+    write_corpus(large, large_mb << 20);
+
+    BPETokenizer ref, inc;
+    inc.train(small, small_vocab, false);
+    ref.freq = inc.freq;
+    auto t0 = clock::now();
+    bpe_train_reference(ref, small_vocab);
+    const double t_ref = secs(t0);
+    t0 = clock::now();
+    inc.train_from_counts(small_vocab, false);
+    const double t_inc = secs(t0);
+    const bool same = ref.merges == inc.merges && ref.rev_vocab == inc.rev_vocab && ref.vocab == inc.vocab;
+
+    std::cout << "== bpe (synthetic Zipf corpus) ==\n"
+              << small_mb << " MB, vocab " << small_vocab << ": full recount " << std::fixed << std::setprecision(2)
+              << t_ref << " s, incremental " << t_inc << " s (" << std::setprecision(0) << t_ref / t_inc
+              << "x), " << inc.merges.size() << " merges " << (same ? "identical" : "DIFFER") << "\n";
+    if (!same) bench_ok = false;
+
+    BPETokenizer big;
+    t0 = clock::now();
+    big.train(large, large_vocab, false);
+    const double t_big = secs(t0);
+    std::cout << large_mb << " MB, vocab " << large_vocab << ": incremental " << std::setprecision(2) << t_big << " s for "
+              << big.merges.size() << " merges (" << big.freq.size() << " distinct words)\n" << std::defaultfloat;
+    std::remove(small.c_str());
+    std::remove(large.c_str());
+}
+
+// The pre-rank encoder: apply_bpe (every merge, in order) on every word.
+static std::vector<int> encode_reference(const BPETokenizer& t, const std::string& text) {
+    std::istringstream iss(text);
+    std::string word;
+    std::vector<int> out;
+    while (iss >> word)
+        for (const auto& tok : t.apply_bpe(BPETokenizer::split_chars("▁" + word))) {
+            auto it = t.vocab.find(tok);
+            out.push_back(it != t.vocab.end() ? it->second : t.vocab.at("<unk>"));
+        }
+    return out;
+}
+
+static void bench_encode() {
+    const std::string corpus = "/tmp/carbon_encode.txt";
+    write_corpus(corpus, 16 << 20);
+    BPETokenizer tok;
+    tok.train(corpus, 32000, false);
+    std::ifstream f(corpus);
+    std::string text((std::istreambuf_iterator<char>(f)), std::istreambuf_iterator<char>());
+    std::remove(corpus.c_str());
+    text += " naïve 東京 ünïcödé qzxj\tmixed\nwhitespace ";  // unseen symbols
+
+    const std::string sample = text.substr(text.size() - (256 << 10));  // reference is slow
+    const std::vector<int> ref = encode_reference(tok, sample);
+    const bool same = tok.encode(sample, nullptr) == ref && tok.encode(sample) == ref;
+
+    const double mb = text.size() / 1e6, sample_mb = sample.size() / 1e6;
+    const double t_ref = time_it([&] { encode_reference(tok, sample); }, 0.0);
+    const double t_rank = time_it([&] { (void)tok.encode(text, nullptr); }, 0.0);
+    WordCache cache;
+    const double t_cached = time_it([&] { (void)tok.encode(text, &cache); }, 0.0);
+    std::cout << "== encode (vocab " << tok.vocab.size() << ", " << tok.merges.size() << " merges, "
+              << std::fixed << std::setprecision(1) << mb << " MB synthetic text) ids "
+              << (same ? "identical" : "DIFFER") << " ==\n"
+              << "apply_bpe per word:       " << std::setw(8) << std::setprecision(2) << sample_mb / t_ref << " MB/s\n"
+              << "rank-based, no cache:     " << std::setw(8) << mb / t_rank << " MB/s\n"
+              << "rank-based + LRU cache:   " << std::setw(8) << mb / t_cached << " MB/s\n" << std::defaultfloat;
+    if (!same) bench_ok = false;
+}
+
+// ===== Corpus sharding =====
+// tokenize_corpus over a synthetic file: shard ids vs tok.encode of the
+// whole text, throughput per thread count, and peak RSS vs reading the
+// text into memory and encoding it in one go.
+static void bench_corpus() {
+    const std::string corpus = "/tmp/carbon_corpus.txt", prefix = "/tmp/carbon_corpus";
+    const size_t mb = 64;
+    write_corpus(corpus, mb << 20);
+    BPETokenizer tok;
+    tok.train(corpus, 8000, false);
+    tok.freq.clear();
+
+    CorpusOptions opt;
+    opt.shard_tokens = 4000000;
+    CorpusStats st;
+    bool same = tokenize_corpus(tok, corpus, prefix, opt, &st);
+    std::vector<int> ids;
+    for (const auto& p : st.shards) {
+        TokenShard s;
+        if (!s.open(p)) { same = false; break; }
+        const size_t at = ids.size();
+        ids.resize(at + s.size());
+        s.read(0, s.size(), ids.data() + at);
+    }
+    {
+        std::ifstream f(corpus);
+        std::string text((std::istreambuf_iterator<char>(f)), std::istreambuf_iterator<char>());
+        same = same && ids == tok.encode(text, nullptr);
+    }
+    std::vector<int>().swap(ids);
+    std::cout << "== corpus (" << mb << " MB synthetic text, vocab " << tok.vocab.size() << ") " << st.tokens
+              << " tokens in " << st.shards.size() << " shards, ids " << (same ? "identical" : "DIFFER") << " ==\n";
+    if (!same) bench_ok = false;
+
+    const int hw = std::max(1u, std::thread::hardware_concurrency());
+    for (int t = 1;; t = std::min(2 * t, hw)) {
+        set_num_threads(t);
+        const double sec = time_it([&] { tokenize_corpus(tok, corpus, prefix, opt); }, 0.0);
+        std::cout << std::setw(3) << t << " threads: " << std::fixed << std::setprecision(1) << std::setw(8)
+                  << mb * 1.048576 / sec << " MB/s\n" << std::defaultfloat;
+        if (t == hw) break;
+    }
+    set_num_threads(0);
+
+    report_peak_rss("peak RSS, tokenizer only", [] {});
+    report_peak_rss("peak RSS, read + encode", [&] {
+        std::ifstream f(corpus);
+        std::string text((std::istreambuf_iterator<char>(f)), std::istreambuf_iterator<char>());
+        (void)tok.encode(text);
+    });
+    report_peak_rss("peak RSS, tokenize_corpus", [&] { tokenize_corpus(tok, corpus, prefix, opt); });
+    std::remove(corpus.c_str());
+    for (const auto& p : st.shards) std::remove(p.c_str());
+}
+
+// ===== Dataset loader =====
+// Synthetic shards where token k of a shard is k % 65521, so every target
+// must be its input + 1 (mod 65521). Checks window alignment, that a
+// shuffled epoch visits every window once, that ranks split the windows,
+// that a loader restarted from a saved cursor continues the same stream,
+// and how often a training step has to wait for its batch.
+static void bench_dataset() {
+    const std::string prefix = "/tmp/carbon_dataset";
+    const int n_shards = 3, P = 65521;
+    const uint64_t shard_tokens[n_shards] = {3000000, 1000003, 2500000};
+    std::vector<std::string> paths;
+    for (int s = 0; s < n_shards; ++s) {
+        TokenShardWriter w;
+        paths.push_back(shard_path(prefix, s));
+        w.open(paths.back(), 65536);
+        std::vector<int> ids;
+        for (uint64_t k = 0; k < shard_tokens[s];) {
+            ids.clear();
+            for (; ids.size() < 65536 && k < shard_tokens[s]; ++k) ids.push_back(static_cast<int>(k % P));
+            w.append(ids);
+        }
+        w.close();
+    }
+
+    DatasetOptions opt;
+    opt.seq = 256;
+    opt.seed = 7;
+    TokenDataset ds;
+    bool ok = ds.open(prefix, opt);
+    const uint64_t n = ds.windows();
+
+    // one shuffled epoch is a permutation of the windows
+    std::vector<char> seen(n, 0);
+    DatasetCursor c;
+    for (uint64_t i = 0; i < n && ok; ++i) {
+        const uint64_t w = ds.window_at(c);
+        ok = w < n && !seen[w];
+        seen[w] = 1;
+        c.position++;
+    }
+    c.epoch = 1;
+    c.position = 0;
+    const bool reshuffled = ds.window_at(c) != ds.window_at(DatasetCursor());
+
+    // ranks draw disjoint windows
+    TokenDataset r0, r1;
+    DatasetOptions o0 = opt, o1 = opt;
+    o0.world = o1.world = 2;
+    o1.rank = 1;
+    ok = ok && r0.open(paths, o0) && r1.open(paths, o1);
+    std::fill(seen.begin(), seen.end(), 0);
+    for (DatasetCursor rc; ok && rc.position < r0.epoch_windows(); rc.position++) {
+        for (const TokenDataset* r : {&r0, &r1}) {
+            const uint64_t w = r->window_at(rc);
+            ok = ok && !seen[w];
+            seen[w] = 1;
+        }
+    }
+
+    // background stream == synchronous fill; every target is input + 1
+    const int batch = 16, steps = 3 * static_cast<int>(n / batch) / 2;  // crosses an epoch boundary
+    std::vector<DataBatch> sync(steps);
+    DatasetCursor sc;
+    for (auto& b : sync) ds.fill(b, batch, sc);
+    DatasetCursor mid;
+    {
+        DataLoader loader(ds, batch);
+        for (int i = 0; i < steps && ok; ++i) {
+            const DataBatch& b = loader.next();
+            ok = b.batch.tokens == sync[i].batch.tokens && b.targets == sync[i].targets;
+            for (size_t j = 0; j < b.targets.size() && ok; ++j) ok = b.targets[j] == (b.batch.tokens[j] + 1) % P;
+            if (i == steps / 3) mid = loader.cursor();
+        }
+    }
+
+    // the cursor survives a checkpoint and resumes the same stream
+    {
+        Model tiny(64, 8, 16, 1, 2);
+        const std::string ckpt = "/tmp/carbon_dataset.cb";
+        tiny.save(ckpt, [&](CheckpointWriter& w) { ds.save_cursor(w, mid); });
+        Checkpoint ck;
+        DatasetCursor restored;
+        ok = ok && ck.open(ckpt) && ds.load_cursor(ck, restored) && Model::open(ckpt) != nullptr;
+        DataLoader loader(ds, batch, restored);
+        for (int i = steps / 3 + 1; i < steps && ok; ++i) ok = loader.next().batch.tokens == sync[i].batch.tokens;
+        std::remove(ckpt.c_str());
+    }
+    std::cout << "== dataset (" << n << " windows of 257 tokens in " << n_shards << " shards) ==\n"
+              << "shuffled epoch is a permutation, ranks disjoint, loader == sync fill, resume from checkpoint: "
+              << (ok && reshuffled ? "ok" : "FAILED") << "\n";
+    if (!ok || !reshuffled) bench_ok = false;
+
+    // assembly rate, and stalls behind a small model step
+    DataBatch b;
+    DatasetCursor fc;
+    const double t_fill = time_it([&] { ds.fill(b, batch, fc); });
+    std::cout << "fill " << batch << " x 256:   " << std::fixed << std::setprecision(1) << t_fill * 1e6 << " us ("
+              << batch * 256 / t_fill / 1e6 << " M tokens/s)\n";
+    Model model(65536, 128, 512, 2, 4);
+    auto step = [&](const DataBatch& db) { NoGradGuard ng; (void)model.hidden(db.batch); };
+    const int iters = 50;
+    double t_next = 0, t_step = 0;
+    DataLoader loader(ds, batch);
+    for (int i = 0; i < iters; ++i) {
+        auto t0 = std::chrono::steady_clock::now();
+        const DataBatch& db = loader.next();
+        auto t1 = std::chrono::steady_clock::now();
+        step(db);
+        t_next += std::chrono::duration<double>(t1 - t0).count();
+        t_step += std::chrono::duration<double>(std::chrono::steady_clock::now() - t1).count();
+    }
+    std::cout << "DataLoader: step " << std::setprecision(2) << t_step / iters * 1e3 << " ms, next() "
+              << t_next / iters * 1e6 << " us (" << loader.stalls() << "/" << iters << " calls waited)\n"
+              << std::defaultfloat;
+    for (const auto& p : paths) std::remove(p.c_str());
+}
+
+// ===== Optimizer =====
+// Fused arena AdamW / SGD-momentum against a scalar per-tensor reference,
+// clipping, and the cost of a step next to the old per-tensor SGD loop.
+// Elements with touched[i] == 0 are skipped entirely (lazy sparse rows).
+static void adamw_reference(std::vector<float>& w, std::vector<float>& m, std::vector<float>& v, const std::vector<float>& g,
+                            const std::vector<char>& touched, const OptimizerConfig& c, float lr, bool decay, int t,
+                            float scale) {
+    for (size_t i = 0; i < w.size(); ++i) {
+        if (!touched[i]) continue;
+        const double gi = g[i] * scale;
+        m[i] = c.beta1 * m[i] + (1 - c.beta1) * gi;
+        v[i] = c.beta2 * v[i] + (1 - c.beta2) * gi * gi;
+        const double mh = m[i] / (1 - std::pow(c.beta1, t)), vh = v[i] / (1 - std::pow(c.beta2, t));
+        w[i] = w[i] - lr * (mh / (std::sqrt(vh) + c.eps) + (decay ? c.weight_decay * w[i] : 0.0));
+    }
+}
+
+static void bench_optimizer() {
+    // correctness: 5 steps on a small model vs the scalar reference; the
+    // embedding gets a random quarter of its rows each step (lazy update)
+    Model tiny(300, 48, 96, 2, 4);
+    struct Ref { Tensor* t; std::vector<float> w, m, v; };
+    std::vector<Ref> refs;
+    tiny.parameters([&](const std::string&, Tensor& t) {
+        refs.push_back({&t, std::vector<float>(t.val.begin(), t.val.end()), std::vector<float>(t.val.size()),
+                        std::vector<float>(t.val.size())});
+    });
+    OptimizerConfig cfg;
+    cfg.clip_norm = 0.5f;
+    Optimizer opt(tiny.flatten(), cfg);
+    std::mt19937 rng(3);
+    std::normal_distribution<float> nd(0.0f, 0.05f);
+    float err = 0;
+    for (int t = 1; t <= 5; ++t) {
+        double sq = 0;
+        std::vector<std::vector<float>> grads;
+        std::vector<std::vector<char>> touched;
+        for (auto& r : refs) {
+            grads.emplace_back(r.w.size());
+            touched.emplace_back(r.w.size(), 1);
+            if (r.t == &tiny.emb.table) {
+                const int cols = r.t->cols;
+                for (int row = 0; row < r.t->rows; ++row) {
+                    const bool hit = rng() % 4 == 0;
+                    float* g = hit ? tiny.emb.grad.row(row) : nullptr;
+                    for (int j = 0; j < cols; ++j) {
+                        touched.back()[(size_t)row * cols + j] = hit;
+                        if (hit) g[j] = grads.back()[(size_t)row * cols + j] = nd(rng);
+                    }
+                }
+            } else {
+                for (size_t i = 0; i < r.w.size(); ++i) r.t->grad[i] = grads.back()[i] = nd(rng);
+            }
+            for (float g : grads.back()) sq += (double)g * g;
+        }
+        const float scale = std::sqrt(sq) > cfg.clip_norm ? cfg.clip_norm / (std::sqrt(sq) + 1e-6f) : 1.0f;
+        opt.step(1e-3f);
+        for (size_t k = 0; k < refs.size(); ++k) {
+            Ref& r = refs[k];
+            adamw_reference(r.w, r.m, r.v, grads[k], touched[k], cfg, 1e-3f, r.t->rows > 1, t, scale);
+            for (size_t i = 0; i < r.w.size(); ++i) err = std::max(err, std::abs(r.w[i] - r.t->val[i]));
+        }
+    }
+    bool grads_zeroed = true;
+    for (float g : opt.arena.grad) grads_zeroed = grads_zeroed && g == 0.0f;
+    grads_zeroed = grads_zeroed && tiny.emb.grad.size() == 0 && tiny.emb.table.grad.empty();
+
+    // state round trip: save, reload into a fresh optimizer, one more step on each
+    const std::string ckpt = "/tmp/carbon_optimizer.cb";
+    tiny.save(ckpt, [&](CheckpointWriter& w) { opt.save_state(w); });
+    Model tiny2(300, 48, 96, 2, 4);
+    Checkpoint ck;
+    bool resumed = tiny2.load(ckpt) && ck.open(ckpt);
+    Optimizer opt2(tiny2.flatten(), cfg);
+    resumed = resumed && opt2.load_state(ck) && opt2.t == opt.t;
+    for (size_t i = 0; i < opt.arena.grad.size(); ++i) opt.arena.grad[i] = opt2.arena.grad[i] = 0.01f * (float)(i % 7);
+    for (int row : {3, 17, 250}) {
+        float* g1 = tiny.emb.grad.row(row);
+        float* g2 = tiny2.emb.grad.row(row);
+        for (int j = 0; j < 48; ++j) g1[j] = g2[j] = 0.02f * (float)(j % 5);
+    }
+    opt.step(1e-3f);
+    opt2.step(1e-3f);
+    resumed = resumed && std::equal(opt.arena.val.begin(), opt.arena.val.end(), opt2.arena.val.begin());
+    std::remove(ckpt.c_str());
+
+    std::cout << "== optimizer ==\n"
+              << "AdamW vs scalar reference (5 steps, clipped): max |dw| " << err << ", grads zeroed "
+              << (grads_zeroed ? "yes" : "NO") << ", state resume " << (resumed ? "identical" : "DIFFERS") << "\n";
+    if (err > 1e-5f || !grads_zeroed || !resumed) bench_ok = false;
+
+    // speed: per-tensor SGD (old Model::step) vs arena sweeps, training.cpp widths at 4 layers
+    Model model(32000, 1024, 4096, 4, 16);
+    size_t n = 0;
+    model.parameters([&](const std::string&, Tensor& t) { n += t.val.size(); });
+    const double t_old = time_it([&] { model.step(1e-4f); });
+    OptimizerConfig sgd_cfg;
+    sgd_cfg.kind = OptimizerKind::SGD;
+    sgd_cfg.clip_norm = 0.0f;
+    double t_sgd, t_adam, t_clip;
+    {
+        Optimizer o(model.flatten(), sgd_cfg);
+        t_sgd = time_it([&] { o.step(1e-4f); });
+    }
+    {
+        OptimizerConfig a = cfg;
+        a.clip_norm = 0.0f;
+        Optimizer o(model.flatten(), a);
+        t_adam = time_it([&] { o.step(1e-4f); });
+        o.cfg.clip_norm = 1.0f;
+        t_clip = time_it([&] { o.step(1e-4f); });
+    }
+    std::cout << std::fixed << std::setprecision(2) << n / 1e6 << "M params, " << num_threads() << " threads\n"
+              << "per-tensor SGD (Model::step): " << std::setw(8) << t_old * 1e3 << " ms\n"
+              << "arena SGD + momentum:         " << std::setw(8) << t_sgd * 1e3 << " ms\n"
+              << "arena AdamW:                  " << std::setw(8) << t_adam * 1e3 << " ms ("
+              << n * 16 / t_adam / 1e9 << " GB/s of w/g/m/v)\n"
+              << "arena AdamW + clipping:       " << std::setw(8) << t_clip * 1e3 << " ms\n" << std::defaultfloat;
+
+    LRSchedule s;
+    s.warmup = 100;
+    s.decay_steps = 1000;
+    std::cout << "lr schedule (warmup 100, cosine to 1000): ";
+    for (int64_t step : {0, 50, 99, 100, 550, 999, 2000}) std::cout << step << ":" << s(step) << " ";
+    std::cout << "\n";
+}
+
+// ===== Sparse embedding =====
+// One backward + SGD step of a 50k x 1024 table for a 512-token batch: the
+// old dense grad buffer swept in full vs touched-row accumulation.
+static void bench_embedding() {
+    const int vocab = 50000, dim = 1024, n = 512;
+    Embedding emb(vocab, dim);
+    std::vector<int> tokens(n);
+    std::mt19937 rng(5);
+    for (auto& t : tokens) t = static_cast<int>(std::min<double>(vocab - 1, std::exp(std::uniform_real_distribution<double>(0, std::log(vocab))(rng))));
+    Tensor out = emb.forward(tokens);
+    for (size_t i = 0; i < out.val.size(); ++i) out.val[i] = 1e-3f * (float)(i % 13);
+
+    // reference: dense [vocab x dim] grad, full-table step
+    std::vector<float> table(emb.table.val.begin(), emb.table.val.end()), dense((size_t)vocab * dim, 0.0f);
+    auto dense_step = [&] {
+        for (int i = 0; i < n; ++i)
+            for (int j = 0; j < dim; ++j) dense[(size_t)tokens[i] * dim + j] += out.val[(size_t)i * dim + j];
+        for (size_t i = 0; i < dense.size(); ++i) {
+            table[i] -= 0.1f * dense[i];
+            dense[i] = 0.0f;
+        }
+    };
+    dense_step();
+    emb.backward(out);
+    const size_t touched = emb.grad.size();
+    emb.step(0.1f);
+    const bool same = std::equal(table.begin(), table.end(), emb.table.val.begin());
+
+    const double t_dense = time_it(dense_step);
+    const double t_sparse = time_it([&] { emb.backward(out); emb.step(0.1f); });
+    std::cout << "== embedding (" << vocab << " x " << dim << ", " << n << " tokens, " << touched
+              << " distinct) sparse == dense: " << (same ? "yes" : "NO") << " ==\n"
+              << std::fixed << std::setprecision(3)
+              << "dense grad + full sweep:  " << std::setw(9) << t_dense * 1e3 << " ms, "
+              << std::setprecision(1) << dense.size() * 4 / 1e6 << " MB grad\n" << std::setprecision(3)
+              << "sparse rows:              " << std::setw(9) << t_sparse * 1e3 << " ms, "
+              << std::setprecision(1) << touched * dim * 4 / 1e6 << " MB grad\n" << std::defaultfloat;
+    if (!same) bench_ok = false;
+}
+
+// ===== Data-parallel training =====
+// Every layer's backward checked against central finite differences of the
+// loss on a tiny model (two sequences, one spanning two attention tiles),
+// then the trainer's reduced gradient against one full-batch backward, and
+// throughput by worker count with a fixed 4 sequences per worker.
+static TokenBatch random_batch(int seqs, int len, int vocab, std::vector<int>& targets, std::mt19937& rng) {
+    std::vector<std::vector<int>> s(seqs, std::vector<int>(len));
+    for (auto& q : s)
+        for (auto& t : q) t = (int)(rng() % vocab);
+    targets.resize((size_t)seqs * len);
+    for (auto& t : targets) t = (int)(rng() % vocab);
+    return TokenBatch::pack(s);
+}
+
+static void bench_dataparallel() {
+    std::mt19937 rng(11);
+    float grad_err = 0;
+    int checked = 0, kinked = 0;
+    {
+        const int vocab = 37;
+        Model tiny(vocab, 16, 24, 2, 2);
+        std::uniform_real_distribution<float> init(-0.3f, 0.3f);  // seeded: the check must not depend on the run
+        tiny.parameters([&](const std::string&, Tensor& t) { for (auto& v : t.val) v = init(rng); });
+        for (auto& b : tiny.blocks)
+            for (LayerNorm* ln : {&b.ln1, &b.ln2})
+                for (auto& g : ln->gamma.val) g += 1.0f;
+        tiny.flatten();
+        std::vector<int> targets;
+        TokenBatch batch = TokenBatch::pack({std::vector<int>(70), std::vector<int>(23)});
+        for (auto& t : batch.tokens) t = (int)(rng() % 8);  // few distinct rows: embedding grads add up
+        targets.resize(batch.total());
+        for (auto& t : targets) t = (int)(rng() % vocab);
+        Tensor g;
+        tiny.loss(batch, targets, &g);
+        tiny.backward(std::move(g));
+        // central differences; entries where a ReLU switches inside +-eps
+        // (one-sided slopes disagree) are skipped, the loss is not smooth there
+        NoGradGuard no_grad;
+        const double f0 = tiny.loss(batch, targets);
+        for (const auto& p : tiny.arena.params) {
+            for (int k = 0; k < 4; ++k) {
+                const size_t i = p.sparse ? (size_t)(rng() % 8) * p.t->cols + rng() % p.t->cols : rng() % p.size;
+                const float analytic = p.sparse ? p.sparse->row((int)(i / p.t->cols))[i % p.t->cols] : p.t->grad[i];
+                const float x = p.t->val[i], eps = 3e-3f;
+                p.t->val[i] = x + eps;
+                const double up = tiny.loss(batch, targets);
+                p.t->val[i] = x - eps;
+                const double down = tiny.loss(batch, targets);
+                p.t->val[i] = x;
+                checked++;
+                if (std::abs((up - f0) - (f0 - down)) > 3e-4 * eps) {
+                    kinked++;
+                    continue;
+                }
+                const float numeric = (float)((up - down) / (2 * eps));
+                grad_err = std::max(grad_err, std::abs(analytic - numeric) / (std::abs(numeric) + 1e-2f));
+            }
+        }
+    }
+
+    // reduced gradient vs one full-batch backward
+    const int vocab = 4096, seq = 128;
+    Model model(vocab, 256, 1024, 4, 4);
+    model.flatten();
+    std::vector<int> targets;
+    TokenBatch batch = random_batch(8, 64, vocab, targets, rng);
+    Tensor g;
+    model.loss(batch, targets, &g);
+    model.backward(std::move(g));
+    std::vector<float> ref(model.arena.grad.begin(), model.arena.grad.end());
+    SparseRowGrad ref_emb = model.emb.grad;
+    model.arena.zero_grad();
+    auto diff = [&] {
+        float err = 0, mx = 0;
+        for (size_t i = 0; i < ref.size(); ++i) {
+            err = std::max(err, std::abs(ref[i] - model.arena.grad[i]));
+            mx = std::max(mx, std::abs(ref[i]));
+        }
+        for (size_t k = 0; k < ref_emb.size(); ++k)
+            for (int j = 0; j < ref_emb.cols; ++j)
+                err = std::max(err, std::abs(ref_emb.grad[k * ref_emb.cols + j] - model.emb.grad.row(ref_emb.ids[k])[j]));
+        const bool same_rows = model.emb.grad.size() == ref_emb.size();
+        model.arena.zero_grad();
+        return same_rows ? err / mx : 1.0f;
+    };
+    float split_err = 0;
+    set_num_threads(8);  // workers really run concurrently, even on small machines
+    for (auto cfg : {std::pair<int, int>{1, 8}, {4, 2}, {8, 1}}) {
+        DataParallelTrainer trainer(model, cfg.first);
+        trainer.accumulate(batch, targets, cfg.second);
+        split_err = std::max(split_err, diff());
+    }
+    std::cout << "== dataparallel ==\n"
+              << "backward vs finite differences (" << checked - kinked << " of " << checked
+              << " entries, rest at a ReLU kink): max rel err " << grad_err << "\n"
+              << "reduced grad (1x8, 4x2, 8x1 workers x accum) vs full batch: max rel err " << split_err << "\n";
+    if (grad_err > 3e-2f || kinked > checked / 4 || split_err > 1e-4f) bench_ok = false;
+
+    const int hw = std::max(1u, std::thread::hardware_concurrency());
+    std::vector<int> counts;
+    for (int t = 1; t < hw; t *= 2) counts.push_back(t);
+    counts.push_back(hw);
+    std::cout << "throughput (dim 256, 4 layers, vocab " << vocab << ", seq " << seq << ", 4 sequences per worker; "
+              << hw << " hardware threads):\n";
+    double base = 0;
+    for (int w : counts) {
+        set_num_threads(w);
+        DataParallelTrainer trainer(model, w);
+        batch = random_batch(4 * w, seq, vocab, targets, rng);
+        const double sec = time_it([&] {
+            trainer.accumulate(batch, targets);
+            model.arena.zero_grad();
+        }, 1.0);
+        const double tps = batch.total() / sec;
+        if (w == 1) base = tps;
+        std::cout << std::setw(4) << w << " workers: " << std::fixed << std::setprecision(1) << std::setw(8)
+                  << sec * 1e3 << " ms/step " << std::setprecision(0) << std::setw(9) << tps << " tokens/s "
+                  << std::setprecision(2) << std::setw(6) << tps / base << "x" << std::defaultfloat << "\n";
+    }
+    set_num_threads(0);
+}
+
+// ===== Activation checkpointing =====
+// Gradients with checkpoint_every = k must equal the fully cached ones.
+// Then, per sequence length and k, each configuration runs in a forked
+// child: RSS once the model is built, the peak RSS during steps (loss +
+// backward) after resetting the high-water mark, and the step time.
+static long proc_status_kb(const char* key) {
+    std::ifstream f("/proc/self/status");
+    std::string line;
+    while (std::getline(f, line))
+        if (line.rfind(key, 0) == 0) return std::stol(line.substr(line.find(':') + 1));
+    return 0;
+}
+
+static void bench_checkpointing() {
+    const int vocab = 4096, dim = 256, hidden = 1024, layers = 8, heads = 4;
+    std::mt19937 rng(21);
+    auto train_step = [](Model& m, const TokenBatch& b, const std::vector<int>& targets) {
+        Tensor g;
+        const float loss = m.loss(b, targets, &g);
+        m.backward(std::move(g));
+        return loss;
+    };
+
+    float err = 0;
+    {
+        Model model(vocab, dim, hidden, layers, heads);
+        model.flatten();
+        std::vector<int> targets;
+        TokenBatch b = random_batch(2, 96, vocab, targets, rng);
+        train_step(model, b, targets);
+        std::vector<float> ref(model.arena.grad.begin(), model.arena.grad.end());
+        for (int k : {1, 3}) {
+            model.arena.zero_grad();
+            model.checkpoint_every = k;
+            train_step(model, b, targets);
+            for (size_t i = 0; i < ref.size(); ++i) err = std::max(err, std::abs(ref[i] - model.arena.grad[i]));
+        }
+    }
+    std::cout << "== checkpointing (dim " << dim << ", " << layers << " layers, vocab " << vocab
+              << ") grads vs fully cached: max |dg| " << err << " ==\n"
+              << "   seq   every   model MB   step peak MB   activations MB   ms/step\n";
+    if (err > 0) bench_ok = false;
+
+    for (int seq : {512, 1024, 2048}) {
+        for (int k : {0, 1, 2, 4}) {
+            std::cout.flush();
+            pid_t pid = fork();
+            if (pid == 0) {
+                Model model(vocab, dim, hidden, layers, heads);
+                model.flatten();
+                model.checkpoint_every = k;
+                std::vector<int> targets;
+                TokenBatch b = random_batch(1, seq, vocab, targets, rng);
+                malloc_trim(0);  // construction buffers freed by flatten() leave the RSS
+                const long base = proc_status_kb("VmRSS");
+                std::ofstream("/proc/self/clear_refs") << "5";  // resets VmHWM
+                const double sec = time_it([&] { train_step(model, b, targets); model.arena.zero_grad(); }, 0.5);
+                const long peak = proc_status_kb("VmHWM");
+                std::cout << std::setw(6) << seq << std::setw(8) << (k == 0 ? "off" : std::to_string(k)) << std::fixed
+                          << std::setprecision(1) << std::setw(11) << base / 1024.0 << std::setw(15) << peak / 1024.0
+                          << std::setw(17) << (peak - base) / 1024.0 << std::setw(10) << sec * 1e3 << std::defaultfloat
+                          << "\n";
+                std::cout.flush();
+                _exit(0);
+            }
+            int status = 0;
+            waitpid(pid, &status, 0);
+        }
+    }
+}
+
+// ===== LayerNorm =====
+// The pre-fusion block path: scalar residual add, then the scalar LayerNorm
+// that copied its input and kept mean/var tensors, and its backward.
+struct LayerNormReference {
+    Tensor x_cache, mean_cache, var_cache;
+    Tensor forward(const LayerNorm& ln, const Tensor& x) {
+        x_cache = x;
+        mean_cache = Tensor(x.rows, 1);
+        var_cache = Tensor(x.rows, 1);
+        Tensor y = Tensor::uninit(x.rows, x.cols);
+        parallel_for(0, x.rows, std::max(1, 16384 / std::max(1, x.cols)), [&](int r0, int r1) {
+            for (int i = r0; i < r1; i++) {
+                float mean = 0;
+                for (int j = 0; j < x.cols; j++) mean += x(i, j);
+                mean /= x.cols;
+                float var = 0;
+                for (int j = 0; j < x.cols; j++) var += (x(i, j) - mean) * (x(i, j) - mean);
+                var /= x.cols;
+                mean_cache(i, 0) = mean;
+                var_cache(i, 0) = var;
+                float inv_std = 1.0f / std::sqrt(var + 1e-5f);
+                for (int j = 0; j < x.cols; j++) y(i, j) = (x(i, j) - mean) * inv_std * ln.gamma.val[j] + ln.beta.val[j];
+            }
+        });
+        return y;
+    }
+    Tensor backward(const LayerNorm& ln, const Tensor& grad_out, Buffer& dgamma, Buffer& dbeta) {
+        Tensor grad_in(x_cache.rows, x_cache.cols);
+        float N = x_cache.cols;
+        for (int i = 0; i < x_cache.rows; i++) {
+            float mean = mean_cache(i, 0), var = var_cache(i, 0);
+            float inv_std = 1.0f / std::sqrt(var + 1e-5f);
+            const float* g = &grad_out.val[i * x_cache.cols];
+            float sum_dxhat = 0, sum_dxhat_xhat = 0;
+            for (int j = 0; j < x_cache.cols; j++) {
+                float xhat = (x_cache(i, j) - mean) * inv_std;
+                float dxhat = g[j] * ln.gamma.val[j];
+                dgamma[j] += g[j] * xhat;
+                dbeta[j] += g[j];
+                sum_dxhat += dxhat;
+                sum_dxhat_xhat += dxhat * xhat;
+            }
+            for (int j = 0; j < x_cache.cols; j++) {
+                float xhat = (x_cache(i, j) - mean) * inv_std;
+                float dxhat = g[j] * ln.gamma.val[j];
+                grad_in.val[i * x_cache.cols + j] = inv_std * (dxhat - sum_dxhat / N - xhat * sum_dxhat_xhat / N);
+            }
+        }
+        return grad_in;
+    }
+};
+
+static void bench_layernorm() {
+    std::cout << "== layernorm (residual add + LayerNorm forward, backward; reference = scalar pre-fusion path) ==\n"
+              << "  rows   dim    ref fwd ms  fused fwd ms  speedup    ref bwd ms  fused bwd ms  speedup   max rel err\n";
+    for (auto shape : {std::pair<int, int>{256, 1024}, {2048, 1024}, {2048, 4096}}) {
+        const int rows = shape.first, dim = shape.second;
+        LayerNorm ln(dim);
+        ln.gamma.randomize(1.0f);
+        ln.beta.randomize(1.0f);
+        Tensor a(rows, dim), r(rows, dim), g(rows, dim);
+        a.randomize(2.0f);
+        r.randomize(1.0f);
+        g.randomize(1.0f);
+        for (int j = 0; j < dim; ++j) a.val[j] += 50.0f;  // one row far from zero mean
+
+        LayerNormReference ref;
+        Tensor s_ref = a;
+        auto ref_forward = [&] {
+            s_ref = a;
+            for (size_t i = 0; i < s_ref.val.size(); i++) s_ref.val[i] += r.val[i];
+            return ref.forward(ln, s_ref);
+        };
+        Tensor s = a;
+        auto fused_forward = [&] {
+            std::copy(a.val.begin(), a.val.end(), s.val.begin());
+            return ln.forward_residual(s, r);
+        };
+        Tensor y_ref = ref_forward(), y = fused_forward();
+        Buffer dgamma(dim, 0.0f), dbeta(dim, 0.0f);
+        Tensor dx_ref = ref.backward(ln, g, dgamma, dbeta);
+        ln.gamma.zero_grad();
+        ln.beta.zero_grad();
+        Tensor dx = ln.backward(g, s);
+        const float err = std::max({max_rel_err(y_ref.val, y.val), max_rel_err(s_ref.val, s.val),
+                                    max_rel_err(dx_ref.val, dx.val), max_rel_err(dgamma, ln.gamma.grad),
+                                    max_rel_err(dbeta, ln.beta.grad)});
+
+        // timed in a workspace, as in a training step, so page faults on
+        // fresh outputs do not drown the kernels
+        Workspace ws;
+        auto in_ws = [&](auto fn) {
+            return [&ws, fn] {
+                ws.reset();
+                WorkspaceScope scope(ws);
+                fn();
+            };
+        };
+        const double t_rf = time_it(in_ws(ref_forward)), t_ff = time_it(in_ws(fused_forward));
+        const double t_rb = time_it(in_ws([&] { ref.backward(ln, g, dgamma, dbeta); }));
+        const double t_fb = time_it(in_ws([&] { ln.backward(g, s); }));
+        std::cout << std::setw(6) << rows << std::setw(6) << dim << std::fixed << std::setprecision(3)
+                  << std::setw(14) << t_rf * 1e3 << std::setw(14) << t_ff * 1e3 << std::setprecision(1) << std::setw(8)
+                  << t_rf / t_ff << "x" << std::setprecision(3) << std::setw(14) << t_rb * 1e3 << std::setw(14)
+                  << t_fb * 1e3 << std::setprecision(1) << std::setw(8) << t_rb / t_fb << "x" << std::defaultfloat
+                  << std::setprecision(2) << std::setw(14) << err << std::setprecision(6) << "\n";
+        if (err > 1e-3f) bench_ok = false;
+    }
+}
+
+// ===== Fused FeedForward =====
+// The pre-fusion MLP path: l1, a scalar activation over the materialized
+// [rows x hidden] pre-activation, l2; training kept the pre-activation and
+// (as l2's input) the activation output.
+static double activation_reference(Activation act, double x, double up) {
+    const double s = 1.0 / (1.0 + std::exp(-x));
+    switch (act) {
+    case Activation::ReLU: return std::max(0.0, x);
+    case Activation::GELU: return 0.5 * x * (1.0 + std::tanh(0.7978845608 * (x + 0.044715 * x * x * x)));
+    case Activation::SiLU: return x * s;
+    default: return x * s * up;
+    }
+}
+
+struct FeedForwardReference {
+    Tensor pre_cache;
+    Tensor forward(FeedForward& ff, const Tensor& x) {
+        Tensor pre = ff.l1.forward(x);
+        Tensor a(x.rows, ff.hidden);
+        for (int i = 0; i < x.rows; i++)
+            for (int j = 0; j < ff.hidden; j++)
+                a(i, j) = (float)activation_reference(ff.act, pre(i, j), ff.act == Activation::SwiGLU ? pre(i, ff.hidden + j) : 0.0);
+        if (grad_enabled()) pre_cache = pre;
+        return ff.l2.forward(a);
+    }
+};
+
+static void bench_ffn() {
+    std::cout << "== ffn (fused MLP vs unfused reference; backward vs finite differences) ==\n"
+              << "  activation  rows   fwd max rel err   dx max rel err (FD)\n";
+    const char* names[] = {"relu", "gelu", "silu", "swiglu"};
+    std::mt19937 rng(7);
+    for (int a = 0; a < 4; ++a) {
+        const Activation act = static_cast<Activation>(a);
+        for (int rows : {200, 3}) {
+            // hidden 300: a partial FF_HC chunk and scalar activation tails
+            FeedForward ff(96, 300, act);
+            ff.l1.W.randomize(0.2f);
+            ff.l1.b.randomize(0.5f);
+            ff.l2.W.randomize(0.2f);
+            ff.l2.b.randomize(0.5f);
+            Tensor x(rows, 96), r(rows, 96);
+            std::uniform_real_distribution<float> u(-1.0f, 1.0f);
+            for (auto& v : x.val) v = u(rng);
+            for (auto& v : r.val) v = u(rng);
+            float fwd_err;
+            {
+                NoGradGuard no_grad;
+                FeedForwardReference ref;
+                fwd_err = max_rel_err(ref.forward(ff, x).val, ff.forward(x).val);
+            }
+            // dL/dx against central differences on a few inputs
+            Tensor g = r;
+            ff.forward(x);
+            Tensor dx = ff.backward(g);
+            // L = sum(y * r); mask = the row's l1 signs, to spot ReLU kinks
+            auto loss = [&](int row, std::vector<bool>& mask) {
+                NoGradGuard no_grad;
+                Tensor y = ff.forward(x);
+                double s = 0;
+                for (size_t i = 0; i < y.val.size(); i++) s += (double)y.val[i] * r.val[i];
+                Tensor pre = ff.l1.forward(x);
+                mask.resize(ff.hidden);
+                for (int j = 0; j < ff.hidden; j++) mask[j] = pre(row, j) > 0;
+                return s;
+            };
+            const float eps = 1e-2f;
+            float dx_err = 0;
+            std::vector<bool> mask_p, mask_m;
+            for (int k = 0; k < 24; ++k) {
+                const size_t i = rng() % x.val.size();
+                const int row = (int)(i / x.cols);
+                const float v = x.val[i];
+                x.val[i] = v + eps;
+                const double lp = loss(row, mask_p);
+                x.val[i] = v - eps;
+                const double lm = loss(row, mask_m);
+                x.val[i] = v;
+                const double fd = (lp - lm) / (2 * eps);
+                if (act == Activation::ReLU && mask_p != mask_m) continue;  // crosses a kink
+                dx_err = std::max(dx_err, (float)(std::abs(fd - dx.val[i]) / std::max(1e-2, std::abs(fd))));
+            }
+            std::cout << std::setw(12) << names[a] << std::setw(6) << rows << std::setprecision(2) << std::setw(18)
+                      << fwd_err << std::setw(22) << dx_err << std::setprecision(6) << "\n";
+            if (fwd_err > 1e-4f || dx_err > 3e-2f) bench_ok = false;
+        }
+    }
+
+    std::cout << "  d=1024 h=4096    ref inf ms  fused inf ms  speedup   ref train ms  fused train ms  speedup"
+                 "   ref tmp MB  fused tmp MB   ref keep MB  fused keep MB\n";
+    for (Activation act : {Activation::ReLU, Activation::SwiGLU}) {
+        for (int rows : {256, 1024}) {
+            const int d = 1024, h = 4096;
+            FeedForward ff(d, h, act);
+            ff.l1.W.randomize(0.05f);
+            ff.l2.W.randomize(0.05f);
+            Tensor x(rows, d), g(rows, d);
+            x.randomize(1.0f);
+            g.randomize(1.0f);
+            FeedForwardReference ref;
+            Workspace ws;
+            auto in_ws = [&](auto fn) {
+                return [&ws, fn] {
+                    ws.reset();
+                    WorkspaceScope scope(ws);
+                    fn();
+                };
+            };
+            double t_ri, t_fi;
+            {
+                NoGradGuard no_grad;
+                t_ri = time_it(in_ws([&] { ref.forward(ff, x); }));
+                t_fi = time_it(in_ws([&] { ff.forward(x); }));
+            }
+            // reference backward: the pre-fusion code path (l2, activation
+            // derivative from the kept pre-activation, l1)
+            const double t_rt = time_it(in_ws([&] {
+                ref.forward(ff, x);
+                Tensor da = ff.l2.backward(g);
+                const bool glu = act == Activation::SwiGLU;
+                Tensor dpre = Tensor::uninit(rows, ff.l1.W.cols);
+                for (int i = 0; i < rows; i++) {
+                    const float* p = &ref.pre_cache.val[(size_t)i * dpre.cols];
+                    float* dp = &dpre.val[(size_t)i * dpre.cols];
+                    activation_backward(act, p, glu ? p + h : nullptr, &da.val[(size_t)i * h], dp, glu ? dp + h : nullptr, h);
+                }
+                ff.l1.backward(dpre);
+            }));
+            const double t_ft = time_it(in_ws([&] {
+                ff.forward(x);
+                ff.backward(g);
+            }));
+            const double mb = 1.0 / (1 << 20);
+            const size_t pre_bytes = (size_t)rows * ff.l1.W.cols * sizeof(float), a_bytes = (size_t)rows * h * sizeof(float);
+            // per-thread tiles plus one chunk's packed W1 (and up) and W2 panels
+            const size_t packed = gemm_packed_size(d, FF_HC) * (act == Activation::SwiGLU ? 2 : 1) + gemm_packed_size(FF_HC, d);
+            const size_t tile_bytes = ((size_t)num_threads() * 2 * GEMM_MC * FF_HC + packed) * sizeof(float);
+            // l1's input is kept by both paths; the fused one adds only the ReLU sign mask
+            const size_t keep_bytes = act == Activation::ReLU ? (size_t)rows * ff.mask_words() * sizeof(uint64_t) : 0;
+            std::cout << std::setw(8) << names[(int)act] << std::setw(6) << rows << std::fixed << std::setprecision(2)
+                      << std::setw(14) << t_ri * 1e3 << std::setw(14) << t_fi * 1e3 << std::setprecision(2) << std::setw(8)
+                      << t_ri / t_fi << "x" << std::setw(15) << t_rt * 1e3 << std::setw(16) << t_ft * 1e3 << std::setw(8)
+                      << t_rt / t_ft << "x" << std::setprecision(1) << std::setw(13) << (pre_bytes + a_bytes) * mb
+                      << std::setw(14) << tile_bytes * mb << std::setw(14) << (pre_bytes + a_bytes) * mb << std::setw(15)
+                      << keep_bytes * mb << std::defaultfloat << std::setprecision(6) << "\n";
+        }
+    }
+}
+
+// ===== Kernel dispatch =====
+// Every kernel variant this CPU can run against the scalar one, plus its
+// throughput. End to end, CARBON_ISA=scalar|avx2 reruns any other suite
+// on a narrower ISA.
+static void bench_kernels() {
+    const Isa detected = cpu_detect_isa(), active = kernels().isa;  // reports a bad CARBON_ISA first
+    std::cout << "== kernels (detected " << isa_name(detected) << ", active " << isa_name(active)
+              << "; errors vs scalar) ==\n"
+              << "  kernel                    isa     max rel err    throughput\n";
+    std::mt19937 rng(11);
+    std::uniform_real_distribution<float> u(-1.0f, 1.0f);
+    auto random_buf = [&](size_t n, float scale) {
+        Buffer b(n, 0.0f);
+        for (size_t i = 0; i < n; ++i) b[i] = scale * u(rng);
+        return b;
+    };
+    const int n = 4099;      // not a multiple of any vector width
+    const int wide = 50003;  // an LM-head row
+    const int kc = 255;      // odd: exercises the AVX-512 kernel's k tail
+    const Buffer a = random_buf(n, 1.0f), b = random_buf(n, 1.0f), r = random_buf(n, 1.0f), g = random_buf(n, 1.0f);
+    const Buffer gamma = random_buf(n, 1.0f), beta = random_buf(n, 1.0f), logits = random_buf(wide, 8.0f);
+    float* pa = static_cast<float*>(std::aligned_alloc(64, sizeof(float) * GEMM_MR * kc));
+    float* pb = static_cast<float*>(std::aligned_alloc(64, sizeof(float) * GEMM_NR * kc));
+    for (int i = 0; i < GEMM_MR * kc; ++i) pa[i] = u(rng);
+    for (int i = 0; i < GEMM_NR * kc; ++i) pb[i] = u(rng);
+    const Buffer c0 = random_buf(GEMM_MR * 20, 1.0f);  // ldc 20
+
+    // outputs of one table: [dot, gemm (load_c, then not), softmax, ln fwd (y, s, stats), ln bwd (dx, dgamma, dbeta), add, scale]
+    using Vec = std::vector<float>;
+    struct Out { Vec dot, gemm, softmax, ln, ln_bwd, add; };
+    auto run = [&](const Kernels& k) {
+        Out o;
+        o.dot = {k.dot(a.data(), b.data(), n)};
+        o.gemm.assign(c0.begin(), c0.end());
+        k.gemm_micro(kc, pa, pb, o.gemm.data(), 20, true);
+        Vec c1(GEMM_MR * 20, 0.0f);
+        k.gemm_micro(kc, pa, pb, c1.data(), 20, false);
+        o.gemm.insert(o.gemm.end(), c1.begin(), c1.end());
+        o.softmax.assign(logits.begin(), logits.end());
+        k.softmax_row(o.softmax.data(), wide);
+        o.ln.assign(2 * n + 2, 0.0f);
+        k.layernorm_row(a.data(), r.data(), o.ln.data() + n, o.ln.data(), gamma.data(), beta.data(), n, 1e-5f,
+                        &o.ln[2 * n], &o.ln[2 * n + 1]);
+        o.ln_bwd.assign(3 * n, 0.5f);
+        k.layernorm_backward_row(a.data(), g.data(), gamma.data(), 0.1f, 1.3f, o.ln_bwd.data(), o.ln_bwd.data() + n,
+                                 o.ln_bwd.data() + 2 * n, n);
+        o.add.assign(a.begin(), a.end());
+        k.add(o.add.data(), b.data(), n);
+        k.scale(o.add.data(), 0.75f, n);
+        return o;
+    };
+    const Out ref = run(kernels_for(Isa::Scalar));
+    auto rel_err = [](const Vec& want, const Vec& got) {
+        float err = 0, scale = 1e-6f;
+        for (size_t i = 0; i < want.size(); ++i) {
+            err = std::max(err, std::fabs(want[i] - got[i]));
+            scale = std::max(scale, std::fabs(want[i]));
+        }
+        return err / scale;
+    };
+
+    for (int i = 0; i <= static_cast<int>(detected); ++i) {
+        const Kernels k = kernels_for(static_cast<Isa>(i));
+        const Out o = run(k);
+        Buffer scratch = logits, y(n, 0.0f), s(n, 0.0f), dx(3 * n, 0.0f);
+        float mean, rstd;
+        const double t_dot = time_it([&] { volatile float v = k.dot(a.data(), b.data(), n); (void)v; }, 0.1);
+        const double t_gemm = time_it([&] { k.gemm_micro(kc, pa, pb, scratch.data(), 20, true); }, 0.1);
+        const double t_soft = time_it([&] { k.softmax_row(scratch.data(), wide); }, 0.1);
+        const double t_ln = time_it([&] {
+            k.layernorm_row(a.data(), r.data(), s.data(), y.data(), gamma.data(), beta.data(), n, 1e-5f, &mean, &rstd);
+        }, 0.1);
+        const double t_lnb = time_it([&] {
+            k.layernorm_backward_row(a.data(), g.data(), gamma.data(), 0.1f, 1.3f, dx.data(), dx.data() + n,
+                                     dx.data() + 2 * n, n);
+        }, 0.1);
+        const double t_add = time_it([&] { k.add(y.data(), b.data(), n); }, 0.1);
+        struct Row { const char* name; float err; double value; const char* unit; };
+        const double gb = 1e-9;
+        const Row rows[] = {
+            {"dot", rel_err(ref.dot, o.dot), 8.0 * n / t_dot * gb, "GB/s"},
+            {"gemm micro-kernel 6x16", rel_err(ref.gemm, o.gemm), 2.0 * GEMM_MR * GEMM_NR * kc / t_gemm * gb, "GFLOP/s"},
+            {"softmax row (50k)", rel_err(ref.softmax, o.softmax), 12.0 * wide / t_soft * gb, "GB/s"},
+            {"layernorm row (+res)", rel_err(ref.ln, o.ln), 20.0 * n / t_ln * gb, "GB/s"},
+            {"layernorm backward row", rel_err(ref.ln_bwd, o.ln_bwd), 36.0 * n / t_lnb * gb, "GB/s"},
+            {"add / scale", rel_err(ref.add, o.add), 12.0 * n / t_add * gb, "GB/s (add)"},
+        };
+        for (const Row& row : rows) {
+            std::cout << "  " << std::left << std::setw(26) << row.name << std::setw(8) << isa_name(k.isa) << std::right
+                      << std::setprecision(2) << std::setw(11) << row.err << std::fixed << std::setprecision(1)
+                      << std::setw(14) << row.value << " " << row.unit << std::defaultfloat << std::setprecision(6)
+                      << "\n";
+            if (row.err > 1e-4f) bench_ok = false;
+        }
+    }
+    std::free(pa);
+    std::free(pb);
+}
+
+// ===== Performance baselines =====
+// Fixed, named measurements whose p50 latency is tracked across commits:
+//
+//   ./carbon_bench perf --json baseline.json              # record
+//   ./carbon_bench perf --baseline baseline.json          # compare, exit 1 on a regression
+//
+// Each entry reports latency percentiles plus GFLOP/s and GB/s from its
+// nominal FLOP and byte counts (compulsory traffic, not cache misses).
+// Baselines are per machine: record one on the host that compares.
+struct PerfResult {
+    std::string name;
+    Latency lat;
+    double flops = 0, bytes = 0;  // per call
+    double rate = 0;              // optional domain throughput
+    std::string rate_unit;
+};
+static std::vector<PerfResult> perf_results;
+
+static void perf_record(const std::string& name, const Latency& lat, double flops, double bytes,
+                        double rate = 0, const std::string& rate_unit = "") {
+    perf_results.push_back({name, lat, flops, bytes, rate, rate_unit});
+    const PerfResult& r = perf_results.back();
+    std::cout << "  " << std::left << std::setw(34) << name << std::right << std::fixed << std::setprecision(3)
+              << std::setprecision(1)
+              << std::setw(12) << lat.p50 * 1e6 << std::setw(12) << lat.p90 * 1e6 << std::setw(12) << lat.p99 * 1e6 << std::setw(10) << (flops > 0 ? flops / lat.p50 * 1e-9 : 0.0) << std::setw(9)
+              << (bytes > 0 ? bytes / lat.p50 * 1e-9 : 0.0) << std::setw(7) << lat.samples;
+    if (r.rate > 0) std::cout << "   " << std::setprecision(1) << r.rate << " " << r.rate_unit;
+    std::cout << std::defaultfloat << std::setprecision(6) << "\n";
+}
+
+static void bench_perf() {
+    std::cout << "== perf (" << isa_name(kernels().isa) << ", " << num_threads() << " threads) ==\n"
+              << "  " << std::left << std::setw(34) << "name" << std::right << std::setw(12) << "p50 us" << std::setw(12)
+              << "p90 us" << std::setw(12) << "p99 us" << std::setw(10) << "GFLOP/s" << std::setw(9) << "GB/s"
+              << std::setw(7) << "n" << "\n";
+    const double F = sizeof(float);
+    {
+        const int rows = 256, in = 1024, out = 4096;
+        Linear l(in, out);
+        Tensor x(rows, in), g(rows, out);
+        x.randomize(1.0f);
+        g.randomize(1.0f);
+        l.forward(x);  // caches x
+        perf_record("linear backward 256x1024x4096", sample_it([&] { l.backward(g); }, 0.2), 4.0 * rows * in * out,
+                    F * (2.0 * in * out + 2.0 * rows * in + (double)rows * out));
+    }
+
+    NoGradGuard no_grad;
+
+    // Tensor::matmul at the main.cpp and training.cpp shapes
+    struct Shape { int M, K, N; };
+    for (const Shape& s : {Shape{64, 256, 512}, Shape{256, 1024, 1024}, Shape{256, 1024, 4096}, Shape{256, 4096, 1024}}) {
+        Tensor A(s.M, s.K), B(s.K, s.N);
+        A.randomize(1.0f);
+        B.randomize(1.0f);
+        perf_record("matmul " + std::to_string(s.M) + "x" + std::to_string(s.K) + "x" + std::to_string(s.N),
+                    sample_it([&] { Tensor::matmul(A, B); }, 0.2), 2.0 * s.M * s.K * s.N,
+                    F * ((double)s.M * s.K + (double)s.K * s.N + (double)s.M * s.N));
+    }
+
+    {
+        const int n = 4096;
+        Tensor a(1, n), b(1, n);
+        a.randomize(1.0f);
+        b.randomize(1.0f);
+        volatile float sink = 0;
+        perf_record("dot_simd 4096", sample_it([&] { sink = Tensor::dot_simd(a.val.data(), b.val.data(), n); }, 0.2, 10, 1000),
+                    2.0 * n, 2 * F * n);
+        (void)sink;
+    }
+
+    // causal self-attention, projections included
+    for (int seq : {256, 1024, 2048}) {
+        const int dim = 1024, heads = 16;
+        MultiHeadAttention mha(dim, heads);
+        Tensor x(seq, dim);
+        x.randomize(1.0f);
+        const double flops = 8.0 * seq * dim * dim + 2.0 * seq * seq * dim;  // 4 projections + QK^T, PV (causal half)
+        perf_record("mha forward seq " + std::to_string(seq), sample_it([&] { mha.forward(x); }, 0.2), flops,
+                    F * (4.0 * dim * dim + 6.0 * seq * dim));
+    }
+
+    {
+        const int rows = 2048, dim = 1024;
+        LayerNorm ln(dim);
+        Tensor x(rows, dim);
+        x.randomize(1.0f);
+        perf_record("layernorm 2048x1024", sample_it([&] { ln.forward(x); }, 0.2), 8.0 * rows * dim, 2 * F * rows * dim);
+    }
+
+    {
+        Tensor logits(64, 50000);
+        logits.randomize(4.0f);
+        perf_record("softmax 64x50000", sample_it([&] { logits = softmax(std::move(logits)); }, 0.2),
+                    4.0 * logits.val.size(), 3 * F * logits.val.size());
+    }
+
+    {
+        const int vocab = 8192, dim = 512, layers = 4, seq = 256;
+        Model model(vocab, dim, 4 * dim, layers, 8);
+        std::vector<int> tokens(seq);
+        for (int i = 0; i < seq; ++i) tokens[i] = (i * 131) % vocab;
+        const Latency lat = sample_it([&] { model.forward(tokens); }, 0.5, 5);
+        const double flops = 2.0 * seq * (layers * 12.0 * dim * dim + (double)dim * vocab) + 2.0 * layers * seq * seq * dim;
+        perf_record("model forward d512 L4 seq256", lat, flops, F * (layers * 12.0 * dim * dim + 2.0 * dim * vocab),
+                    seq / lat.p50, "tokens/s");
+    }
+
+    {
+        const std::string path = "/tmp/carbon_perf_corpus.txt";
+        write_corpus(path, 4 << 20);
+        std::ifstream f(path);
+        const std::string text((std::istreambuf_iterator<char>(f)), std::istreambuf_iterator<char>());
+        std::remove(path.c_str());
+        const double mb = text.size() / 1e6;
+        const Latency train = sample_it([&] { BPETokenizer t; t.train_from_string(text, 4000, false); }, 0.0, 3);
+        perf_record("bpe train 4MB vocab 4000", train, 0, (double)text.size(), mb / train.p50, "MB/s");
+        BPETokenizer tok;
+        tok.train_from_string(text, 4000, false);
+        const Latency enc = sample_it([&] { (void)tok.encode(text, nullptr); }, 0.0, 5);
+        perf_record("bpe encode 4MB", enc, 0, (double)text.size(), mb / enc.p50, "MB/s");
+    }
+}
+
+static std::string json_escape(const std::string& s) {
+    std::string out;
+    for (char c : s) {
+        if (c == '"' || c == '\\') out += '\\';
+        out += c;
+    }
+    return out;
+}
+
+static bool write_perf_json(const std::string& path) {
+    std::ofstream f(path);
+    if (!f) {
+        std::cerr << "[BENCH] Error: cannot write " << path << "\n";
+        return false;
+    }
+    f << std::setprecision(9) << "{\n  \"isa\": \"" << isa_name(kernels().isa) << "\",\n  \"threads\": " << num_threads()
+      << ",\n  \"results\": [\n";
+    for (size_t i = 0; i < perf_results.size(); ++i) {
+        const PerfResult& r = perf_results[i];
+        f << "    {\"name\": \"" << json_escape(r.name) << "\", \"p50_ms\": " << r.lat.p50 * 1e3
+          << ", \"p90_ms\": " << r.lat.p90 * 1e3 << ", \"p99_ms\": " << r.lat.p99 * 1e3
+          << ", \"mean_ms\": " << r.lat.mean * 1e3 << ", \"samples\": " << r.lat.samples
+          << ", \"gflops\": " << (r.flops > 0 ? r.flops / r.lat.p50 * 1e-9 : 0.0)
+          << ", \"gbs\": " << (r.bytes > 0 ? r.bytes / r.lat.p50 * 1e-9 : 0.0);
+        if (r.rate > 0) f << ", \"rate\": " << r.rate << ", \"rate_unit\": \"" << json_escape(r.rate_unit) << "\"";
+        f << "}" << (i + 1 < perf_results.size() ? "," : "") << "\n";
+    }
+    f << "  ]\n}\n";
+    return static_cast<bool>(f);
+}
+
+// name -> p50_ms from a file written by write_perf_json (not a general
+// JSON parser: it only reads that layout).
+static bool read_perf_baseline(const std::string& path, std::vector<std::pair<std::string, double>>& out) {
+    std::ifstream f(path);
+    if (!f) {
+        std::cerr << "[BENCH] Error: cannot read baseline " << path << "\n";
+        return false;
+    }
+    const std::string text((std::istreambuf_iterator<char>(f)), std::istreambuf_iterator<char>());
+    const std::string name_key = "\"name\": \"", p50_key = "\"p50_ms\": ";
+    for (size_t pos = text.find(name_key); pos != std::string::npos; pos = text.find(name_key, pos)) {
+        pos += name_key.size();
+        std::string name;
+        for (; pos < text.size() && text[pos] != '"'; ++pos) {
+            if (text[pos] == '\\' && pos + 1 < text.size()) ++pos;
+            name += text[pos];
+        }
+        const size_t v = text.find(p50_key, pos);
+        if (v == std::string::npos) break;
+        out.emplace_back(name, std::strtod(text.c_str() + v + p50_key.size(), nullptr));
+    }
+    if (out.empty()) {
+        std::cerr << "[BENCH] Error: no results in baseline " << path << "\n";
+        return false;
+    }
+    return true;
+}
+
+// Fails the run when an entry's p50 is more than `tolerance` slower than
+// the baseline's. Entries missing on either side are listed, not failed.
+static void compare_perf_baseline(const std::string& path, double tolerance) {
+    std::vector<std::pair<std::string, double>> base;
+    if (!read_perf_baseline(path, base)) {
+        bench_ok = false;
+        return;
+    }
+    std::cout << "== perf vs " << path << " (fail above +" << std::setprecision(3) << tolerance * 100
+              << "% p50) ==\n";
+    int regressions = 0;
+    for (const auto& b : base) {
+        auto it = std::find_if(perf_results.begin(), perf_results.end(), [&](const PerfResult& r) { return r.name == b.first; });
+        std::cout << "  " << std::left << std::setw(34) << b.first << std::right;
+        if (it == perf_results.end()) {
+            std::cout << "   not measured\n";
+            continue;
+        }
+        const double now = it->lat.p50 * 1e3, ratio = now / b.second;
+        const bool regressed = ratio > 1.0 + tolerance;
+        regressions += regressed;
+        std::cout << std::fixed << std::setprecision(1) << std::setw(12) << b.second * 1e3 << " ->" << std::setw(12)
+                  << now * 1e3 << " us" << std::showpos << std::setprecision(1) << std::setw(9) << (ratio - 1.0) * 100 << "%"
+                  << std::noshowpos << (regressed ? "   REGRESSION" : "") << std::defaultfloat << "\n";
+    }
+    for (const PerfResult& r : perf_results)
+        if (std::none_of(base.begin(), base.end(), [&](const auto& b) { return b.first == r.name; }))
+            std::cout << "  " << std::left << std::setw(34) << r.name << std::right << "   not in baseline\n";
+    std::cout << std::setprecision(6);
+    if (regressions > 0) {
+        std::cout << regressions << " regression(s)\n";
+        bench_ok = false;
+    }
+}
+
+// ===== Profiler =====
+// A training step with the profiler idle and recording. Checks that every
+// block shows up once per layer in forward and backward, and that self
+// times add up to the top-level scopes.
+static void bench_profile() {
+    const int vocab = 2048, dim = 256, hidden = 1024, layers = 4, heads = 4, seq = 128, seqs = 4;
+    Model model(vocab, dim, hidden, layers, heads);
+    Optimizer opt(model.flatten(), OptimizerConfig());
+    TokenBatch batch;
+    std::vector<int> targets;
+    for (int b = 0; b < seqs; ++b) {
+        std::vector<int> s(seq);
+        for (int i = 0; i < seq; ++i) { s[i] = (b * 977 + i * 131) % vocab; targets.push_back((s[i] + 1) % vocab); }
+        batch.add(s);
+    }
+    auto train_step = [&] {
+        Tensor g;
+        model.loss(batch, targets, &g);
+        model.backward(std::move(g));
+        opt.step(1e-4f);
+    };
+    train_step();
+    const double t_idle = time_it(train_step, 1.0);
+
+    std::cout << "== profile (dim " << dim << ", " << layers << " layers, " << seqs << " x " << seq
+              << " tokens, train step) ==\n";
+#ifdef CARBON_PROFILE
+    profiler().start();
+    const double t_on = time_it(train_step, 1.0);
+    profiler().start();
+    train_step();
+    profiler().stop();
+    profiler().report(std::cout);
+    const bool wrote = profiler().write_chrome_trace("/tmp/carbon_profile_trace.json");
+
+    std::vector<int> fwd(layers), bwd(layers);
+    uint64_t self = 0, top = 0;
+    for (const ProfileEvent& e : profiler().events()) {
+        if (e.worker) continue;
+        const std::string name = e.name;
+        if (name == "block.forward" && e.layer >= 0 && e.layer < layers) fwd[e.layer]++;
+        if (name == "block.backward" && e.layer >= 0 && e.layer < layers) bwd[e.layer]++;
+        if (name == "model.forward" || name == "loss" || name == "model.backward" || name == "optimizer.step")
+            top += e.dur_ns;
+        self += e.self_ns;
+    }
+    bool layers_ok = true;
+    for (int l = 0; l < layers; ++l) layers_ok &= fwd[l] == 1 && bwd[l] == 1;
+    const bool self_ok = top > 0 && self == top;
+    std::cout << "step time: " << std::fixed << std::setprecision(2) << t_idle * 1e3 << " ms idle, " << t_on * 1e3
+              << " ms recording (" << std::setprecision(1) << 100.0 * (t_on / t_idle - 1.0) << "% overhead)\n"
+              << std::defaultfloat << "one block.forward/backward per layer: " << (layers_ok ? "PASS" : "FAIL") << "\n"
+              << "self times sum to top-level scopes: " << (self_ok ? "PASS" : "FAIL") << "\n"
+              << "chrome trace: " << (wrote ? "/tmp/carbon_profile_trace.json" : "FAIL") << "\n";
+    if (!layers_ok || !self_ok || !wrote) bench_ok = false;
+#else
+    std::cout << "step time: " << std::fixed << std::setprecision(2) << t_idle * 1e3 << " ms\n" << std::defaultfloat;
+    profiler().report(std::cout);
+#endif
+}
+
+// ===== Thread scaling =====
+// Each hot loop on the shared pool, from 1 thread up to every hardware thread.
+static void bench_threads() {
+    const int hw = std::max(1u, std::thread::hardware_concurrency());
+    std::vector<int> counts;
+    for (int t = 1; t < hw; t *= 2) counts.push_back(t);
+    counts.push_back(hw);
+
+    const int M = 512, K = 1024, N = 4096, seq = 2048, dim = 1024, heads = 16, vocab = 32000;
+    Tensor A(M, K), B(K, N), C(M, N);
+    A.randomize(1.0f);
+    B.randomize(1.0f);
+    Tensor Q(seq, dim), Kt(seq, dim), V(seq, dim), O(seq, dim), X(seq, dim), logits(64, vocab);
+    Q.randomize(1.0f);
+    Kt.randomize(1.0f);
+    V.randomize(1.0f);
+    X.randomize(1.0f);
+    logits.randomize(4.0f);
+    LayerNorm ln(dim);
+    Linear big(dim, 4 * dim);
+    Model model(4096, 256, 1024, 4, 4);
+    std::vector<int> tokens(256);
+    for (int i = 0; i < (int)tokens.size(); ++i) tokens[i] = (i * 131) % 4096;
+
+    struct Row { const char* name; std::function<void()> fn; double base = 0; };
+    std::vector<Row> rows;
+    rows.push_back({"gemm 512x1024x4096", [&] { gemm(M, N, K, A.val.data(), K, B.val.data(), N, C.val.data(), N); }});
+    rows.push_back({"attention 2k causal", [&] {
+        flash_attention(Q.val.data(), Kt.val.data(), V.val.data(), O.val.data(), seq, dim, heads, dim / heads, true);
+    }});
+    rows.push_back({"layernorm 2k x 1024", [&] { NoGradGuard ng; ln.forward(X); }});
+    rows.push_back({"softmax 64 x 32000", [&] { softmax(logits); }});
+    rows.push_back({"sgd step 4M params", [&] { big.step(1e-4f); }});
+    rows.push_back({"forward dim256 seq256", [&] { NoGradGuard ng; model.forward(tokens); }});
+
+    std::cout << "== threads (speedup vs 1 thread; " << hw << " hardware threads) ==\n" << std::setw(24) << "";
+    for (int t : counts) std::cout << std::setw(9) << t;
+    std::cout << "\n";
+    for (auto& r : rows) {
+        std::cout << std::setw(24) << std::left << r.name << std::right << std::fixed << std::setprecision(2);
+        for (int t : counts) {
+            set_num_threads(t);
+            const double sec = time_it(r.fn, 0.2);
+            if (t == 1) r.base = sec;
+            std::cout << std::setw(9) << r.base / sec;
+        }
+        std::cout << std::defaultfloat << "   (" << std::setprecision(3) << r.base * 1e3 << " ms @1)\n";
+    }
+    set_num_threads(0);
+}
+
+// usage: carbon_bench [suite] [--json out.json] [--baseline base.json] [--tolerance 0.15]
+int main(int argc, char** argv) {
+    std::string suite = "all", json_path, baseline_path;
+    double tolerance = 0.15;
+    for (int i = 1; i < argc; ++i) {
+        const std::string arg = argv[i];
+        if (arg == "--json" && i + 1 < argc) json_path = argv[++i];
+        else if (arg == "--baseline" && i + 1 < argc) baseline_path = argv[++i];
+        else if (arg == "--tolerance" && i + 1 < argc) tolerance = std::atof(argv[++i]);
+        else if (arg.rfind("--", 0) == 0) {
+            std::cerr << "[BENCH] Error: unknown option " << arg << "\n";
+            return 2;
+        } else suite = arg;
+    }
+    if (suite == "all" || suite == "gemm") bench_gemm();
+    if (suite == "all" || suite == "linear_backward") bench_linear_backward();
+    if (suite == "all" || suite == "decode") bench_decode();
+    if (suite == "all" || suite == "attention") bench_attention();
+    if (suite == "all" || suite == "batch") bench_batch();
+    if (suite == "all" || suite == "memory") bench_memory();
+    if (suite == "all" || suite == "workspace") bench_workspace();
+    if (suite == "all" || suite == "checkpoint") bench_checkpoint();
+    if (suite == "all" || suite == "quant") bench_quant();
+    if (suite == "all" || suite == "loss") bench_loss();
+    if (suite == "all" || suite == "sampler") bench_sampler();
+    if (suite == "all" || suite == "bpe") bench_bpe();
+    if (suite == "all" || suite == "encode") bench_encode();
+    if (suite == "all" || suite == "corpus") bench_corpus();
+    if (suite == "all" || suite == "dataset") bench_dataset();
+    if (suite == "all" || suite == "optimizer") bench_optimizer();
+    if (suite == "all" || suite == "embedding") bench_embedding();
+    if (suite == "all" || suite == "dataparallel") bench_dataparallel();
+    if (suite == "all" || suite == "checkpointing") bench_checkpointing();
+    if (suite == "all" || suite == "layernorm") bench_layernorm();
+    if (suite == "all" || suite == "ffn") bench_ffn();
+    if (suite == "all" || suite == "kernels") bench_kernels();
+    if (suite == "all" || suite == "perf") bench_perf();
+    if (suite == "all" || suite == "profile") bench_profile();
+    if (suite == "all" || suite == "threads") bench_threads();
+    if (!json_path.empty() && !write_perf_json(json_path)) bench_ok = false;
+    if (!baseline_path.empty()) compare_perf_baseline(baseline_path, tolerance);
+    return bench_ok ? 0 : 1;
+}
@@ -0,0 +1,272 @@
+#pragma once
+#include "tensor.hpp"
+#include <cstdint>
+#include <cstring>
+#include <fcntl.h>
+#include <fstream>
+#include <iostream>
+#include <memory>
+#include <string>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <unordered_map>
+#include <vector>
+
+// ===== .cb v2 checkpoint format =====
+// [CheckpointHeader: 64 bytes]
+// [directory: n_tensors x {u16 name_len, name, u32 dtype, i32 rows, i32 cols,
+//                          u64 offset, u64 nbytes}]
+// [payloads, each starting on a 64-byte boundary; offsets are absolute]
+//
+// Payloads are laid out so the file can be mmap'ed and used in place: a
+// loaded float tensor is a Buffer::view straight into the mapping, and
+// processes loading the same file share its pages through the page cache.
+// Files without the magic are the legacy v1 stream of (rows, cols, floats)
+// records; see convert_legacy_checkpoint.
+constexpr char CB_MAGIC[8] = {'C', 'A', 'R', 'B', 'O', 'N', 'C', 'B'};
+constexpr uint32_t CB_VERSION = 2;
+constexpr uint64_t CB_ALIGN = 64;
+
+enum CheckpointDType : uint32_t { CB_F32 = 0, CB_I8 = 1, CB_U64 = 2 };
+
+struct CheckpointHeader {
+    char magic[8];
+    uint32_t version;
+    uint32_t n_tensors;
+    uint64_t dir_offset;
+    uint64_t data_offset;
+    int32_t vocab, dim, hidden, layers, heads;  // model config
+    int32_t activation;                         // FeedForward Activation, 0 = ReLU
+    uint8_t reserved[8];
+};
+static_assert(sizeof(CheckpointHeader) == 64, "header must stay 64 bytes");
+
+struct CheckpointEntry {
+    std::string name;
+    uint32_t dtype = CB_F32;
+    int32_t rows = 0, cols = 0;
+    uint64_t offset = 0, nbytes = 0;
+};
+
+// Read-only-from-disk, copy-on-write mapping: pages stay shared until a
+// process writes to them (e.g. fine-tuning a loaded model).
+struct MappedFile {
+    char* data = nullptr;
+    size_t size = 0;
+
+    explicit MappedFile(const std::string& path) {
+        int fd = ::open(path.c_str(), O_RDONLY);
+        if (fd < 0) return;
+        struct stat st{};
+        if (fstat(fd, &st) == 0 && st.st_size > 0) {
+            void* p = mmap(nullptr, st.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+            if (p != MAP_FAILED) {
+                data = static_cast<char*>(p);
+                size = st.st_size;
+            }
+        }
+        ::close(fd);
+    }
+    ~MappedFile() { if (data) munmap(data, size); }
+    MappedFile(const MappedFile&) = delete;
+    MappedFile& operator=(const MappedFile&) = delete;
+};
+
+// ===== Writer =====
+// Collects (name, shape, bytes) records and writes header, directory and
+// aligned payloads in one pass. Payload pointers must stay valid until write().
+struct CheckpointWriter {
+    CheckpointHeader header{};
+    std::vector<CheckpointEntry> entries;
+    std::vector<const void*> payloads;
+
+    CheckpointWriter() {
+        std::memcpy(header.magic, CB_MAGIC, sizeof(CB_MAGIC));
+        header.version = CB_VERSION;
+    }
+
+    void add(const std::string& name, uint32_t dtype, int rows, int cols, const void* data, uint64_t nbytes) {
+        CheckpointEntry e;
+        e.name = name;
+        e.dtype = dtype;
+        e.rows = rows;
+        e.cols = cols;
+        e.nbytes = nbytes;
+        entries.push_back(e);
+        payloads.push_back(data);
+    }
+
+    void add(const std::string& name, const Tensor& t) {
+        add(name, CB_F32, t.rows, t.cols, t.val.data(), t.val.size() * sizeof(float));
+    }
+
+    bool write(const std::string& path) {
+        auto align = [](uint64_t x) { return (x + CB_ALIGN - 1) / CB_ALIGN * CB_ALIGN; };
+        uint64_t dir_size = 0;
+        for (const auto& e : entries) dir_size += 2 + e.name.size() + 4 + 4 + 4 + 8 + 8;
+        header.n_tensors = static_cast<uint32_t>(entries.size());
+        header.dir_offset = sizeof(CheckpointHeader);
+        header.data_offset = align(header.dir_offset + dir_size);
+        uint64_t off = header.data_offset;
+        for (auto& e : entries) {
+            e.offset = off;
+            off = align(off + e.nbytes);
+        }
+
+        std::ofstream f(path, std::ios::binary);
+        if (!f) {
+            std::cerr << "[CB] Error: cannot write to file: " << path << "\n";
+            return false;
+        }
+        f.write(reinterpret_cast<const char*>(&header), sizeof(header));
+        for (const auto& e : entries) {
+            const uint16_t len = static_cast<uint16_t>(e.name.size());
+            f.write(reinterpret_cast<const char*>(&len), sizeof(len));
+            f.write(e.name.data(), len);
+            f.write(reinterpret_cast<const char*>(&e.dtype), sizeof(e.dtype));
+            f.write(reinterpret_cast<const char*>(&e.rows), sizeof(e.rows));
+            f.write(reinterpret_cast<const char*>(&e.cols), sizeof(e.cols));
+            f.write(reinterpret_cast<const char*>(&e.offset), sizeof(e.offset));
+            f.write(reinterpret_cast<const char*>(&e.nbytes), sizeof(e.nbytes));
+        }
+        static const char zeros[CB_ALIGN] = {};
+        for (size_t i = 0; i < entries.size(); i++) {
+            const uint64_t pos = static_cast<uint64_t>(f.tellp());
+            f.write(zeros, entries[i].offset - pos);
+            f.write(static_cast<const char*>(payloads[i]), entries[i].nbytes);
+        }
+        return static_cast<bool>(f);
+    }
+};
+
+// ===== Reader =====
+struct Checkpoint {
+    std::shared_ptr<MappedFile> file;
+    CheckpointHeader header{};
+    std::vector<CheckpointEntry> entries;
+    std::unordered_map<std::string, size_t> index;
+
+    static bool is_v2(const std::string& path) {
+        std::ifstream f(path, std::ios::binary);
+        char magic[8] = {};
+        return f.read(magic, sizeof(magic)) && std::memcmp(magic, CB_MAGIC, sizeof(magic)) == 0;
+    }
+
+    bool open(const std::string& path) {
+        file = std::make_shared<MappedFile>(path);
+        if (!file->data || file->size < sizeof(CheckpointHeader)) {
+            std::cerr << "[CB] Error: cannot map checkpoint: " << path << "\n";
+            return false;
+        }
+        std::memcpy(&header, file->data, sizeof(header));
+        if (std::memcmp(header.magic, CB_MAGIC, sizeof(CB_MAGIC)) != 0 || header.version != CB_VERSION) {
+            std::cerr << "[CB] Error: not a v" << CB_VERSION << " checkpoint: " << path << "\n";
+            return false;
+        }
+        if (header.dir_offset < sizeof(CheckpointHeader) || header.dir_offset > file->size) return corrupt(path);
+        const char* p = file->data + header.dir_offset;
+        const char* end = file->data + file->size;
+        entries.clear();
+        index.clear();
+        for (uint32_t i = 0; i < header.n_tensors; i++) {
+            CheckpointEntry e;
+            uint16_t len;
+            if ((size_t)(end - p) < sizeof(len)) return corrupt(path);
+            std::memcpy(&len, p, sizeof(len)); p += sizeof(len);
+            if ((size_t)(end - p) < len + 28u) return corrupt(path);
+            e.name.assign(p, len); p += len;
+            std::memcpy(&e.dtype, p, 4); p += 4;
+            std::memcpy(&e.rows, p, 4); p += 4;
+            std::memcpy(&e.cols, p, 4); p += 4;
+            std::memcpy(&e.offset, p, 8); p += 8;
+            std::memcpy(&e.nbytes, p, 8); p += 8;
+            if (e.offset % CB_ALIGN != 0 || e.nbytes > file->size || e.offset > file->size - e.nbytes)
+                return corrupt(path);
+            index[e.name] = entries.size();
+            entries.push_back(std::move(e));
+        }
+        return true;
+    }
+
+    const CheckpointEntry* find(const std::string& name) const {
+        auto it = index.find(name);
+        return it == index.end() ? nullptr : &entries[it->second];
+    }
+
+    void* payload(const CheckpointEntry& e) const { return file->data + e.offset; }
+
+    // Points t at the named f32 payload in place (no copy).
+    bool view(const std::string& name, Tensor& t) const {
+        const CheckpointEntry* e = find(name);
+        if (!e || e->dtype != CB_F32 || e->nbytes != (uint64_t)e->rows * e->cols * sizeof(float)) {
+            std::cerr << "[CB] Error: missing or malformed tensor: " << name << "\n";
+            return false;
+        }
+        t.rows = e->rows;
+        t.cols = e->cols;
+        t.val = Buffer::view(static_cast<float*>(payload(*e)), (size_t)e->rows * e->cols);
+        t.grad.assign(grad_enabled() ? t.val.size() : 0, 0.0f);
+        return true;
+    }
+
+private:
+    bool corrupt(const std::string& path) {
+        std::cerr << "[CB] Error: corrupt checkpoint directory: " << path << "\n";
+        return false;
+    }
+};
+
+// ===== Legacy v1 =====
+// v1 files are the Model::save stream of (int rows, int cols, floats)
+// records in parameter order with no names; this maps record i to the v2
+// name Model::parameters() uses for it.
+inline std::vector<std::string> legacy_tensor_names(int layers) {
+    std::vector<std::string> names{"emb.table"};
+    const char* block[] = {"ln1.gamma", "ln1.beta", "ln2.gamma", "ln2.beta",
+                           "attn.q_proj.W", "attn.q_proj.b", "attn.k_proj.W", "attn.k_proj.b",
+                           "attn.v_proj.W", "attn.v_proj.b", "attn.o_proj.W", "attn.o_proj.b",
+                           "ff.l1.W", "ff.l1.b", "ff.l2.W", "ff.l2.b"};
+    for (int l = 0; l < layers; l++)
+        for (const char* n : block) names.push_back("blocks." + std::to_string(l) + "." + n);
+    names.push_back("lm_head.W");
+    names.push_back("lm_head.b");
+    return names;
+}
+
+// Rewrites a v1 checkpoint as v2. v1 does not record the head count, so it
+// must be supplied; every other config field is inferred from the shapes.
+inline bool convert_legacy_checkpoint(const std::string& in_path, const std::string& out_path, int heads) {
+    std::ifstream f(in_path, std::ios::binary);
+    if (!f) {
+        std::cerr << "[CB] Error: cannot open file: " << in_path << "\n";
+        return false;
+    }
+    std::vector<Tensor> records;
+    {
+        NoGradGuard no_grad;
+        int rows, cols;
+        while (f.read(reinterpret_cast<char*>(&rows), sizeof(int)) && f.read(reinterpret_cast<char*>(&cols), sizeof(int))) {
+            records.emplace_back(rows, cols);
+            if (!f.read(reinterpret_cast<char*>(records.back().val.data()), records.back().val.size() * sizeof(float))) {
+                std::cerr << "[CB] Error: truncated legacy checkpoint: " << in_path << "\n";
+                return false;
+            }
+        }
+    }
+    if (records.size() < 3 || (records.size() - 3) % 16 != 0) {
+        std::cerr << "[CB] Error: unexpected record count " << records.size() << " in " << in_path << "\n";
+        return false;
+    }
+    const int layers = static_cast<int>((records.size() - 3) / 16);
+    const auto names = legacy_tensor_names(layers);
+
+    CheckpointWriter w;
+    w.header.vocab = records.front().rows;
+    w.header.dim = records.front().cols;
+    w.header.hidden = layers > 0 ? records[1 + 12].cols : 0;  // blocks.0.ff.l1.W
+    w.header.layers = layers;
+    w.header.heads = heads;
+    for (size_t i = 0; i < records.size(); i++) w.add(names[i], records[i]);
+    return w.write(out_path);
+}
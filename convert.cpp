@@ -0,0 +1,24 @@
+#include "checkpoint.hpp"
+#include <iostream>
+#include <string>
+
+// Converts a legacy (v1) .cb checkpoint to the v2 format.
+// usage: cb_convert <old.cb> <new.cb> <heads>
+int main(int argc, char** argv) {
+    if (argc != 4) {
+        std::cerr << "usage: " << argv[0] << " <old.cb> <new.cb> <heads>\n";
+        return 1;
+    }
+    if (Checkpoint::is_v2(argv[1])) {
+        std::cerr << argv[1] << " is already a v2 checkpoint\n";
+        return 1;
+    }
+    if (!convert_legacy_checkpoint(argv[1], argv[2], std::stoi(argv[3]))) return 1;
+
+    Checkpoint ck;
+    if (!ck.open(argv[2])) return 1;
+    const auto& h = ck.header;
+    std::cout << "Wrote " << argv[2] << ": " << ck.entries.size() << " tensors, vocab=" << h.vocab
+              << " dim=" << h.dim << " hidden=" << h.hidden << " layers=" << h.layers << " heads=" << h.heads << "\n";
+    return 0;
+}
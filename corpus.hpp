@@ -0,0 +1,214 @@
+#pragma once
+#include "tokenizer_bpe.hpp"
+#include "checkpoint.hpp"
+#include "threadpool.hpp"
+#include <sys/mman.h>
+#include <cctype>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <memory>
+#include <string>
+#include <vector>
+
+// ===== Token shard format =====
+// [TokenShardHeader: 64 bytes]
+// [token ids: n_tokens x id_bytes (2 if the vocab fits in uint16, else 4)]
+// [index: (n_chunks + 1) x u64 token offsets, one chunk per encoded text chunk]
+// Token ids start at byte 64, so a mapped shard is used in place.
+constexpr char TOK_MAGIC[8] = {'C', 'A', 'R', 'B', 'O', 'N', 'T', 'K'};
+constexpr uint32_t TOK_VERSION = 1;
+
+struct TokenShardHeader {
+    char magic[8];
+    uint32_t version;
+    uint32_t id_bytes;
+    uint64_t n_tokens;
+    uint64_t n_chunks;
+    uint64_t index_offset;
+    uint64_t data_offset;
+    int32_t vocab;
+    uint8_t reserved[12];
+};
+static_assert(sizeof(TokenShardHeader) == 64, "header must stay 64 bytes");
+
+// ===== Writer =====
+// Appends chunks of ids; the header is rewritten on close() once the
+// counts are known.
+struct TokenShardWriter {
+    std::ofstream f;
+    TokenShardHeader header{};
+    std::vector<uint64_t> index{0};
+    std::vector<char> buf;
+
+    bool open(const std::string& path, int vocab) {
+        f.open(path, std::ios::binary);
+        if (!f) {
+            std::cerr << "[TOK] Error: cannot write to file: " << path << "\n";
+            return false;
+        }
+        header = TokenShardHeader{};
+        std::memcpy(header.magic, TOK_MAGIC, sizeof(TOK_MAGIC));
+        header.version = TOK_VERSION;
+        header.id_bytes = vocab <= 65536 ? 2 : 4;
+        header.data_offset = sizeof(TokenShardHeader);
+        header.vocab = vocab;
+        index.assign(1, 0);
+        f.write(reinterpret_cast<const char*>(&header), sizeof(header));
+        return static_cast<bool>(f);
+    }
+
+    uint64_t tokens() const { return index.back(); }
+
+    void append(const std::vector<int>& ids) {
+        buf.resize(ids.size() * header.id_bytes);
+        if (header.id_bytes == 2) {
+            uint16_t* p = reinterpret_cast<uint16_t*>(buf.data());
+            for (size_t i = 0; i < ids.size(); ++i) p[i] = static_cast<uint16_t>(ids[i]);
+        } else {
+            std::memcpy(buf.data(), ids.data(), buf.size());
+        }
+        f.write(buf.data(), buf.size());
+        index.push_back(index.back() + ids.size());
+    }
+
+    bool close() {
+        header.n_tokens = index.back();
+        header.n_chunks = index.size() - 1;
+        header.index_offset = header.data_offset + header.n_tokens * header.id_bytes;
+        f.write(reinterpret_cast<const char*>(index.data()), index.size() * sizeof(uint64_t));
+        f.seekp(0);
+        f.write(reinterpret_cast<const char*>(&header), sizeof(header));
+        f.close();
+        return !f.fail();
+    }
+};
+
+// ===== Reader =====
+struct TokenShard {
+    std::shared_ptr<MappedFile> file;
+    TokenShardHeader header{};
+    const char* data = nullptr;
+    const uint64_t* index = nullptr;
+
+    bool open(const std::string& path) {
+        file = std::make_shared<MappedFile>(path);
+        if (!file->data || file->size < sizeof(TokenShardHeader)) {
+            std::cerr << "[TOK] Error: cannot map token shard: " << path << "\n";
+            return false;
+        }
+        std::memcpy(&header, file->data, sizeof(header));
+        if (std::memcmp(header.magic, TOK_MAGIC, sizeof(TOK_MAGIC)) != 0 || header.version != TOK_VERSION ||
+            (header.id_bytes != 2 && header.id_bytes != 4) || header.data_offset > file->size ||
+            header.n_tokens > (file->size - header.data_offset) / header.id_bytes ||
+            header.index_offset + (header.n_chunks + 1) * sizeof(uint64_t) > file->size) {
+            std::cerr << "[TOK] Error: not a v" << TOK_VERSION << " token shard: " << path << "\n";
+            return false;
+        }
+        data = file->data + header.data_offset;
+        index = reinterpret_cast<const uint64_t*>(file->data + header.index_offset);
+        return true;
+    }
+
+    uint64_t size() const { return header.n_tokens; }
+
+    int operator[](uint64_t i) const {
+        return header.id_bytes == 2 ? reinterpret_cast<const uint16_t*>(data)[i]
+                                    : reinterpret_cast<const int32_t*>(data)[i];
+    }
+
+    // out[0, n) = tokens [begin, begin + n)
+    void read(uint64_t begin, size_t n, int* out) const {
+        if (header.id_bytes == 2) {
+            const uint16_t* p = reinterpret_cast<const uint16_t*>(data) + begin;
+            for (size_t i = 0; i < n; ++i) out[i] = p[i];
+        } else {
+            std::memcpy(out, data + begin * 4, n * 4);
+        }
+    }
+};
+
+// ===== Parallel corpus tokenizer =====
+struct CorpusOptions {
+    size_t chunk_bytes = 1 << 20;        // text per work item, extended to the next whitespace
+    uint64_t shard_tokens = 1ull << 28;  // a new shard starts once this many tokens are written
+    int window = 0;                      // chunks in flight (0: 4 per thread)
+};
+
+struct CorpusStats {
+    uint64_t bytes = 0, tokens = 0, chunks = 0;
+    std::vector<std::string> shards;
+};
+
+inline std::string shard_path(const std::string& prefix, int n) {
+    char suffix[16];
+    std::snprintf(suffix, sizeof(suffix), "_%05d.tok", n);
+    return prefix + suffix;
+}
+
+// Tokenizes the text file at in_path into out_prefix_00000.tok, ... The
+// file is mapped and cut into whitespace-aligned chunks (no word spans two
+// chunks, so the ids equal tok.encode of the whole text). A window of
+// chunks is encoded across the thread pool, each worker with its own word
+// cache, then written in order. Pages of the mapping are released as the
+// window advances, so memory stays at about window x chunk_bytes however
+// large the corpus is.
+inline bool tokenize_corpus(const BPETokenizer& tok, const std::string& in_path, const std::string& out_prefix,
+                            const CorpusOptions& opt = CorpusOptions(), CorpusStats* stats = nullptr) {
+    MappedFile in(in_path);
+    if (!in.data) {
+        std::cerr << "[TOK] Error: cannot map corpus: " << in_path << "\n";
+        return false;
+    }
+    madvise(in.data, in.size, MADV_SEQUENTIAL);
+    const int vocab = static_cast<int>(tok.rev_vocab.size());
+    const int window = opt.window > 0 ? opt.window : 4 * num_threads();
+    const size_t page = static_cast<size_t>(sysconf(_SC_PAGESIZE));
+
+    CorpusStats local;
+    CorpusStats& st = stats ? *stats : local;
+    st = CorpusStats();
+    st.bytes = in.size;
+
+    TokenShardWriter writer;
+    st.shards.push_back(shard_path(out_prefix, 0));
+    if (!writer.open(st.shards.back(), vocab)) return false;
+
+    std::vector<std::pair<size_t, size_t>> spans(window);
+    std::vector<std::vector<int>> ids(window);
+    size_t pos = 0, released = 0;
+    while (pos < in.size) {
+        int n = 0;
+        for (; n < window && pos < in.size; ++n) {
+            size_t end = std::min(in.size, pos + opt.chunk_bytes);
+            while (end < in.size && !std::isspace(static_cast<unsigned char>(in.data[end]))) ++end;
+            spans[n] = {pos, end};
+            pos = end;
+        }
+        parallel_for(0, n, 1, [&](int c0, int c1) {
+            for (int c = c0; c < c1; ++c) {
+                ids[c].clear();
+                tok.encode_into(std::string_view(in.data + spans[c].first, spans[c].second - spans[c].first), ids[c],
+                                &BPETokenizer::thread_cache());
+            }
+        });
+        for (int c = 0; c < n; ++c) {
+            if (writer.tokens() > 0 && writer.tokens() + ids[c].size() > opt.shard_tokens) {
+                if (!writer.close()) return false;
+                st.shards.push_back(shard_path(out_prefix, static_cast<int>(st.shards.size())));
+                if (!writer.open(st.shards.back(), vocab)) return false;
+            }
+            writer.append(ids[c]);
+            st.tokens += ids[c].size();
+            st.chunks++;
+        }
+        const size_t done = pos / page * page;
+        if (done > released) {
+            madvise(in.data + released, done - released, MADV_DONTNEED);
+            released = done;
+        }
+    }
+    return writer.close();
+}
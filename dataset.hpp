@@ -0,0 +1,265 @@
+#pragma once
+#include "corpus.hpp"
+#include "batch.hpp"
+#include "checkpoint.hpp"
+#include <algorithm>
+#include <condition_variable>
+#include <cstdint>
+#include <fstream>
+#include <iostream>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+// ===== Token dataset =====
+// Training windows over mapped token shards (corpus.hpp). Shard tokens are
+// cut into windows of seq + 1 tokens with stride seq; a window yields seq
+// inputs and their seq next-token targets, read straight from the mapping
+// into the batch (the only copy is the widening to int). Windows are drawn
+// in order or, with shuffle, in a seeded per-epoch permutation that needs
+// no memory and can be entered at any position, so a cursor of
+// (epoch, position) is all it takes to resume.
+
+// Where the next window comes from. position counts the windows this rank
+// has drawn in the current epoch.
+struct DatasetCursor {
+    uint64_t epoch = 0;
+    uint64_t position = 0;
+};
+
+struct DatasetOptions {
+    int seq = 256;
+    bool shuffle = true;
+    uint64_t seed = 0;
+    int rank = 0, world = 1;  // data-parallel replicas each draw every world-th window
+};
+
+struct DataBatch {
+    TokenBatch batch;          // one sequence of seq tokens per window
+    std::vector<int> targets;  // next token of every input position
+    DatasetCursor cursor;      // resume point after this batch
+};
+
+inline uint64_t mix64(uint64_t z) {
+    z += 0x9E3779B97F4A7C15ull;
+    z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ull;
+    z = (z ^ (z >> 27)) * 0x94D049BB133111EBull;
+    return z ^ (z >> 31);
+}
+
+// Bijection on [0, n): a 4-round Feistel network over the smallest
+// even-bit domain >= n (at most 4n), cycle-walking any value past n.
+struct WindowPermutation {
+    uint64_t n = 0, key = 0, mask = 0;
+    int half = 1;
+
+    WindowPermutation(uint64_t n_, uint64_t key_) : n(n_), key(key_) {
+        int bits = 2;
+        while (bits < 64 && (1ull << bits) < n) bits += 2;
+        half = bits / 2;
+        mask = (1ull << half) - 1;
+    }
+
+    uint64_t operator()(uint64_t x) const {
+        do x = encrypt(x); while (x >= n);
+        return x;
+    }
+
+private:
+    uint64_t encrypt(uint64_t x) const {
+        uint64_t l = x >> half, r = x & mask;
+        for (uint64_t round = 0; round < 4; ++round) {
+            const uint64_t t = l ^ (mix64(r ^ key ^ (round << 56)) & mask);
+            l = r;
+            r = t;
+        }
+        return l << half | r;
+    }
+};
+
+class TokenDataset {
+public:
+    DatasetOptions opt;
+    std::vector<TokenShard> shards;
+
+    bool open(const std::vector<std::string>& paths, const DatasetOptions& o = DatasetOptions()) {
+        opt = o;
+        shards.clear();
+        first_window.assign(1, 0);
+        if (opt.seq < 1 || opt.world < 1 || opt.rank < 0 || opt.rank >= opt.world) {
+            std::cerr << "[DATA] Error: bad dataset options\n";
+            return false;
+        }
+        for (const auto& p : paths) {
+            shards.emplace_back();
+            if (!shards.back().open(p)) return false;
+            const uint64_t n = shards.back().size();
+            first_window.push_back(first_window.back() + (n > 0 ? (n - 1) / opt.seq : 0));
+        }
+        if (epoch_windows() == 0) {
+            std::cerr << "[DATA] Error: no complete window of " << opt.seq + 1 << " tokens per rank\n";
+            return false;
+        }
+        return true;
+    }
+
+    // Every shard written by tokenize_corpus(..., prefix): prefix_00000.tok, ...
+    bool open(const std::string& prefix, const DatasetOptions& o = DatasetOptions()) {
+        std::vector<std::string> paths;
+        while (std::ifstream(shard_path(prefix, static_cast<int>(paths.size()))))
+            paths.push_back(shard_path(prefix, static_cast<int>(paths.size())));
+        if (paths.empty()) {
+            std::cerr << "[DATA] Error: no token shards at " << prefix << "_*.tok\n";
+            return false;
+        }
+        return open(paths, o);
+    }
+
+    // Windows in the dataset, and windows one rank draws per epoch (the
+    // remainder that does not split evenly across ranks is skipped).
+    uint64_t windows() const { return first_window.back(); }
+    uint64_t epoch_windows() const { return windows() / opt.world; }
+
+    // Global window index of a cursor for this rank.
+    uint64_t window_at(const DatasetCursor& c) const {
+        const uint64_t g = c.position * opt.world + opt.rank;
+        if (!opt.shuffle) return g;
+        return WindowPermutation(epoch_windows() * opt.world, mix64(opt.seed ^ mix64(c.epoch)))(g);
+    }
+
+    // inputs[0, seq) and targets[0, seq) of window w.
+    void window(uint64_t w, int* inputs, int* targets) const {
+        const size_t s = std::upper_bound(first_window.begin(), first_window.end(), w) - first_window.begin() - 1;
+        const uint64_t off = (w - first_window[s]) * opt.seq;
+        shards[s].read(off, opt.seq, inputs);
+        shards[s].read(off + 1, opt.seq, targets);
+    }
+
+    // Fills b with the next batch windows from c and advances c, rolling
+    // into the next epoch as needed. Reuses b's storage.
+    void fill(DataBatch& b, int batch, DatasetCursor& c) const {
+        const size_t seq = opt.seq;
+        b.batch.tokens.resize(batch * seq);
+        b.batch.offsets.resize(batch + 1);
+        b.targets.resize(batch * seq);
+        for (int i = 0; i < batch; ++i) {
+            b.batch.offsets[i] = static_cast<int>(i * seq);
+            window(window_at(c), b.batch.tokens.data() + i * seq, b.targets.data() + i * seq);
+            if (++c.position == epoch_windows()) {
+                c.position = 0;
+                c.epoch++;
+            }
+        }
+        b.batch.offsets[batch] = static_cast<int>(batch * seq);
+        b.cursor = c;
+    }
+
+    // The cursor rides along in a model checkpoint as "data.cursor": u64
+    // [epoch, position, seed, windows]. Restoring checks that the seed and
+    // the dataset are the ones it was saved with.
+    void save_cursor(CheckpointWriter& w, const DatasetCursor& c) {
+        cursor_record[0] = c.epoch;
+        cursor_record[1] = c.position;
+        cursor_record[2] = opt.seed;
+        cursor_record[3] = windows();
+        w.add("data.cursor", CB_U64, 1, 4, cursor_record, sizeof(cursor_record));
+    }
+
+    bool load_cursor(const Checkpoint& ck, DatasetCursor& c) const {
+        const CheckpointEntry* e = ck.find("data.cursor");
+        if (!e || e->dtype != CB_U64 || e->nbytes != sizeof(cursor_record)) {
+            std::cerr << "[DATA] Error: checkpoint has no data cursor\n";
+            return false;
+        }
+        uint64_t r[4];
+        std::memcpy(r, ck.payload(*e), sizeof(r));
+        if (r[2] != opt.seed || r[3] != windows() || r[1] >= epoch_windows()) {
+            std::cerr << "[DATA] Error: data cursor was saved for a different dataset or seed\n";
+            return false;
+        }
+        c.epoch = r[0];
+        c.position = r[1];
+        return true;
+    }
+
+private:
+    std::vector<uint64_t> first_window{0};  // prefix sums of windows per shard
+    uint64_t cursor_record[4] = {};         // must outlive CheckpointWriter::write
+};
+
+// ===== Background loader =====
+// A producer thread assembles batches into a ring of prefetch slots while
+// the training step runs, so next() only waits if a whole step is faster
+// than assembling one batch. The batch next() returns stays valid (its
+// slot is not refilled) until the following next().
+class DataLoader {
+public:
+    DataLoader(const TokenDataset& ds, int batch, const DatasetCursor& start = DatasetCursor(), int prefetch = 4)
+        : data(ds), batch_size(batch), slots(std::max(prefetch, 2)), resume(start) {
+        producer = std::thread([this, start] { produce(start); });
+    }
+
+    ~DataLoader() {
+        {
+            std::lock_guard<std::mutex> lock(m);
+            stop = true;
+        }
+        not_full.notify_all();
+        producer.join();
+    }
+    DataLoader(const DataLoader&) = delete;
+    DataLoader& operator=(const DataLoader&) = delete;
+
+    const DataBatch& next() {
+        std::unique_lock<std::mutex> lock(m);
+        if (holding) {
+            consumed++;
+            not_full.notify_one();
+        }
+        if (produced == consumed) {
+            waits++;
+            not_empty.wait(lock, [&] { return produced > consumed; });
+        }
+        holding = true;
+        const DataBatch& b = slots[consumed % slots.size()];
+        resume = b.cursor;
+        return b;
+    }
+
+    // Resume point: just after the last batch next() returned.
+    DatasetCursor cursor() const { return resume; }
+
+    // Calls to next() that found no batch ready.
+    uint64_t stalls() const {
+        std::lock_guard<std::mutex> lock(m);
+        return waits;
+    }
+
+private:
+    const TokenDataset& data;
+    const int batch_size;
+    std::vector<DataBatch> slots;
+    DatasetCursor resume;
+    uint64_t produced = 0, consumed = 0, waits = 0;
+    bool holding = false, stop = false;
+    mutable std::mutex m;
+    std::condition_variable not_full, not_empty;
+    std::thread producer;
+
+    void produce(DatasetCursor c) {
+        for (;;) {
+            {
+                std::unique_lock<std::mutex> lock(m);
+                not_full.wait(lock, [&] { return stop || produced - consumed < slots.size(); });
+                if (stop) return;
+            }
+            data.fill(slots[produced % slots.size()], batch_size, c);
+            {
+                std::lock_guard<std::mutex> lock(m);
+                produced++;
+            }
+            not_empty.notify_one();
+        }
+    }
+};
@@ -1,30 +1,39 @@
 #pragma once
 #include "tensor.hpp"
+#include <string>
 
 struct Embedding {
-    Tensor table;
+    Tensor table;          // no dense grad: a batch touches a few hundred of its rows
+    SparseRowGrad grad;    // dL/dtable for the rows touched since the last step
     std::vector<int> last_tokens;
-    Embedding(int vocab,int dim):table(vocab,dim){table.randomize();}
+    Embedding(int vocab,int dim):table(make_table(vocab,dim)),grad(vocab,dim){table.randomize();}
+    static Tensor make_table(int vocab,int dim){NoGradGuard no_grad;return Tensor(vocab,dim);}
     Tensor forward(const std::vector<int>&tokens){
-        last_tokens=tokens;
-        Tensor out(tokens.size(),table.cols);
+        if(grad_enabled()) last_tokens=tokens;
+        Tensor out=Tensor::uninit(tokens.size(),table.cols);
         for(size_t i=0;i<tokens.size();i++)
-            for(int j=0;j<table.cols;j++)
-                out(i,j)=table(tokens[i],j);
+            std::copy_n(&table.val[(size_t)tokens[i]*table.cols],table.cols,&out.val[i*table.cols]);
         return out;
     }
+    // Accumulates grad_out.val into the rows of the tokens it came from.
     Tensor backward(const Tensor&grad_out){
-        for(size_t i=0;i<last_tokens.size();i++)
-            for(int j=0;j<table.cols;j++)
-                table.grad[last_tokens[i]*table.cols+j]+=grad_out.grad[i*grad_out.cols+j];
+        for(size_t i=0;i<last_tokens.size();i++){
+            float*g=grad.row(last_tokens[i]);
+            kernels().add(g,&grad_out.val[i*grad_out.cols],table.cols);
+        }
         return grad_out;
     }
+    // SGD on the touched rows only, then forgets them.
     void step(float lr){
-        for(size_t i=0;i<table.val.size();i++){
-            table.val[i]-=lr*table.grad[i];
-            table.grad[i]=0;
+        for(size_t k=0;k<grad.size();k++){
+            float*w=&table.val[(size_t)grad.ids[k]*table.cols];
+            const float*g=&grad.grad[k*table.cols];
+            for(int j=0;j<table.cols;j++) w[j]-=lr*g[j];
         }
+        grad.clear();
     }
+    template<typename F> void parameters(const std::string&prefix,F&&f){f(prefix+"table",table);}
+    template<typename F> void sparse_parameters(const std::string&prefix,F&&f){f(prefix+"table",table,grad);}
     void save(std::ofstream&f)const{table.save(f);}
-    void load(std::ifstream&f){table.load(f);}
+    void load(std::ifstream&f){table.load(f);table.grad=Buffer();}
 };
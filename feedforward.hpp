@@ -1,24 +1,265 @@
 #pragma once
 #include "layers.hpp"
+#include "kernels.hpp"
+#include <cstdint>
+#include <vector>
+
+// ===== Activations =====
+// SwiGLU: act = silu(first half of l1) * second half of l1, so its l1 is
+// twice as wide. Values are stored in the checkpoint header (0 = ReLU).
+enum class Activation{ReLU=0,GELU=1,SiLU=2,SwiGLU=3};
+
+constexpr float GELU_K=0.7978845608f;  // sqrt(2 / pi), tanh approximation
+constexpr float GELU_C=0.044715f;
+
+inline float sigmoid(float x){return 1.0f/(1.0f+std::exp(-x));}
+CARBON_AVX2 inline __m256 sigmoid256_ps(__m256 x){
+    const __m256 one=_mm256_set1_ps(1.0f);
+    return _mm256_div_ps(one,_mm256_add_ps(one,exp256_ps(_mm256_sub_ps(_mm256_setzero_ps(),x))));
+}
+// tanh(u) = 1 - 2 / (e^2u + 1); exp256_ps saturates, so this does too.
+CARBON_AVX2 inline __m256 tanh256_ps(__m256 u){
+    const __m256 one=_mm256_set1_ps(1.0f);
+    return _mm256_sub_ps(one,_mm256_div_ps(_mm256_set1_ps(2.0f),_mm256_add_ps(exp256_ps(_mm256_add_ps(u,u)),one)));
+}
+
+// out[j0, n) = act(pre), or silu(pre) * up for SwiGLU; out may alias pre.
+inline void activation_forward_scalar(Activation act,const float*pre,const float*up,float*out,int j0,int n){
+    for(int j=j0;j<n;j++){
+        const float x=pre[j];
+        switch(act){
+        case Activation::ReLU: out[j]=std::max(0.0f,x);break;
+        case Activation::GELU: out[j]=0.5f*x*(1.0f+std::tanh(GELU_K*(x+GELU_C*x*x*x)));break;
+        case Activation::SiLU: out[j]=x*sigmoid(x);break;
+        default: out[j]=x*sigmoid(x)*up[j];break;
+        }
+    }
+}
+CARBON_AVX2 inline void activation_forward_avx2(Activation act,const float*pre,const float*up,float*out,int n){
+    const __m256 zero=_mm256_setzero_ps(),half=_mm256_set1_ps(0.5f),one=_mm256_set1_ps(1.0f);
+    const __m256 k=_mm256_set1_ps(GELU_K),c=_mm256_set1_ps(GELU_C);
+    int j=0;
+    for(;j+8<=n;j+=8){
+        const __m256 x=_mm256_loadu_ps(pre+j);
+        __m256 y;
+        switch(act){
+        case Activation::ReLU: y=_mm256_max_ps(x,zero);break;
+        case Activation::GELU:{
+            const __m256 t=tanh256_ps(_mm256_mul_ps(k,_mm256_fmadd_ps(_mm256_mul_ps(c,x),_mm256_mul_ps(x,x),x)));
+            y=_mm256_mul_ps(_mm256_mul_ps(half,x),_mm256_add_ps(one,t));break;}
+        case Activation::SiLU: y=_mm256_mul_ps(x,sigmoid256_ps(x));break;
+        default: y=_mm256_mul_ps(_mm256_mul_ps(x,sigmoid256_ps(x)),_mm256_loadu_ps(up+j));break;
+        }
+        _mm256_storeu_ps(out+j,y);
+    }
+    activation_forward_scalar(act,pre,up,out,j,n);
+}
+inline void activation_forward(Activation act,const float*pre,const float*up,float*out,int n){
+    if(has_avx2()) activation_forward_avx2(act,pre,up,out,n);
+    else activation_forward_scalar(act,pre,up,out,0,n);
+}
+
+// d_pre[j0, n) = d_out * act'(pre); SwiGLU also sets d_up = d_out * silu(pre).
+// For ReLU pre may be the activation output (same sign). d_pre may alias d_out.
+inline void activation_backward_scalar(Activation act,const float*pre,const float*up,const float*d_out,float*d_pre,
+                                       float*d_up,int j0,int n){
+    for(int j=j0;j<n;j++){
+        const float x=pre[j],d=d_out[j];
+        switch(act){
+        case Activation::ReLU: d_pre[j]=x>0?d:0.0f;break;
+        case Activation::GELU:{
+            const float t=std::tanh(GELU_K*(x+GELU_C*x*x*x));
+            d_pre[j]=d*0.5f*(1.0f+t+x*(1.0f-t*t)*GELU_K*(1.0f+3*GELU_C*x*x));break;}
+        case Activation::SiLU:{const float s=sigmoid(x);d_pre[j]=d*s*(1.0f+x*(1.0f-s));break;}
+        default:{
+            const float s=sigmoid(x);
+            d_up[j]=d*x*s;
+            d_pre[j]=d*up[j]*s*(1.0f+x*(1.0f-s));break;}
+        }
+    }
+}
+CARBON_AVX2 inline void activation_backward_avx2(Activation act,const float*pre,const float*up,const float*d_out,
+                                                 float*d_pre,float*d_up,int n){
+    const __m256 zero=_mm256_setzero_ps(),half=_mm256_set1_ps(0.5f),one=_mm256_set1_ps(1.0f);
+    const __m256 k=_mm256_set1_ps(GELU_K),c=_mm256_set1_ps(GELU_C),c3=_mm256_set1_ps(3*GELU_C);
+    int j=0;
+    for(;j+8<=n;j+=8){
+        const __m256 x=_mm256_loadu_ps(pre+j),d=_mm256_loadu_ps(d_out+j);
+        __m256 g;
+        switch(act){
+        case Activation::ReLU: g=_mm256_and_ps(d,_mm256_cmp_ps(x,zero,_CMP_GT_OQ));break;
+        case Activation::GELU:{
+            const __m256 x2=_mm256_mul_ps(x,x);
+            const __m256 t=tanh256_ps(_mm256_mul_ps(k,_mm256_fmadd_ps(_mm256_mul_ps(c,x),x2,x)));
+            const __m256 du=_mm256_mul_ps(k,_mm256_fmadd_ps(c3,x2,one));
+            const __m256 dt=_mm256_mul_ps(_mm256_sub_ps(one,_mm256_mul_ps(t,t)),du);
+            g=_mm256_mul_ps(d,_mm256_mul_ps(half,_mm256_fmadd_ps(x,dt,_mm256_add_ps(one,t))));break;}
+        case Activation::SiLU:{
+            const __m256 s=sigmoid256_ps(x);
+            g=_mm256_mul_ps(d,_mm256_mul_ps(s,_mm256_fmadd_ps(x,_mm256_sub_ps(one,s),one)));break;}
+        default:{
+            const __m256 s=sigmoid256_ps(x),u=_mm256_loadu_ps(up+j);
+            _mm256_storeu_ps(d_up+j,_mm256_mul_ps(d,_mm256_mul_ps(x,s)));
+            g=_mm256_mul_ps(_mm256_mul_ps(d,u),_mm256_mul_ps(s,_mm256_fmadd_ps(x,_mm256_sub_ps(one,s),one)));break;}
+        }
+        _mm256_storeu_ps(d_pre+j,g);
+    }
+    activation_backward_scalar(act,pre,up,d_out,d_pre,d_up,j,n);
+}
+inline void activation_backward(Activation act,const float*pre,const float*up,const float*d_out,float*d_pre,float*d_up,int n){
+    if(has_avx2()) activation_backward_avx2(act,pre,up,d_out,d_pre,d_up,n);
+    else activation_backward_scalar(act,pre,up,d_out,d_pre,d_up,0,n);
+}
+
+// ReLU derivative masks, one bit per hidden unit: bit j%64 of word j/64
+// is set where x[j] > 0 (mask_store); mask_apply zeroes the rest of in.
+// out may alias in.
+inline void relu_mask_store(const float*x,int n,uint64_t*bits){
+    for(int w=0;w*64<n;w++){
+        uint64_t m=0;
+        const int e=std::min(64,n-w*64);
+        for(int b=0;b<e;b++) m|=(uint64_t)(x[w*64+b]>0.0f)<<b;
+        bits[w]=m;
+    }
+}
+inline void relu_mask_apply(const uint64_t*bits,const float*in,float*out,int n){
+    for(int j=0;j<n;j++) out[j]=(bits[j>>6]>>(j&63))&1?in[j]:0.0f;
+}
+
+// ===== Fused MLP =====
+// y = act(x W1 + b1) W2 + b2, one FF_HC-wide chunk of the hidden
+// dimension at a time: the chunk's W1 (and SwiGLU up) columns and W2 rows
+// are packed once, then every block of rows computes its bias-seeded
+// x W1 tile, activates it while it is still in cache and multiplies it
+// straight into y. The [rows x hidden] intermediate never exists; each
+// thread holds one rows x FF_HC tile. Row blocks run on the thread pool.
+// When there are too few rows to keep every thread busy (decode), the two
+// GEMMs run unfused, split across columns.
+//
+// Training keeps l1's input and, for ReLU, a one-bit-per-unit mask of the
+// forward's signs. Backward recomputes the pre-activation with one GEMM,
+// rebuilds the activation for dW2 from it (masked for ReLU) and takes the
+// derivative from the mask or the recomputed pre-activation.
+constexpr int FF_HC=256;
 
 struct FeedForward {
-    Linear l1,l2; Tensor a_cache;
-    FeedForward(int d,int h):l1(d,h),l2(h,d){}
+    Linear l1,l2; Activation act; int hidden;
+    std::vector<uint64_t> relu_mask;  // [rows x mask_words()], ReLU training only
+    FeedForward(int d,int h,Activation a=Activation::ReLU):l1(d,a==Activation::SwiGLU?2*h:h),l2(h,d),act(a),hidden(h){}
+    int mask_words()const{return (hidden+63)/64;}
     Tensor forward(const Tensor&x){
-        a_cache=l1.forward(x);
-        Tensor y(a_cache.rows,a_cache.cols);
-        for(int i=0;i<a_cache.rows;i++)
-            for(int j=0;j<a_cache.cols;j++) y(i,j)=std::max(0.0f,a_cache(i,j));
-        return l2.forward(y);
+        const int threads=num_threads();
+        const int blk=std::min(GEMM_MC,std::max(4*GEMM_MR,(x.rows/(2*threads)+GEMM_MR-1)/GEMM_MR*GEMM_MR));
+        if(l1.quantized()||l2.quantized()||(x.rows+blk-1)/blk<threads) return forward_unfused(x);
+        const bool train=grad_enabled(),glu=act==Activation::SwiGLU;
+        const int K=x.cols,W1c=l1.W.cols,D=l2.W.cols,words=mask_words();
+        uint64_t*bits=nullptr;
+        if(train){
+            l1.x_cache=x;
+            if(act==Activation::ReLU){relu_mask.resize((size_t)x.rows*words);bits=relu_mask.data();}
+        }
+        NoGradGuard no_grad;
+        Tensor y=Tensor::uninit(x.rows,D);
+        for(int i=0;i<x.rows;i++) std::copy(l2.b.val.begin(),l2.b.val.end(),y.val.begin()+(size_t)i*D);
+        const float*W1=l1.W.val.data(),*b1=l1.b.val.data(),*W2=l2.W.val.data();
+        // one chunk's packed W1 columns (and up columns), then its W2 rows
+        const size_t n1=gemm_packed_size(K,FF_HC);
+        Buffer packed((glu?2:1)*n1+gemm_packed_size(FF_HC,D),Buffer::Uninit{});
+        float*p1=packed.data(),*pu=p1+n1,*p2=p1+(glu?2:1)*n1;
+        for(int h0=0;h0<hidden;h0+=FF_HC){
+            const int hc=std::min(FF_HC,hidden-h0);
+            gemm_prepack_b(false,K,hc,W1+h0,W1c,p1);
+            if(glu) gemm_prepack_b(false,K,hc,W1+hidden+h0,W1c,pu);
+            gemm_prepack_b(false,hc,D,W2+(size_t)h0*D,D,p2);
+            parallel_for(0,(x.rows+blk-1)/blk,1,[&](int u0,int u1){
+                thread_local std::vector<float> tile_buf;  // each worker's own
+                tile_buf.resize((size_t)2*blk*FF_HC);
+                float*g=tile_buf.data(),*up=glu?g+(size_t)blk*FF_HC:nullptr;
+                for(int u=u0;u<u1;u++){
+                    const int i0=u*blk,mb=std::min(blk,x.rows-i0);
+                    const float*xr=x.val.data()+(size_t)i0*K;
+                    // tile[mb x hc] = x rows * W1[:, col0 : col0 + hc] + b1[col0 : col0 + hc]
+                    for(int r=0;r<mb;r++) std::copy_n(b1+h0,hc,g+(size_t)r*hc);
+                    gemm_serial_packed(false,mb,hc,K,xr,K,p1,g,hc,true);
+                    if(up){
+                        for(int r=0;r<mb;r++) std::copy_n(b1+hidden+h0,hc,up+(size_t)r*hc);
+                        gemm_serial_packed(false,mb,hc,K,xr,K,pu,up,hc,true);
+                    }
+                    for(int r=0;r<mb;r++) activation_forward(act,g+(size_t)r*hc,up?up+(size_t)r*hc:nullptr,g+(size_t)r*hc,hc);
+                    if(bits)
+                        for(int r=0;r<mb;r++) relu_mask_store(g+(size_t)r*hc,hc,bits+(size_t)(i0+r)*words+h0/64);
+                    gemm_serial_packed(false,mb,D,hc,g,hc,p2,y.val.data()+(size_t)i0*D,D,true);
+                }
+            });
+        }
+        return y;
     }
+    // Upstream gradients travel in .val, as in Linear::backward.
     Tensor backward(const Tensor&grad_out){
-        Tensor grad_y=l2.backward(grad_out);
-        for(int i=0;i<a_cache.rows;i++)
-            for(int j=0;j<a_cache.cols;j++)
-                grad_y.grad[i*a_cache.cols+j]*=(a_cache(i,j)>0)?1.0f:0.0f;
-        return l1.backward(grad_y);
+        const bool relu=act==Activation::ReLU,glu=act==Activation::SwiGLU;
+        const int words=mask_words(),grain=std::max(1,16384/hidden);
+        Tensor pre;
+        {
+            NoGradGuard no_grad;
+            pre=l1.forward(l1.x_cache);
+            if(relu){
+                // the forward's ReLU output, in place
+                parallel_for(0,pre.rows,grain,[&](int r0,int r1){
+                    for(int i=r0;i<r1;i++){
+                        float*p=&pre.val[(size_t)i*hidden];
+                        relu_mask_apply(&relu_mask[(size_t)i*words],p,p,hidden);
+                    }
+                });
+                l2.x_cache=std::move(pre);
+            }else l2.x_cache=activate(pre);
+        }
+        Tensor dA=l2.backward(grad_out);
+        Tensor dpre=glu?Tensor::uninit(dA.rows,2*hidden):std::move(dA);
+        const float*da=glu?dA.val.data():dpre.val.data();
+        parallel_for(0,dpre.rows,grain,[&](int r0,int r1){
+            for(int i=r0;i<r1;i++){
+                float*dp=&dpre.val[(size_t)i*dpre.cols];
+                if(relu){relu_mask_apply(&relu_mask[(size_t)i*words],dp,dp,hidden);continue;}
+                const float*p=&pre.val[(size_t)i*pre.cols];
+                activation_backward(act,p,glu?p+hidden:nullptr,da+(size_t)i*hidden,dp,glu?dp+hidden:nullptr,hidden);
+            }
+        });
+        l2.release();relu_mask.clear();
+        return l1.backward(dpre);
     }
+    // The mask keeps its capacity, so steady-state steps do not allocate.
+    void release(){l1.release();l2.release();relu_mask.clear();}
     void step(float lr){l1.step(lr);l2.step(lr);}
+    template<typename F> void parameters(const std::string&prefix,F&&f){l1.parameters(prefix+"l1.",f);l2.parameters(prefix+"l2.",f);}
+    template<typename F> void linears(const std::string&prefix,F&&f){f(prefix+"l1.",l1);f(prefix+"l2.",l2);}
     void save(std::ofstream&f)const{l1.save(f);l2.save(f);}
     void load(std::ifstream&f){l1.load(f);l2.load(f);}
+
+    // act over a pre-activation laid out like l1's output; [rows x hidden].
+    Tensor activate(const Tensor&pre)const{
+        Tensor a=Tensor::uninit(pre.rows,hidden);
+        parallel_for(0,pre.rows,std::max(1,16384/hidden),[&](int r0,int r1){
+            for(int i=r0;i<r1;i++){
+                const float*p=&pre.val[(size_t)i*pre.cols];
+                activation_forward(act,p,act==Activation::SwiGLU?p+hidden:nullptr,&a.val[(size_t)i*hidden],hidden);
+            }
+        });
+        return a;
+    }
+
+private:
+    Tensor forward_unfused(const Tensor&x){
+        const bool train=grad_enabled();
+        Tensor pre=l1.forward(x);  // caches x when training
+        NoGradGuard no_grad;
+        Tensor a=activate(pre);
+        if(train&&act==Activation::ReLU){
+            const int words=mask_words();
+            relu_mask.resize((size_t)x.rows*words);
+            parallel_for(0,x.rows,std::max(1,16384/hidden),[&](int r0,int r1){
+                for(int i=r0;i<r1;i++) relu_mask_store(&a.val[(size_t)i*hidden],hidden,&relu_mask[(size_t)i*words]);
+            });
+        }
+        return l2.forward(a);
+    }
 };
@@ -0,0 +1,277 @@
+#pragma once
+#include "tensor.hpp"
+#include <cmath>
+#include <limits>
+
+// ===== Fused tiled attention =====
+// FlashAttention-style forward: for a block of BR queries, stream BC-key
+// tiles of K and V, keep a running row max / row sum, and rescale the
+// output accumulator on the fly. Scores only ever exist as one BR x BC
+// tile, so memory is O(block) instead of O(seq^2).
+constexpr int ATTN_BR = 64;
+constexpr int ATTN_BC = 64;
+
+struct AttnScratch {
+    std::vector<float> s, acc, m, l;
+    AttnScratch() : s(ATTN_BR * ATTN_BC), m(ATTN_BR), l(ATTN_BR) {}
+};
+
+inline AttnScratch& attn_scratch() {
+    thread_local AttnScratch s;
+    return s;
+}
+
+// Score-row helpers over [j, n), each with an AVX2 body and a scalar tail:
+//   scale_max:  x *= scale, returns max(mx, x)
+//   exp_sum:    x = e^(x - m), returns sum + the new x
+//   axpy:       y += a * x
+//   grad:       p = e^(s * scale - lse); dp = p * (dp - D) * scale
+inline float attn_scale_max_scalar(float* x, int j, int n, float scale, float mx) {
+    for (; j < n; ++j) { x[j] *= scale; mx = std::max(mx, x[j]); }
+    return mx;
+}
+inline float attn_exp_sum_scalar(float* x, int j, int n, float m, float sum) {
+    for (; j < n; ++j) { x[j] = std::exp(x[j] - m); sum += x[j]; }
+    return sum;
+}
+inline void attn_axpy_scalar(float* y, const float* x, float a, int j, int n) {
+    for (; j < n; ++j) y[j] += a * x[j];
+}
+inline void attn_grad_row_scalar(float* s, float* dp, int j, int n, float scale, float lse, float D) {
+    for (; j < n; ++j) {
+        s[j] = std::exp(s[j] * scale - lse);
+        dp[j] = s[j] * (dp[j] - D) * scale;
+    }
+}
+
+CARBON_AVX2 inline float attn_scale_max_avx2(float* x, int n, float scale) {
+    const __m256 vscale = _mm256_set1_ps(scale);
+    __m256 vmax = _mm256_set1_ps(-std::numeric_limits<float>::infinity());
+    int j = 0;
+    for (; j + 8 <= n; j += 8) {
+        __m256 t = _mm256_mul_ps(_mm256_loadu_ps(x + j), vscale);
+        _mm256_storeu_ps(x + j, t);
+        vmax = _mm256_max_ps(vmax, t);
+    }
+    return attn_scale_max_scalar(x, j, n, scale, hmax256_ps(vmax));
+}
+CARBON_AVX2 inline float attn_exp_sum_avx2(float* x, int n, float m) {
+    const __m256 vm = _mm256_set1_ps(m);
+    __m256 vsum = _mm256_setzero_ps();
+    int j = 0;
+    for (; j + 8 <= n; j += 8) {
+        __m256 p = exp256_ps(_mm256_sub_ps(_mm256_loadu_ps(x + j), vm));
+        _mm256_storeu_ps(x + j, p);
+        vsum = _mm256_add_ps(vsum, p);
+    }
+    return attn_exp_sum_scalar(x, j, n, m, hsum256_ps(vsum));
+}
+CARBON_AVX2 inline void attn_axpy_avx2(float* y, const float* x, float a, int n) {
+    const __m256 va = _mm256_set1_ps(a);
+    int j = 0;
+    for (; j + 8 <= n; j += 8)
+        _mm256_storeu_ps(y + j, _mm256_fmadd_ps(va, _mm256_loadu_ps(x + j), _mm256_loadu_ps(y + j)));
+    attn_axpy_scalar(y, x, a, j, n);
+}
+CARBON_AVX2 inline void attn_grad_row_avx2(float* s, float* dp, int n, float scale, float lse, float D) {
+    const __m256 vs = _mm256_set1_ps(scale), vl = _mm256_set1_ps(lse), vd = _mm256_set1_ps(D);
+    int j = 0;
+    for (; j + 8 <= n; j += 8) {
+        const __m256 p = exp256_ps(_mm256_sub_ps(_mm256_mul_ps(_mm256_loadu_ps(s + j), vs), vl));
+        _mm256_storeu_ps(s + j, p);
+        _mm256_storeu_ps(dp + j, _mm256_mul_ps(_mm256_mul_ps(p, _mm256_sub_ps(_mm256_loadu_ps(dp + j), vd)), vs));
+    }
+    attn_grad_row_scalar(s, dp, j, n, scale, lse, D);
+}
+
+// One query block of one head. q/o hold nq <= ATTN_BR rows (strides ldq/ldo),
+// k/v hold nk rows (stride ldkv), all head_dim wide. q_pos0 is the absolute
+// position of the first query, so with causal=true row r sees keys
+// [0, q_pos0 + r]; key tiles entirely in the future are skipped. lse, if
+// given, receives the per-row log-sum-exp of the scaled scores.
+inline void flash_attention_block(const float* q, int ldq, int nq, int q_pos0,
+                                  const float* k, const float* v, int ldkv, int nk,
+                                  float* o, int ldo, int head_dim, float scale,
+                                  bool causal, float* lse = nullptr) {
+    AttnScratch& sc = attn_scratch();
+    sc.acc.assign((size_t)nq * head_dim, 0.0f);
+    std::fill(sc.m.begin(), sc.m.end(), -std::numeric_limits<float>::infinity());
+    std::fill(sc.l.begin(), sc.l.end(), 0.0f);
+    float* S = sc.s.data();
+    float* acc = sc.acc.data();
+
+    const int k_end = causal ? std::min(nk, q_pos0 + nq) : nk;
+    const Kernels& kern = kernels();
+    const bool avx2 = has_avx2();
+    for (int j0 = 0; j0 < k_end; j0 += ATTN_BC) {
+        const int bc = std::min(ATTN_BC, k_end - j0);
+
+        // S = Q_blk * K_blk^T; decode-sized blocks skip GEMM packing
+        if (nq < GEMM_MR) {
+            for (int r = 0; r < nq; ++r)
+                for (int j = 0; j < bc; ++j)
+                    S[r * ATTN_BC + j] = Tensor::dot_simd(q + (size_t)r * ldq, k + (size_t)(j0 + j) * ldkv, head_dim);
+        } else {
+            gemm(false, true, nq, bc, head_dim, q, ldq, k + (size_t)j0 * ldkv, ldkv, S, ATTN_BC);
+        }
+
+        for (int r = 0; r < nq; ++r) {
+            float* srow = S + (size_t)r * ATTN_BC;
+            const int valid = causal ? std::min(bc, q_pos0 + r + 1 - j0) : bc;
+            if (valid <= 0) {
+                std::fill(srow, srow + bc, 0.0f);
+                continue;
+            }
+
+            const float mx = avx2 ? attn_scale_max_avx2(srow, valid, scale)
+                                  : attn_scale_max_scalar(srow, 0, valid, scale, -std::numeric_limits<float>::infinity());
+            const float m_new = std::max(sc.m[r], mx);
+            const float alpha = std::exp(sc.m[r] - m_new);  // 0 on the first tile
+            const float sum = avx2 ? attn_exp_sum_avx2(srow, valid, m_new) : attn_exp_sum_scalar(srow, 0, valid, m_new, 0.0f);
+            std::fill(srow + valid, srow + bc, 0.0f);
+
+            sc.l[r] = sc.l[r] * alpha + sum;
+            sc.m[r] = m_new;
+            if (alpha != 1.0f) kern.scale(acc + (size_t)r * head_dim, alpha, head_dim);
+        }
+
+        // acc += P * V_blk
+        if (nq < GEMM_MR) {
+            for (int r = 0; r < nq; ++r) {
+                float* arow = acc + (size_t)r * head_dim;
+                for (int j = 0; j < bc; ++j) {
+                    const float p = S[r * ATTN_BC + j];
+                    const float* vrow = v + (size_t)(j0 + j) * ldkv;
+                    if (avx2) attn_axpy_avx2(arow, vrow, p, head_dim);
+                    else attn_axpy_scalar(arow, vrow, p, 0, head_dim);
+                }
+            }
+        } else {
+            gemm(false, false, nq, head_dim, bc, S, ATTN_BC, v + (size_t)j0 * ldkv, ldkv, acc, head_dim, true);
+        }
+    }
+
+    for (int r = 0; r < nq; ++r) {
+        const float inv = sc.l[r] > 0 ? 1.0f / sc.l[r] : 0.0f;
+        const float* arow = acc + (size_t)r * head_dim;
+        float* orow = o + (size_t)r * ldo;
+        for (int d = 0; d < head_dim; ++d) orow[d] = arow[d] * inv;
+        if (lse) lse[r] = sc.m[r] + std::log(sc.l[r]);
+    }
+}
+
+// Multi-head attention over [rows x heads*head_dim] row-major Q/K/V (stride
+// ld) holding packed sequences: sequence b is rows [offsets[b], offsets[b+1])
+// and only attends within itself. Work is split into (head, query block)
+// units run on the thread pool; causal blocks (cheap early, expensive late)
+// are balanced by work stealing. lse, if given, is [heads x rows].
+inline void flash_attention(const float* Q, const float* K, const float* V, float* O,
+                            const std::vector<int>& offsets, int ld, int heads, int head_dim,
+                            bool causal, float* lse = nullptr) {
+    const float scale = 1.0f / std::sqrt((float)head_dim);
+    const int rows = offsets.back();
+    // (sequence, first row of block); a local reference so pool workers
+    // see this thread's list rather than their own thread_local
+    thread_local std::vector<std::pair<int, int>> block_list;
+    auto& blocks = block_list;
+    blocks.clear();
+    double work_est = 0;
+    for (size_t b = 0; b + 1 < offsets.size(); ++b) {
+        const int len = offsets[b + 1] - offsets[b];
+        for (int i0 = 0; i0 < len; i0 += ATTN_BR) blocks.emplace_back((int)b, offsets[b] + i0);
+        work_est += (double)len * len * ld;
+    }
+    const int nblocks = (int)blocks.size();
+    const int units = heads * nblocks;
+    auto run = [&](int u) {
+        const int h = u / nblocks;
+        const int b = blocks[u % nblocks].first, r0 = blocks[u % nblocks].second;
+        const int s0 = offsets[b], len = offsets[b + 1] - s0;
+        const int nq = std::min(ATTN_BR, offsets[b + 1] - r0);
+        const size_t off = (size_t)h * head_dim;
+        flash_attention_block(Q + (size_t)r0 * ld + off, ld, nq, r0 - s0,
+                              K + (size_t)s0 * ld + off, V + (size_t)s0 * ld + off, ld, len,
+                              O + (size_t)r0 * ld + off, ld, head_dim, scale, causal,
+                              lse ? lse + (size_t)h * rows + r0 : nullptr);
+    };
+
+    if (work_est < 4e6) {
+        for (int u = 0; u < units; ++u) run(u);
+        return;
+    }
+    parallel_for(0, units, 1, [&](int u0, int u1) { for (int u = u0; u < u1; ++u) run(u); });
+}
+
+// Single sequence of seq rows.
+inline void flash_attention(const float* Q, const float* K, const float* V, float* O,
+                            int seq, int ld, int heads, int head_dim, bool causal,
+                            float* lse = nullptr) {
+    const std::vector<int> offsets{0, seq};
+    flash_attention(Q, K, V, O, offsets, ld, heads, head_dim, causal, lse);
+}
+
+// ===== Attention backward =====
+// FlashAttention-style backward for one (sequence, head): scores are
+// recomputed tile by tile from Q, K and the forward's log-sum-exp, so
+// nothing seq x seq is ever stored. For a BR x BC tile:
+//   P  = exp(Q K^T * scale - lse)         dV += P^T dO
+//   dP = dO V^T                           dS  = P * (dP - rowsum(dO * O)) * scale
+//   dQ += dS K                            dK += dS^T Q
+// dQ/dK/dV of the unit are overwritten; units own disjoint slices, so they
+// run on the thread pool without atomics.
+inline void flash_attention_backward_unit(const float* q, const float* k, const float* v, const float* o,
+                                          const float* d_o, const float* lse, float* dq, float* dk, float* dv,
+                                          int len, int ld, int head_dim, float scale, bool causal) {
+    thread_local std::vector<float> S(ATTN_BR * ATTN_BC), dP(ATTN_BR * ATTN_BC), D(ATTN_BR);
+    for (int i = 0; i < len; ++i) {
+        std::fill_n(dq + (size_t)i * ld, head_dim, 0.0f);
+        std::fill_n(dk + (size_t)i * ld, head_dim, 0.0f);
+        std::fill_n(dv + (size_t)i * ld, head_dim, 0.0f);
+    }
+    const bool avx2 = has_avx2();
+    for (int i0 = 0; i0 < len; i0 += ATTN_BR) {
+        const int nq = std::min(ATTN_BR, len - i0);
+        for (int r = 0; r < nq; ++r)
+            D[r] = Tensor::dot_simd(d_o + (size_t)(i0 + r) * ld, o + (size_t)(i0 + r) * ld, head_dim);
+        const int kend = causal ? i0 + nq : len;
+        for (int j0 = 0; j0 < kend; j0 += ATTN_BC) {
+            const int bc = std::min(ATTN_BC, kend - j0);
+            gemm_serial(false, true, nq, bc, head_dim, q + (size_t)i0 * ld, ld, k + (size_t)j0 * ld, ld,
+                        S.data(), ATTN_BC, false);
+            gemm_serial(false, true, nq, bc, head_dim, d_o + (size_t)i0 * ld, ld, v + (size_t)j0 * ld, ld,
+                        dP.data(), ATTN_BC, false);
+            for (int r = 0; r < nq; ++r) {
+                float* srow = &S[r * ATTN_BC];
+                float* prow = &dP[r * ATTN_BC];
+                const int valid = causal ? std::min(bc, i0 + r - j0 + 1) : bc;
+                if (avx2) attn_grad_row_avx2(srow, prow, valid, scale, lse[i0 + r], D[r]);
+                else attn_grad_row_scalar(srow, prow, 0, valid, scale, lse[i0 + r], D[r]);
+                for (int j = std::max(valid, 0); j < bc; ++j) srow[j] = prow[j] = 0.0f;
+            }
+            gemm_serial(true, false, bc, head_dim, nq, S.data(), ATTN_BC, d_o + (size_t)i0 * ld, ld,
+                        dv + (size_t)j0 * ld, ld, true);
+            gemm_serial(false, false, nq, head_dim, bc, dP.data(), ATTN_BC, k + (size_t)j0 * ld, ld,
+                        dq + (size_t)i0 * ld, ld, true);
+            gemm_serial(true, false, bc, head_dim, nq, dP.data(), ATTN_BC, q + (size_t)i0 * ld, ld,
+                        dk + (size_t)j0 * ld, ld, true);
+        }
+    }
+}
+
+// Packed-batch backward matching flash_attention(..., lse); lse is the
+// [heads x rows] buffer the forward filled.
+inline void flash_attention_backward(const float* Q, const float* K, const float* V, const float* O,
+                                     const float* dO, const float* lse, float* dQ, float* dK, float* dV,
+                                     const std::vector<int>& offsets, int ld, int heads, int head_dim, bool causal) {
+    const float scale = 1.0f / std::sqrt((float)head_dim);
+    const int rows = offsets.back(), seqs = (int)offsets.size() - 1;
+    parallel_for(0, heads * seqs, 1, [&](int u0, int u1) {
+        for (int u = u0; u < u1; ++u) {
+            const int h = u / seqs, b = u % seqs;
+            const size_t off = (size_t)offsets[b] * ld + (size_t)h * head_dim;
+            flash_attention_backward_unit(Q + off, K + off, V + off, O + off, dO + off, lse + (size_t)h * rows + offsets[b],
+                                          dQ + off, dK + off, dV + off, offsets[b + 1] - offsets[b], ld, head_dim,
+                                          scale, causal);
+        }
+    });
+}
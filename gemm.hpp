@@ -0,0 +1,227 @@
+#pragma once
+#include "threadpool.hpp"
+#include "kernels.hpp"
+#include <algorithm>
+#include <cstdlib>
+#include <cstddef>
+#include <cstring>
+#include <vector>
+
+// ===== Blocked SGEMM =====
+// C[M x N] (+)= op(A)[M x K] * op(B)[K x N], all row-major with leading
+// dimensions, where op() optionally transposes. Transposes are folded into
+// packing, so X^T*dY and dY*W^T never materialize a transposed copy.
+// Goto-style loop nest: B is packed into KC x NC panels (L3), A into
+// MC x KC panels (L2), and a 6x16 register-tiled micro-kernel streams a
+// KC x 16 sliver of B out of L1. The micro-kernel (GEMM_MR x GEMM_NR)
+// comes from the dispatch table in kernels.hpp.
+constexpr int GEMM_MC = 120;
+constexpr int GEMM_KC = 256;
+constexpr int GEMM_NC = 3072;
+
+struct GemmScratch {
+    float* a;
+    float* b;
+    GemmScratch()
+        : a(static_cast<float*>(std::aligned_alloc(64, sizeof(float) * GEMM_MC * GEMM_KC))),
+          b(static_cast<float*>(std::aligned_alloc(64, sizeof(float) * GEMM_KC * GEMM_NC))) {}
+    ~GemmScratch() { std::free(a); std::free(b); }
+    GemmScratch(const GemmScratch&) = delete;
+    GemmScratch& operator=(const GemmScratch&) = delete;
+};
+
+inline GemmScratch& gemm_scratch() {
+    thread_local GemmScratch s;
+    return s;
+}
+
+// Pack an mc x kc block of op(A) into MR-row slivers, k-major, zero-padded.
+inline void gemm_pack_a(bool trans, int mc, int kc, const float* A, int lda, float* buf) {
+    for (int i = 0; i < mc; i += GEMM_MR) {
+        const int mr = std::min(GEMM_MR, mc - i);
+        for (int p = 0; p < kc; ++p) {
+            if (trans) {
+                const float* src = A + (size_t)p * lda + i;
+                for (int r = 0; r < mr; ++r) buf[r] = src[r];
+            } else {
+                for (int r = 0; r < mr; ++r) buf[r] = A[(size_t)(i + r) * lda + p];
+            }
+            for (int r = mr; r < GEMM_MR; ++r) buf[r] = 0.0f;
+            buf += GEMM_MR;
+        }
+    }
+}
+
+// Pack a kc x nc block of op(B) into NR-column slivers, k-major, zero-padded.
+inline void gemm_pack_b(bool trans, int kc, int nc, const float* B, int ldb, float* buf) {
+    for (int j = 0; j < nc; j += GEMM_NR) {
+        const int nr = std::min(GEMM_NR, nc - j);
+        if (trans) {
+            // op(B)(p, j) = B[j * ldb + p]: walk each source row contiguously
+            for (int c = 0; c < nr; ++c) {
+                const float* src = B + (size_t)(j + c) * ldb;
+                for (int p = 0; p < kc; ++p) buf[p * GEMM_NR + c] = src[p];
+            }
+            for (int c = nr; c < GEMM_NR; ++c)
+                for (int p = 0; p < kc; ++p) buf[p * GEMM_NR + c] = 0.0f;
+            buf += (size_t)kc * GEMM_NR;
+            continue;
+        }
+        for (int p = 0; p < kc; ++p) {
+            const float* src = B + (size_t)p * ldb + j;
+            if (nr == GEMM_NR) {
+                std::memcpy(buf, src, GEMM_NR * sizeof(float));
+            } else {
+                for (int c = 0; c < nr; ++c) buf[c] = src[c];
+                for (int c = nr; c < GEMM_NR; ++c) buf[c] = 0.0f;
+            }
+            buf += GEMM_NR;
+        }
+    }
+}
+
+// Edge tiles go through a 6x16 staging buffer so the kernel never
+// touches memory outside C.
+inline void gemm_kernel_edge(const Kernels& k, int mr, int nr, int kc, const float* a, const float* b,
+                             float* c, int ldc, bool load_c) {
+    alignas(64) float tmp[GEMM_MR * GEMM_NR];
+    k.gemm_micro(kc, a, b, tmp, GEMM_NR, false);
+    for (int r = 0; r < mr; ++r)
+        for (int j = 0; j < nr; ++j)
+            c[(size_t)r * ldc + j] = (load_c ? c[(size_t)r * ldc + j] : 0.0f) + tmp[r * GEMM_NR + j];
+}
+
+// C[M x nc] (+)= op(A)[M x kc] * one packed kc x nc panel of B; A and C
+// already point at the panel's k range and columns.
+inline void gemm_macro(const Kernels& k, bool trans_a, int M, int nc, int kc, const float* A, int lda,
+                       const float* bpack, float* C, int ldc, bool load_c, float* abuf) {
+    for (int ic = 0; ic < M; ic += GEMM_MC) {
+        const int mc = std::min(GEMM_MC, M - ic);
+        gemm_pack_a(trans_a, mc, kc, trans_a ? A + ic : A + (size_t)ic * lda, lda, abuf);
+        for (int jr = 0; jr < nc; jr += GEMM_NR) {
+            const int nr = std::min(GEMM_NR, nc - jr);
+            const float* bp = bpack + (size_t)jr * kc;
+            for (int ir = 0; ir < mc; ir += GEMM_MR) {
+                const int mr = std::min(GEMM_MR, mc - ir);
+                const float* ap = abuf + (size_t)ir * kc;
+                float* cp = C + (size_t)(ic + ir) * ldc + jr;
+                if (mr == GEMM_MR && nr == GEMM_NR)
+                    k.gemm_micro(kc, ap, bp, cp, ldc, load_c);
+                else
+                    gemm_kernel_edge(k, mr, nr, kc, ap, bp, cp, ldc, load_c);
+            }
+        }
+    }
+}
+
+// Degenerate shapes; returns true if there is nothing left to multiply.
+inline bool gemm_trivial(int M, int N, int K, float* C, int ldc, bool accumulate) {
+    if (M <= 0 || N <= 0) return true;
+    if (K > 0) return false;
+    if (!accumulate)
+        for (int i = 0; i < M; ++i) std::fill(C + (size_t)i * ldc, C + (size_t)i * ldc + N, 0.0f);
+    return true;
+}
+
+inline void gemm_serial(bool trans_a, bool trans_b, int M, int N, int K, const float* A, int lda,
+                        const float* B, int ldb, float* C, int ldc, bool accumulate) {
+    if (gemm_trivial(M, N, K, C, ldc, accumulate)) return;
+    GemmScratch& s = gemm_scratch();
+    const Kernels& k = kernels();
+    for (int jc = 0; jc < N; jc += GEMM_NC) {
+        const int nc = std::min(GEMM_NC, N - jc);
+        for (int pc = 0; pc < K; pc += GEMM_KC) {
+            const int kc = std::min(GEMM_KC, K - pc);
+            gemm_pack_b(trans_b, kc, nc,
+                        trans_b ? B + (size_t)jc * ldb + pc : B + (size_t)pc * ldb + jc, ldb, s.b);
+            gemm_macro(k, trans_a, M, nc, kc, trans_a ? A + (size_t)pc * lda : A + pc, lda, s.b, C + jc, ldc,
+                       accumulate || pc > 0, s.a);
+        }
+    }
+}
+
+// ===== Prepacked B =====
+// For a B shared by many small GEMMs (the fused MLP runs every row block
+// against the same weight chunk): op(B) [K x N] is packed once, panel by
+// panel in the order gemm_serial visits them, and gemm_serial_packed
+// streams it without repacking. Panel (jc, pc) starts at jc * K + pc *
+// round_up(nc, NR) floats.
+inline size_t gemm_packed_size(int K, int N) {
+    return (size_t)K * ((N + GEMM_NR - 1) / GEMM_NR * GEMM_NR);
+}
+
+// buf is 64-byte aligned, like the scratch panels. NR slivers are packed
+// in parallel across the thread pool.
+inline void gemm_prepack_b(bool trans, int K, int N, const float* B, int ldb, float* buf) {
+    const int slivers = (N + GEMM_NR - 1) / GEMM_NR, threads = num_threads();
+    parallel_for(0, slivers, std::max(1, (slivers + 2 * threads - 1) / (2 * threads)), [&](int s0, int s1) {
+        for (int s = s0; s < s1; ++s) {
+            const int j = s * GEMM_NR, jc = j / GEMM_NC * GEMM_NC;
+            const int ncp = (std::min(GEMM_NC, N - jc) + GEMM_NR - 1) / GEMM_NR * GEMM_NR;
+            for (int pc = 0; pc < K; pc += GEMM_KC) {
+                const int kc = std::min(GEMM_KC, K - pc);
+                gemm_pack_b(trans, kc, std::min(GEMM_NR, N - j),
+                            trans ? B + (size_t)j * ldb + pc : B + (size_t)pc * ldb + j, ldb,
+                            buf + (size_t)jc * K + (size_t)pc * ncp + (size_t)(j - jc) * kc);
+            }
+        }
+    });
+}
+
+// C[M x N] (+)= op(A)[M x K] * B, B from gemm_prepack_b(K, N).
+inline void gemm_serial_packed(bool trans_a, int M, int N, int K, const float* A, int lda, const float* bpack,
+                               float* C, int ldc, bool accumulate) {
+    if (gemm_trivial(M, N, K, C, ldc, accumulate)) return;
+    GemmScratch& s = gemm_scratch();
+    const Kernels& k = kernels();
+    for (int jc = 0; jc < N; jc += GEMM_NC) {
+        const int nc = std::min(GEMM_NC, N - jc);
+        const int ncp = (nc + GEMM_NR - 1) / GEMM_NR * GEMM_NR;
+        for (int pc = 0; pc < K; pc += GEMM_KC) {
+            const int kc = std::min(GEMM_KC, K - pc);
+            gemm_macro(k, trans_a, M, nc, kc, trans_a ? A + (size_t)pc * lda : A + pc, lda,
+                       bpack + (size_t)jc * K + (size_t)pc * ncp, C + jc, ldc, accumulate || pc > 0, s.a);
+        }
+    }
+}
+
+// Row panels are split across the thread pool; skinny problems (decode,
+// M < a few panels) are split across column slivers instead. Chunks are
+// sized for about two per thread so stealing can even out stragglers
+// without repacking B too often.
+inline void gemm(bool trans_a, bool trans_b, int M, int N, int K, const float* A, int lda,
+                 const float* B, int ldb, float* C, int ldc, bool accumulate = false) {
+    const double flops = 2.0 * M * N * K;
+    const int threads = (int)std::min<double>(num_threads(), std::max(1.0, flops / 4e6));
+    if (threads <= 1) {
+        gemm_serial(trans_a, trans_b, M, N, K, A, lda, B, ldb, C, ldc, accumulate);
+        return;
+    }
+
+    const bool split_rows = M >= threads * GEMM_MR * 4;
+    const int units = split_rows ? (M + GEMM_MR - 1) / GEMM_MR : (N + GEMM_NR - 1) / GEMM_NR;
+    const int grain = std::max(split_rows ? 4 : 1, (units + 2 * threads - 1) / (2 * threads));
+    parallel_for(0, units, grain, [&](int u0, int u1) {
+        if (split_rows) {
+            const int i0 = u0 * GEMM_MR, i1 = std::min(M, u1 * GEMM_MR);
+            gemm_serial(trans_a, trans_b, i1 - i0, N, K,
+                        trans_a ? A + i0 : A + (size_t)i0 * lda, lda, B, ldb,
+                        C + (size_t)i0 * ldc, ldc, accumulate);
+        } else {
+            const int j0 = u0 * GEMM_NR, j1 = std::min(N, u1 * GEMM_NR);
+            gemm_serial(trans_a, trans_b, M, j1 - j0, K, A, lda,
+                        trans_b ? B + (size_t)j0 * ldb : B + j0, ldb, C + j0, ldc, accumulate);
+        }
+    });
+}
+
+inline void gemm(int M, int N, int K, const float* A, int lda,
+                 const float* B, int ldb, float* C, int ldc, bool accumulate = false) {
+    gemm(false, false, M, N, K, A, lda, B, ldb, C, ldc, accumulate);
+}
+
+// out[j] += sum_i A[i * lda + j] for an M x N block (bias gradients).
+inline void colsum_accumulate(int M, int N, const float* A, int lda, float* out) {
+    const Kernels& k = kernels();
+    for (int i = 0; i < M; ++i) k.add(out, A + (size_t)i * lda, N);
+}
@@ -0,0 +1,597 @@
+#pragma once
+#include <immintrin.h>
+#include <algorithm>
+#include <cmath>
+#include <cstddef>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <limits>
+
+// ===== Runtime kernel dispatch =====
+// The innermost loops come in scalar, AVX2 and AVX-512 variants: dot, the
+// GEMM micro-kernel, softmax rows, LayerNorm rows and the element-wise
+// adds of the residual stream and the gradient reduction. kernels()
+// returns the table for cpu_isa(), chosen once at first use: the widest
+// ISA that cpuid and the OS report, or a narrower one forced with
+//
+//   CARBON_ISA=scalar|avx2|avx512 ./carbon
+//
+// Every variant carries its own target attribute, so one binary built for
+// baseline x86-64 (no -mavx2) carries every variant and only runs the ones
+// the CPU has. The rest of the hand-vectorized code follows the same rule:
+// CARBON_AVX2 functions (and lambdas) behind has_avx2(), with a scalar
+// fallback. Never call a CARBON_AVX2 function without checking it.
+#define CARBON_AVX2 __attribute__((target("avx2,fma")))
+#define CARBON_AVX512 __attribute__((target("avx512f,avx2,fma")))
+
+constexpr int GEMM_MR = 6;   // micro-kernel tile: rows of C
+constexpr int GEMM_NR = 16;  // micro-kernel tile: columns of C
+
+enum class Isa { Scalar = 0, AVX2 = 1, AVX512 = 2 };
+
+inline const char* isa_name(Isa isa) {
+    switch (isa) {
+    case Isa::AVX512: return "avx512";
+    case Isa::AVX2: return "avx2";
+    default: return "scalar";
+    }
+}
+
+// Widest ISA this CPU runs. __builtin_cpu_supports reads cpuid and also
+// checks (xgetbv) that the OS saves the wider registers.
+inline Isa cpu_detect_isa() {
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx512f")) return Isa::AVX512;
+    if (__builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma")) return Isa::AVX2;
+    return Isa::Scalar;
+}
+
+// The detected ISA, lowered by CARBON_ISA if set.
+inline Isa cpu_isa() {
+    static const Isa isa = [] {
+        const Isa detected = cpu_detect_isa();
+        const char* env = std::getenv("CARBON_ISA");
+        if (!env || !*env) return detected;
+        Isa want;
+        if (!std::strcmp(env, "scalar")) want = Isa::Scalar;
+        else if (!std::strcmp(env, "avx2")) want = Isa::AVX2;
+        else if (!std::strcmp(env, "avx512")) want = Isa::AVX512;
+        else {
+            std::cerr << "[CPU] Error: unknown CARBON_ISA=" << env << ", using " << isa_name(detected) << "\n";
+            return detected;
+        }
+        if (want > detected) {
+            std::cerr << "[CPU] Error: this CPU does not support CARBON_ISA=" << env << ", using "
+                      << isa_name(detected) << "\n";
+            return detected;
+        }
+        return want;
+    }();
+    return isa;
+}
+
+struct Kernels {
+    Isa isa;
+    // sum of a[i] * b[i]
+    float (*dot)(const float* a, const float* b, int n);
+    // c[MR x NR] (+)= a * b over kc steps; a and b packed by gemm_pack_a/b.
+    void (*gemm_micro)(int kc, const float* a, const float* b, float* c, int ldc, bool load_c);
+    // x[0, n) = softmax(x[0, n)), in place
+    void (*softmax_row)(float* x, int n);
+    // y = (x - mean) * rstd * gamma + beta for one row of n; with r, the row
+    // s = x + r is written (s may alias x) and normalized instead.
+    void (*layernorm_row)(const float* x, const float* r, float* s, float* y, const float* gamma,
+                          const float* beta, int n, float eps, float* mean, float* rstd);
+    // dx for one row from dL/dy g; adds the row's gamma/beta grads into dgamma/dbeta.
+    void (*layernorm_backward_row)(const float* x, const float* g, const float* gamma, float mean, float rstd,
+                                   float* dx, float* dgamma, float* dbeta, int n);
+    void (*add)(float* dst, const float* src, size_t n);  // dst += src
+    void (*scale)(float* x, float s, size_t n);           // x *= s
+};
+
+// ----- scalar -----
+
+inline float dot_scalar(const float* a, const float* b, int n) {
+    float sum = 0.0f;
+    for (int i = 0; i < n; ++i) sum += a[i] * b[i];
+    return sum;
+}
+
+inline void gemm_micro_scalar(int kc, const float* a, const float* b, float* c, int ldc, bool load_c) {
+    float acc[GEMM_MR][GEMM_NR];
+    for (int r = 0; r < GEMM_MR; ++r)
+        for (int j = 0; j < GEMM_NR; ++j) acc[r][j] = load_c ? c[(size_t)r * ldc + j] : 0.0f;
+    for (int p = 0; p < kc; ++p, a += GEMM_MR, b += GEMM_NR)
+        for (int r = 0; r < GEMM_MR; ++r)
+            for (int j = 0; j < GEMM_NR; ++j) acc[r][j] += a[r] * b[j];
+    for (int r = 0; r < GEMM_MR; ++r)
+        for (int j = 0; j < GEMM_NR; ++j) c[(size_t)r * ldc + j] = acc[r][j];
+}
+
+inline void softmax_row_scalar(float* x, int n) {
+    float maxv = -std::numeric_limits<float>::infinity(), sum = 0.0f;
+    for (int j = 0; j < n; ++j) maxv = std::max(maxv, x[j]);
+    for (int j = 0; j < n; ++j) { x[j] = std::exp(x[j] - maxv); sum += x[j]; }
+    const float inv = 1.0f / sum;
+    for (int j = 0; j < n; ++j) x[j] *= inv;
+}
+
+inline void layernorm_row_scalar(const float* x, const float* r, float* s, float* y, const float* gamma,
+                                 const float* beta, int n, float eps, float* mean, float* rstd) {
+    float sum = 0.0f;
+    if (r) {
+        for (int j = 0; j < n; ++j) { s[j] = x[j] + r[j]; sum += s[j]; }
+        x = s;
+    } else {
+        for (int j = 0; j < n; ++j) sum += x[j];
+    }
+    const float mu = sum / n;
+    float var = 0.0f;
+    for (int j = 0; j < n; ++j) var += (x[j] - mu) * (x[j] - mu);
+    const float rs = 1.0f / std::sqrt(var / n + eps);
+    for (int j = 0; j < n; ++j) y[j] = (x[j] - mu) * rs * gamma[j] + beta[j];
+    *mean = mu;
+    *rstd = rs;
+}
+
+inline void layernorm_backward_row_scalar(const float* x, const float* g, const float* gamma, float mean, float rstd,
+                                          float* dx, float* dgamma, float* dbeta, int n) {
+    float sum1 = 0.0f, sum2 = 0.0f;
+    for (int j = 0; j < n; ++j) {
+        const float xh = (x[j] - mean) * rstd, dxh = g[j] * gamma[j];
+        sum1 += dxh;
+        sum2 += dxh * xh;
+        dgamma[j] += g[j] * xh;
+        dbeta[j] += g[j];
+    }
+    const float a = sum1 / n, b = sum2 / n;
+    for (int j = 0; j < n; ++j) dx[j] = rstd * (g[j] * gamma[j] - a - (x[j] - mean) * rstd * b);
+}
+
+inline void add_scalar(float* dst, const float* src, size_t n) {
+    for (size_t i = 0; i < n; ++i) dst[i] += src[i];
+}
+
+inline void scale_scalar(float* x, float s, size_t n) {
+    for (size_t i = 0; i < n; ++i) x[i] *= s;
+}
+
+// ----- AVX2 -----
+
+CARBON_AVX2 inline float hmax256_ps(__m256 v) {
+    __m128 m = _mm_max_ps(_mm256_castps256_ps128(v), _mm256_extractf128_ps(v, 1));
+    m = _mm_max_ps(m, _mm_movehl_ps(m, m));
+    m = _mm_max_ss(m, _mm_movehdup_ps(m));
+    return _mm_cvtss_f32(m);
+}
+
+CARBON_AVX2 inline float hsum256_ps(__m256 v) {
+    __m128 s = _mm_add_ps(_mm256_castps256_ps128(v), _mm256_extractf128_ps(v, 1));
+    s = _mm_add_ps(s, _mm_movehl_ps(s, s));
+    s = _mm_add_ss(s, _mm_movehdup_ps(s));
+    return _mm_cvtss_f32(s);
+}
+
+// Vectorized e^x (Cephes-style range reduction + degree-5 polynomial),
+// ~1 ulp over the float range; inputs below -87.3 flush to 0.
+CARBON_AVX2 inline __m256 exp256_ps(__m256 x) {
+    const __m256 lo = _mm256_set1_ps(-87.3365f);
+    const __m256 underflow = _mm256_cmp_ps(x, lo, _CMP_LT_OQ);
+    x = _mm256_min_ps(_mm256_max_ps(x, lo), _mm256_set1_ps(88.3762626647949f));
+
+    __m256 fx = _mm256_floor_ps(_mm256_fmadd_ps(x, _mm256_set1_ps(1.44269504088896341f), _mm256_set1_ps(0.5f)));
+    x = _mm256_fmadd_ps(fx, _mm256_set1_ps(-0.693359375f), x);
+    x = _mm256_fmadd_ps(fx, _mm256_set1_ps(2.12194440e-4f), x);
+
+    __m256 y = _mm256_set1_ps(1.9875691500E-4f);
+    y = _mm256_fmadd_ps(y, x, _mm256_set1_ps(1.3981999507E-3f));
+    y = _mm256_fmadd_ps(y, x, _mm256_set1_ps(8.3334519073E-3f));
+    y = _mm256_fmadd_ps(y, x, _mm256_set1_ps(4.1665795894E-2f));
+    y = _mm256_fmadd_ps(y, x, _mm256_set1_ps(1.6666665459E-1f));
+    y = _mm256_fmadd_ps(y, x, _mm256_set1_ps(5.0000001201E-1f));
+    y = _mm256_fmadd_ps(y, _mm256_mul_ps(x, x), _mm256_add_ps(x, _mm256_set1_ps(1.0f)));
+
+    __m256i n = _mm256_slli_epi32(_mm256_add_epi32(_mm256_cvttps_epi32(fx), _mm256_set1_epi32(127)), 23);
+    y = _mm256_mul_ps(y, _mm256_castsi256_ps(n));
+    return _mm256_andnot_ps(underflow, y);
+}
+
+CARBON_AVX2 inline float dot_avx2(const float* a, const float* b, int n) {
+    __m256 acc = _mm256_setzero_ps();
+    int i = 0;
+    for (; i + 8 <= n; i += 8) acc = _mm256_fmadd_ps(_mm256_loadu_ps(a + i), _mm256_loadu_ps(b + i), acc);
+    float sum = hsum256_ps(acc);
+    for (; i < n; ++i) sum += a[i] * b[i];
+    return sum;
+}
+
+// 6x16 micro-kernel: 12 ymm accumulators, one A broadcast per row per k.
+// Accumulators are spelled out so the compiler keeps them in registers.
+CARBON_AVX2 inline void gemm_micro_avx2(int kc, const float* a, const float* b, float* c, int ldc, bool load_c) {
+    float* c0 = c;
+    float* c1 = c0 + ldc;
+    float* c2 = c1 + ldc;
+    float* c3 = c2 + ldc;
+    float* c4 = c3 + ldc;
+    float* c5 = c4 + ldc;
+    __m256 r00, r01, r10, r11, r20, r21, r30, r31, r40, r41, r50, r51;
+    if (load_c) {
+        r00 = _mm256_loadu_ps(c0); r01 = _mm256_loadu_ps(c0 + 8);
+        r10 = _mm256_loadu_ps(c1); r11 = _mm256_loadu_ps(c1 + 8);
+        r20 = _mm256_loadu_ps(c2); r21 = _mm256_loadu_ps(c2 + 8);
+        r30 = _mm256_loadu_ps(c3); r31 = _mm256_loadu_ps(c3 + 8);
+        r40 = _mm256_loadu_ps(c4); r41 = _mm256_loadu_ps(c4 + 8);
+        r50 = _mm256_loadu_ps(c5); r51 = _mm256_loadu_ps(c5 + 8);
+    } else {
+        r00 = r01 = r10 = r11 = r20 = r21 = _mm256_setzero_ps();
+        r30 = r31 = r40 = r41 = r50 = r51 = _mm256_setzero_ps();
+    }
+    for (int p = 0; p < kc; ++p) {
+        const __m256 b0 = _mm256_load_ps(b);
+        const __m256 b1 = _mm256_load_ps(b + 8);
+        __m256 ar;
+        ar = _mm256_broadcast_ss(a + 0); r00 = _mm256_fmadd_ps(ar, b0, r00); r01 = _mm256_fmadd_ps(ar, b1, r01);
+        ar = _mm256_broadcast_ss(a + 1); r10 = _mm256_fmadd_ps(ar, b0, r10); r11 = _mm256_fmadd_ps(ar, b1, r11);
+        ar = _mm256_broadcast_ss(a + 2); r20 = _mm256_fmadd_ps(ar, b0, r20); r21 = _mm256_fmadd_ps(ar, b1, r21);
+        ar = _mm256_broadcast_ss(a + 3); r30 = _mm256_fmadd_ps(ar, b0, r30); r31 = _mm256_fmadd_ps(ar, b1, r31);
+        ar = _mm256_broadcast_ss(a + 4); r40 = _mm256_fmadd_ps(ar, b0, r40); r41 = _mm256_fmadd_ps(ar, b1, r41);
+        ar = _mm256_broadcast_ss(a + 5); r50 = _mm256_fmadd_ps(ar, b0, r50); r51 = _mm256_fmadd_ps(ar, b1, r51);
+        a += GEMM_MR;
+        b += GEMM_NR;
+    }
+    _mm256_storeu_ps(c0, r00); _mm256_storeu_ps(c0 + 8, r01);
+    _mm256_storeu_ps(c1, r10); _mm256_storeu_ps(c1 + 8, r11);
+    _mm256_storeu_ps(c2, r20); _mm256_storeu_ps(c2 + 8, r21);
+    _mm256_storeu_ps(c3, r30); _mm256_storeu_ps(c3 + 8, r31);
+    _mm256_storeu_ps(c4, r40); _mm256_storeu_ps(c4 + 8, r41);
+    _mm256_storeu_ps(c5, r50); _mm256_storeu_ps(c5 + 8, r51);
+}
+
+CARBON_AVX2 inline void softmax_row_avx2(float* x, int n) {
+    __m256 vmax = _mm256_set1_ps(-std::numeric_limits<float>::infinity());
+    int j = 0;
+    for (; j + 8 <= n; j += 8) vmax = _mm256_max_ps(vmax, _mm256_loadu_ps(x + j));
+    float maxv = hmax256_ps(vmax);
+    for (; j < n; ++j) maxv = std::max(maxv, x[j]);
+    const __m256 vm = _mm256_set1_ps(maxv);
+    __m256 vs = _mm256_setzero_ps();
+    for (j = 0; j + 8 <= n; j += 8) {
+        const __m256 e = exp256_ps(_mm256_sub_ps(_mm256_loadu_ps(x + j), vm));
+        _mm256_storeu_ps(x + j, e);
+        vs = _mm256_add_ps(vs, e);
+    }
+    float sum = hsum256_ps(vs);
+    for (; j < n; ++j) { x[j] = std::exp(x[j] - maxv); sum += x[j]; }
+    const float inv = 1.0f / sum;
+    const __m256 vi = _mm256_set1_ps(inv);
+    for (j = 0; j + 8 <= n; j += 8) _mm256_storeu_ps(x + j, _mm256_mul_ps(_mm256_loadu_ps(x + j), vi));
+    for (; j < n; ++j) x[j] *= inv;
+}
+
+// Three passes over a row that stays in L1: mean (plus the residual add),
+// variance around the mean, normalize.
+CARBON_AVX2 inline void layernorm_row_avx2(const float* x, const float* r, float* s, float* y, const float* gamma,
+                                           const float* beta, int n, float eps, float* mean, float* rstd) {
+    __m256 acc = _mm256_setzero_ps();
+    float sum = 0.0f;
+    int j = 0;
+    if (r) {
+        for (; j + 8 <= n; j += 8) {
+            const __m256 v = _mm256_add_ps(_mm256_loadu_ps(x + j), _mm256_loadu_ps(r + j));
+            _mm256_storeu_ps(s + j, v);
+            acc = _mm256_add_ps(acc, v);
+        }
+        for (; j < n; ++j) { s[j] = x[j] + r[j]; sum += s[j]; }
+        x = s;
+    } else {
+        for (; j + 8 <= n; j += 8) acc = _mm256_add_ps(acc, _mm256_loadu_ps(x + j));
+        for (; j < n; ++j) sum += x[j];
+    }
+    sum += hsum256_ps(acc);
+    const float mu = sum / n;
+    const __m256 vm = _mm256_set1_ps(mu);
+    acc = _mm256_setzero_ps();
+    for (j = 0; j + 8 <= n; j += 8) {
+        const __m256 d = _mm256_sub_ps(_mm256_loadu_ps(x + j), vm);
+        acc = _mm256_fmadd_ps(d, d, acc);
+    }
+    float var = hsum256_ps(acc);
+    for (; j < n; ++j) var += (x[j] - mu) * (x[j] - mu);
+    const float rs = 1.0f / std::sqrt(var / n + eps);
+    const __m256 vr = _mm256_set1_ps(rs);
+    for (j = 0; j + 8 <= n; j += 8) {
+        const __m256 xh = _mm256_mul_ps(_mm256_sub_ps(_mm256_loadu_ps(x + j), vm), vr);
+        _mm256_storeu_ps(y + j, _mm256_fmadd_ps(xh, _mm256_loadu_ps(gamma + j), _mm256_loadu_ps(beta + j)));
+    }
+    for (; j < n; ++j) y[j] = (x[j] - mu) * rs * gamma[j] + beta[j];
+    *mean = mu;
+    *rstd = rs;
+}
+
+CARBON_AVX2 inline void layernorm_backward_row_avx2(const float* x, const float* g, const float* gamma, float mean,
+                                                    float rstd, float* dx, float* dgamma, float* dbeta, int n) {
+    const __m256 vm = _mm256_set1_ps(mean), vr = _mm256_set1_ps(rstd);
+    __m256 s1 = _mm256_setzero_ps(), s2 = _mm256_setzero_ps();
+    int j = 0;
+    for (; j + 8 <= n; j += 8) {
+        const __m256 xh = _mm256_mul_ps(_mm256_sub_ps(_mm256_loadu_ps(x + j), vm), vr), gj = _mm256_loadu_ps(g + j);
+        const __m256 dxh = _mm256_mul_ps(gj, _mm256_loadu_ps(gamma + j));
+        s1 = _mm256_add_ps(s1, dxh);
+        s2 = _mm256_fmadd_ps(dxh, xh, s2);
+        _mm256_storeu_ps(dgamma + j, _mm256_fmadd_ps(gj, xh, _mm256_loadu_ps(dgamma + j)));
+        _mm256_storeu_ps(dbeta + j, _mm256_add_ps(gj, _mm256_loadu_ps(dbeta + j)));
+    }
+    float sum1 = hsum256_ps(s1), sum2 = hsum256_ps(s2);
+    for (; j < n; ++j) {
+        const float xh = (x[j] - mean) * rstd, dxh = g[j] * gamma[j];
+        sum1 += dxh;
+        sum2 += dxh * xh;
+        dgamma[j] += g[j] * xh;
+        dbeta[j] += g[j];
+    }
+    const float a = sum1 / n, b = sum2 / n;
+    const __m256 va = _mm256_set1_ps(a), vb = _mm256_set1_ps(b);
+    for (j = 0; j + 8 <= n; j += 8) {
+        const __m256 xh = _mm256_mul_ps(_mm256_sub_ps(_mm256_loadu_ps(x + j), vm), vr);
+        const __m256 dxh = _mm256_mul_ps(_mm256_loadu_ps(g + j), _mm256_loadu_ps(gamma + j));
+        _mm256_storeu_ps(dx + j, _mm256_mul_ps(vr, _mm256_sub_ps(_mm256_sub_ps(dxh, va), _mm256_mul_ps(xh, vb))));
+    }
+    for (; j < n; ++j) dx[j] = rstd * (g[j] * gamma[j] - a - (x[j] - mean) * rstd * b);
+}
+
+CARBON_AVX2 inline void add_avx2(float* dst, const float* src, size_t n) {
+    size_t i = 0;
+    for (; i + 8 <= n; i += 8) _mm256_storeu_ps(dst + i, _mm256_add_ps(_mm256_loadu_ps(dst + i), _mm256_loadu_ps(src + i)));
+    for (; i < n; ++i) dst[i] += src[i];
+}
+
+CARBON_AVX2 inline void scale_avx2(float* x, float s, size_t n) {
+    const __m256 vs = _mm256_set1_ps(s);
+    size_t i = 0;
+    for (; i + 8 <= n; i += 8) _mm256_storeu_ps(x + i, _mm256_mul_ps(_mm256_loadu_ps(x + i), vs));
+    for (; i < n; ++i) x[i] *= s;
+}
+
+// ----- AVX-512 -----
+// Tails use masked loads and stores instead of scalar loops. GCC 12 warns
+// about the deliberately undefined vectors inside its own AVX-512 headers.
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wuninitialized"
+#pragma GCC diagnostic ignored "-Wmaybe-uninitialized"
+
+inline __mmask16 tail_mask16(size_t rem) { return static_cast<__mmask16>((1u << rem) - 1); }
+
+CARBON_AVX512 inline __m512 exp512_ps(__m512 x) {
+    const __m512 lo = _mm512_set1_ps(-87.3365f);
+    const __mmask16 underflow = _mm512_cmp_ps_mask(x, lo, _CMP_LT_OQ);
+    x = _mm512_min_ps(_mm512_max_ps(x, lo), _mm512_set1_ps(88.3762626647949f));
+
+    __m512 fx = _mm512_roundscale_ps(_mm512_fmadd_ps(x, _mm512_set1_ps(1.44269504088896341f), _mm512_set1_ps(0.5f)),
+                                     _MM_FROUND_TO_NEG_INF | _MM_FROUND_NO_EXC);
+    x = _mm512_fmadd_ps(fx, _mm512_set1_ps(-0.693359375f), x);
+    x = _mm512_fmadd_ps(fx, _mm512_set1_ps(2.12194440e-4f), x);
+
+    __m512 y = _mm512_set1_ps(1.9875691500E-4f);
+    y = _mm512_fmadd_ps(y, x, _mm512_set1_ps(1.3981999507E-3f));
+    y = _mm512_fmadd_ps(y, x, _mm512_set1_ps(8.3334519073E-3f));
+    y = _mm512_fmadd_ps(y, x, _mm512_set1_ps(4.1665795894E-2f));
+    y = _mm512_fmadd_ps(y, x, _mm512_set1_ps(1.6666665459E-1f));
+    y = _mm512_fmadd_ps(y, x, _mm512_set1_ps(5.0000001201E-1f));
+    y = _mm512_fmadd_ps(y, _mm512_mul_ps(x, x), _mm512_add_ps(x, _mm512_set1_ps(1.0f)));
+
+    __m512i n = _mm512_slli_epi32(_mm512_add_epi32(_mm512_cvttps_epi32(fx), _mm512_set1_epi32(127)), 23);
+    y = _mm512_mul_ps(y, _mm512_castsi512_ps(n));
+    return _mm512_maskz_mov_ps(static_cast<__mmask16>(~underflow), y);
+}
+
+CARBON_AVX512 inline float dot_avx512(const float* a, const float* b, int n) {
+    __m512 acc0 = _mm512_setzero_ps(), acc1 = _mm512_setzero_ps();
+    int i = 0;
+    for (; i + 32 <= n; i += 32) {
+        acc0 = _mm512_fmadd_ps(_mm512_loadu_ps(a + i), _mm512_loadu_ps(b + i), acc0);
+        acc1 = _mm512_fmadd_ps(_mm512_loadu_ps(a + i + 16), _mm512_loadu_ps(b + i + 16), acc1);
+    }
+    for (; i + 16 <= n; i += 16) acc0 = _mm512_fmadd_ps(_mm512_loadu_ps(a + i), _mm512_loadu_ps(b + i), acc0);
+    if (i < n) {
+        const __mmask16 m = tail_mask16(n - i);
+        acc1 = _mm512_fmadd_ps(_mm512_maskz_loadu_ps(m, a + i), _mm512_maskz_loadu_ps(m, b + i), acc1);
+    }
+    return _mm512_reduce_add_ps(_mm512_add_ps(acc0, acc1));
+}
+
+// A 16-wide B row is one zmm, so a k step is six FMAs. Two k steps run
+// into separate accumulator sets (12 zmm) to cover the FMA latency.
+CARBON_AVX512 inline void gemm_micro_avx512(int kc, const float* a, const float* b, float* c, int ldc, bool load_c) {
+    float* c0 = c;
+    float* c1 = c0 + ldc;
+    float* c2 = c1 + ldc;
+    float* c3 = c2 + ldc;
+    float* c4 = c3 + ldc;
+    float* c5 = c4 + ldc;
+    __m512 r0, r1, r2, r3, r4, r5;
+    if (load_c) {
+        r0 = _mm512_loadu_ps(c0); r1 = _mm512_loadu_ps(c1); r2 = _mm512_loadu_ps(c2);
+        r3 = _mm512_loadu_ps(c3); r4 = _mm512_loadu_ps(c4); r5 = _mm512_loadu_ps(c5);
+    } else {
+        r0 = r1 = r2 = r3 = r4 = r5 = _mm512_setzero_ps();
+    }
+    __m512 s0, s1, s2, s3, s4, s5;
+    s0 = s1 = s2 = s3 = s4 = s5 = _mm512_setzero_ps();
+    int p = 0;
+    for (; p + 2 <= kc; p += 2) {
+        const __m512 b0 = _mm512_load_ps(b);
+        const __m512 b1 = _mm512_load_ps(b + GEMM_NR);
+        r0 = _mm512_fmadd_ps(_mm512_set1_ps(a[0]), b0, r0); s0 = _mm512_fmadd_ps(_mm512_set1_ps(a[6]), b1, s0);
+        r1 = _mm512_fmadd_ps(_mm512_set1_ps(a[1]), b0, r1); s1 = _mm512_fmadd_ps(_mm512_set1_ps(a[7]), b1, s1);
+        r2 = _mm512_fmadd_ps(_mm512_set1_ps(a[2]), b0, r2); s2 = _mm512_fmadd_ps(_mm512_set1_ps(a[8]), b1, s2);
+        r3 = _mm512_fmadd_ps(_mm512_set1_ps(a[3]), b0, r3); s3 = _mm512_fmadd_ps(_mm512_set1_ps(a[9]), b1, s3);
+        r4 = _mm512_fmadd_ps(_mm512_set1_ps(a[4]), b0, r4); s4 = _mm512_fmadd_ps(_mm512_set1_ps(a[10]), b1, s4);
+        r5 = _mm512_fmadd_ps(_mm512_set1_ps(a[5]), b0, r5); s5 = _mm512_fmadd_ps(_mm512_set1_ps(a[11]), b1, s5);
+        a += 2 * GEMM_MR;
+        b += 2 * GEMM_NR;
+    }
+    if (p < kc) {
+        const __m512 b0 = _mm512_load_ps(b);
+        r0 = _mm512_fmadd_ps(_mm512_set1_ps(a[0]), b0, r0);
+        r1 = _mm512_fmadd_ps(_mm512_set1_ps(a[1]), b0, r1);
+        r2 = _mm512_fmadd_ps(_mm512_set1_ps(a[2]), b0, r2);
+        r3 = _mm512_fmadd_ps(_mm512_set1_ps(a[3]), b0, r3);
+        r4 = _mm512_fmadd_ps(_mm512_set1_ps(a[4]), b0, r4);
+        r5 = _mm512_fmadd_ps(_mm512_set1_ps(a[5]), b0, r5);
+    }
+    _mm512_storeu_ps(c0, _mm512_add_ps(r0, s0));
+    _mm512_storeu_ps(c1, _mm512_add_ps(r1, s1));
+    _mm512_storeu_ps(c2, _mm512_add_ps(r2, s2));
+    _mm512_storeu_ps(c3, _mm512_add_ps(r3, s3));
+    _mm512_storeu_ps(c4, _mm512_add_ps(r4, s4));
+    _mm512_storeu_ps(c5, _mm512_add_ps(r5, s5));
+}
+
+CARBON_AVX512 inline void softmax_row_avx512(float* x, int n) {
+    const __m512 ninf = _mm512_set1_ps(-std::numeric_limits<float>::infinity());
+    const __mmask16 m = tail_mask16(n % 16);
+    const int full = n - n % 16;
+    __m512 vmax = ninf;
+    for (int j = 0; j < full; j += 16) vmax = _mm512_max_ps(vmax, _mm512_loadu_ps(x + j));
+    if (m) vmax = _mm512_max_ps(vmax, _mm512_mask_loadu_ps(ninf, m, x + full));
+    const __m512 vm = _mm512_set1_ps(_mm512_reduce_max_ps(vmax));
+    __m512 vs = _mm512_setzero_ps();
+    for (int j = 0; j < full; j += 16) {
+        const __m512 e = exp512_ps(_mm512_sub_ps(_mm512_loadu_ps(x + j), vm));
+        _mm512_storeu_ps(x + j, e);
+        vs = _mm512_add_ps(vs, e);
+    }
+    if (m) {
+        const __m512 e = exp512_ps(_mm512_sub_ps(_mm512_maskz_loadu_ps(m, x + full), vm));
+        _mm512_mask_storeu_ps(x + full, m, e);
+        vs = _mm512_mask_add_ps(vs, m, vs, e);
+    }
+    const __m512 vi = _mm512_set1_ps(1.0f / _mm512_reduce_add_ps(vs));
+    for (int j = 0; j < full; j += 16) _mm512_storeu_ps(x + j, _mm512_mul_ps(_mm512_loadu_ps(x + j), vi));
+    if (m) _mm512_mask_storeu_ps(x + full, m, _mm512_mul_ps(_mm512_maskz_loadu_ps(m, x + full), vi));
+}
+
+CARBON_AVX512 inline void layernorm_row_avx512(const float* x, const float* r, float* s, float* y,
+                                               const float* gamma, const float* beta, int n, float eps, float* mean,
+                                               float* rstd) {
+    const __mmask16 m = tail_mask16(n % 16);
+    const int full = n - n % 16;
+    __m512 acc = _mm512_setzero_ps();
+    if (r) {
+        for (int j = 0; j < full; j += 16) {
+            const __m512 v = _mm512_add_ps(_mm512_loadu_ps(x + j), _mm512_loadu_ps(r + j));
+            _mm512_storeu_ps(s + j, v);
+            acc = _mm512_add_ps(acc, v);
+        }
+        if (m) {
+            const __m512 v = _mm512_add_ps(_mm512_maskz_loadu_ps(m, x + full), _mm512_maskz_loadu_ps(m, r + full));
+            _mm512_mask_storeu_ps(s + full, m, v);
+            acc = _mm512_add_ps(acc, v);
+        }
+        x = s;
+    } else {
+        for (int j = 0; j < full; j += 16) acc = _mm512_add_ps(acc, _mm512_loadu_ps(x + j));
+        if (m) acc = _mm512_add_ps(acc, _mm512_maskz_loadu_ps(m, x + full));
+    }
+    const float mu = _mm512_reduce_add_ps(acc) / n;
+    const __m512 vm = _mm512_set1_ps(mu);
+    acc = _mm512_setzero_ps();
+    for (int j = 0; j < full; j += 16) {
+        const __m512 d = _mm512_sub_ps(_mm512_loadu_ps(x + j), vm);
+        acc = _mm512_fmadd_ps(d, d, acc);
+    }
+    if (m) {
+        const __m512 d = _mm512_maskz_sub_ps(m, _mm512_maskz_loadu_ps(m, x + full), vm);
+        acc = _mm512_fmadd_ps(d, d, acc);
+    }
+    const float rs = 1.0f / std::sqrt(_mm512_reduce_add_ps(acc) / n + eps);
+    const __m512 vr = _mm512_set1_ps(rs);
+    for (int j = 0; j < full; j += 16) {
+        const __m512 xh = _mm512_mul_ps(_mm512_sub_ps(_mm512_loadu_ps(x + j), vm), vr);
+        _mm512_storeu_ps(y + j, _mm512_fmadd_ps(xh, _mm512_loadu_ps(gamma + j), _mm512_loadu_ps(beta + j)));
+    }
+    if (m) {
+        const __m512 xh = _mm512_mul_ps(_mm512_sub_ps(_mm512_maskz_loadu_ps(m, x + full), vm), vr);
+        _mm512_mask_storeu_ps(y + full, m,
+                              _mm512_fmadd_ps(xh, _mm512_maskz_loadu_ps(m, gamma + full), _mm512_maskz_loadu_ps(m, beta + full)));
+    }
+    *mean = mu;
+    *rstd = rs;
+}
+
+CARBON_AVX512 inline void layernorm_backward_row_avx512(const float* x, const float* g, const float* gamma,
+                                                        float mean, float rstd, float* dx, float* dgamma,
+                                                        float* dbeta, int n) {
+    const __m512 vm = _mm512_set1_ps(mean), vr = _mm512_set1_ps(rstd);
+    __m512 s1 = _mm512_setzero_ps(), s2 = _mm512_setzero_ps();
+    // masked-off lanes load as zero: g = 0 adds nothing to any sum
+    auto pass1 = [&](int j, __mmask16 m) CARBON_AVX512 {
+        const __m512 xh = _mm512_mul_ps(_mm512_sub_ps(_mm512_maskz_loadu_ps(m, x + j), vm), vr);
+        const __m512 gj = _mm512_maskz_loadu_ps(m, g + j);
+        const __m512 dxh = _mm512_mul_ps(gj, _mm512_maskz_loadu_ps(m, gamma + j));
+        s1 = _mm512_add_ps(s1, dxh);
+        s2 = _mm512_fmadd_ps(dxh, xh, s2);
+        _mm512_mask_storeu_ps(dgamma + j, m, _mm512_fmadd_ps(gj, xh, _mm512_maskz_loadu_ps(m, dgamma + j)));
+        _mm512_mask_storeu_ps(dbeta + j, m, _mm512_add_ps(gj, _mm512_maskz_loadu_ps(m, dbeta + j)));
+    };
+    const int full = n - n % 16;
+    for (int j = 0; j < full; j += 16) pass1(j, 0xFFFF);
+    if (n % 16) pass1(full, tail_mask16(n % 16));
+    const __m512 va = _mm512_set1_ps(_mm512_reduce_add_ps(s1) / n), vb = _mm512_set1_ps(_mm512_reduce_add_ps(s2) / n);
+    auto pass2 = [&](int j, __mmask16 m) CARBON_AVX512 {
+        const __m512 xh = _mm512_mul_ps(_mm512_sub_ps(_mm512_maskz_loadu_ps(m, x + j), vm), vr);
+        const __m512 dxh = _mm512_mul_ps(_mm512_maskz_loadu_ps(m, g + j), _mm512_maskz_loadu_ps(m, gamma + j));
+        _mm512_mask_storeu_ps(dx + j, m, _mm512_mul_ps(vr, _mm512_sub_ps(_mm512_sub_ps(dxh, va), _mm512_mul_ps(xh, vb))));
+    };
+    for (int j = 0; j < full; j += 16) pass2(j, 0xFFFF);
+    if (n % 16) pass2(full, tail_mask16(n % 16));
+}
+
+CARBON_AVX512 inline void add_avx512(float* dst, const float* src, size_t n) {
+    size_t i = 0;
+    for (; i + 16 <= n; i += 16) _mm512_storeu_ps(dst + i, _mm512_add_ps(_mm512_loadu_ps(dst + i), _mm512_loadu_ps(src + i)));
+    if (i < n) {
+        const __mmask16 m = tail_mask16(n - i);
+        _mm512_mask_storeu_ps(dst + i, m, _mm512_add_ps(_mm512_maskz_loadu_ps(m, dst + i), _mm512_maskz_loadu_ps(m, src + i)));
+    }
+}
+
+CARBON_AVX512 inline void scale_avx512(float* x, float s, size_t n) {
+    const __m512 vs = _mm512_set1_ps(s);
+    size_t i = 0;
+    for (; i + 16 <= n; i += 16) _mm512_storeu_ps(x + i, _mm512_mul_ps(_mm512_loadu_ps(x + i), vs));
+    if (i < n) {
+        const __mmask16 m = tail_mask16(n - i);
+        _mm512_mask_storeu_ps(x + i, m, _mm512_mul_ps(_mm512_maskz_loadu_ps(m, x + i), vs));
+    }
+}
+
+#pragma GCC diagnostic pop
+
+// ----- registry -----
+
+// The table for one ISA; the benchmark checks every variant this CPU can
+// run against the scalar one.
+inline Kernels kernels_for(Isa isa) {
+    switch (isa) {
+    case Isa::AVX512:
+        return {isa, dot_avx512, gemm_micro_avx512, softmax_row_avx512, layernorm_row_avx512,
+                layernorm_backward_row_avx512, add_avx512, scale_avx512};
+    case Isa::AVX2:
+        return {isa, dot_avx2, gemm_micro_avx2, softmax_row_avx2, layernorm_row_avx2,
+                layernorm_backward_row_avx2, add_avx2, scale_avx2};
+    default:
+        return {isa, dot_scalar, gemm_micro_scalar, softmax_row_scalar, layernorm_row_scalar,
+                layernorm_backward_row_scalar, add_scalar, scale_scalar};
+    }
+}
+
+inline const Kernels& kernels() {
+    static const Kernels k = kernels_for(cpu_isa());
+    return k;
+}
+
+// Gate for the AVX2 code outside the table (attention, FFN activations,
+// optimizer, int8 weights, sampler, loss); each has a scalar fallback.
+inline bool has_avx2() { return kernels().isa >= Isa::AVX2; }
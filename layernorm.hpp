@@ -1,59 +1,83 @@
 #pragma once
 #include "tensor.hpp"
+#include <string>
 
+// Row-wise LayerNorm over contiguous token rows; the row kernels come
+// from kernels.hpp. Forward makes three passes over a row that stays in
+// L1: mean, variance around the mean, normalize. The residual variant adds
+// the residual in the first pass.
+// Only the per-row mean and rstd are kept for backward. The caller keeps
+// the input (the block keeps it for its residual anyway) and passes it
+// back to backward().
 struct LayerNorm {
-    Tensor gamma,beta,x_cache,mean_cache,var_cache;
+    Tensor gamma,beta;
+    std::vector<float> mean,rstd;  // per row of the last grad-enabled forward
     int dim;
+    static constexpr float eps=1e-5f;
+    static constexpr int LN_CHUNKS=64;
     LayerNorm(int d):gamma(1,d),beta(1,d),dim(d){
-        for(int i=0;i<d;i++){gamma.val[i]=1.0f;beta.val[i]=0.0f;}
+        std::fill(gamma.val.begin(),gamma.val.end(),1.0f);
     }
+    static int row_grain(int cols){return std::max(1,16384/std::max(1,cols));}
+    // Normalizes each token (row) over the feature dimension, so a
+    // position's output never depends on other positions.
     Tensor forward(const Tensor&x){
-        x_cache=x;
-        Tensor y(x.rows,x.cols);
-        mean_cache=Tensor(1,x.cols);
-        var_cache=Tensor(1,x.cols);
-        for(int j=0;j<x.cols;j++){
-            float mean=0;
-            for(int i=0;i<x.rows;i++) mean+=x(i,j);
-            mean/=x.rows;
-            float var=0;
-            for(int i=0;i<x.rows;i++) var+=(x(i,j)-mean)*(x(i,j)-mean);
-            var/=x.rows;
-            mean_cache(0,j)=mean;var_cache(0,j)=var;
-            float inv_std=1.0f/std::sqrt(var+1e-5f);
-            for(int i=0;i<x.rows;i++)
-                y(i,j)=(x(i,j)-mean)*inv_std*gamma.val[j]+beta.val[j];
-        }
+        Tensor y=Tensor::uninit(x.rows,x.cols);
+        run_forward(x.val.data(),nullptr,nullptr,y.val.data(),x.rows,x.cols);
         return y;
     }
-    Tensor backward(const Tensor&grad_out){
-        Tensor grad_in(x_cache.rows,x_cache.cols);
-        for(int j=0;j<x_cache.cols;j++){
-            float mean=mean_cache(0,j),var=var_cache(0,j);
-            float inv_std=1.0f/std::sqrt(var+1e-5f);
-            float dgamma=0,dbeta=0;
-            for(int i=0;i<x_cache.rows;i++){
-                float xmu=x_cache(i,j)-mean;
-                dgamma+=grad_out.grad[i*x_cache.cols+j]*xmu*inv_std;
-                dbeta+=grad_out.grad[i*x_cache.cols+j];
-            }
-            gamma.grad[j]+=dgamma;
-            beta.grad[j]+=dbeta;
-            for(int i=0;i<x_cache.rows;i++){
-                float N=x_cache.rows;
-                float dxhat=grad_out.grad[i*x_cache.cols+j]*gamma.val[j];
-                float xmu=x_cache(i,j)-mean;
-                grad_in.grad[i*x_cache.cols+j]=inv_std*(dxhat - (1.0f/N)*dbeta - (xmu*inv_std*inv_std/N)*dgamma);
+    // x += r, then returns LayerNorm(x): the residual add is fused into
+    // the mean pass, so the residual stream is written once.
+    Tensor forward_residual(Tensor&x,const Tensor&r){
+        Tensor y=Tensor::uninit(x.rows,x.cols);
+        run_forward(x.val.data(),r.val.data(),x.val.data(),y.val.data(),x.rows,x.cols);
+        return y;
+    }
+    // dL/dy in grad_out.val, x the forward input; returns dL/dx in .val.
+    // gamma/beta grads are summed per row chunk (at most LN_CHUNKS of them)
+    // and then reduced in chunk order, so the result does not depend on the
+    // thread count.
+    Tensor backward(const Tensor&grad_out,const Tensor&x){
+        const int rows=x.rows,n=x.cols,grain=std::max(1,(rows+LN_CHUNKS-1)/LN_CHUNKS),chunks=(rows+grain-1)/grain;
+        Tensor grad_in=Tensor::uninit(rows,n);
+        thread_local std::vector<float> partial_buf;
+        auto&partial=partial_buf;  // this thread's buffer, also inside pool workers
+        partial.assign((size_t)chunks*2*n,0.0f);
+        const Kernels&k=kernels();
+        parallel_for(0,chunks,1,[&](int c0,int c1){
+            for(int c=c0;c<c1;c++){
+                float*dg=&partial[(size_t)c*2*n],*db=dg+n;
+                for(int i=c*grain;i<std::min(rows,(c+1)*grain);i++){
+                    const size_t o=(size_t)i*n;
+                    k.layernorm_backward_row(&x.val[o],&grad_out.val[o],gamma.val.data(),mean[i],rstd[i],&grad_in.val[o],dg,db,n);
+                }
             }
+        });
+        for(int c=0;c<chunks;c++){
+            const float*dg=&partial[(size_t)c*2*n];
+            for(int j=0;j<n;j++){gamma.grad[j]+=dg[j];beta.grad[j]+=dg[n+j];}
         }
         return grad_in;
     }
-    void step(float lr){
-        for(size_t i=0;i<gamma.val.size();i++){
-            gamma.val[i]-=lr*gamma.grad[i];gamma.grad[i]=0;
-            beta.val[i]-=lr*beta.grad[i];beta.grad[i]=0;
-        }
-    }
+    void release(){std::vector<float>().swap(mean);std::vector<float>().swap(rstd);}
+    void step(float lr){gamma.sgd_step(lr);beta.sgd_step(lr);}
+    template<typename F> void parameters(const std::string&prefix,F&&f){f(prefix+"gamma",gamma);f(prefix+"beta",beta);}
     void save(std::ofstream&f)const{gamma.save(f);beta.save(f);}
     void load(std::ifstream&f){gamma.load(f);beta.load(f);}
+
+private:
+    // y = LayerNorm(x), or with r: s = x + r (s may alias x), y = LayerNorm(s).
+    void run_forward(const float*x,const float*r,float*s,float*y,int rows,int n){
+        const bool cache=grad_enabled();
+        if(cache){mean.resize(rows);rstd.resize(rows);}
+        const Kernels&k=kernels();
+        parallel_for(0,rows,row_grain(n),[&](int r0,int r1){
+            for(int i=r0;i<r1;i++){
+                const size_t o=(size_t)i*n;
+                float mu,rs;
+                k.layernorm_row(x+o,r?r+o:nullptr,r?s+o:nullptr,y+o,gamma.val.data(),beta.val.data(),n,eps,&mu,&rs);
+                if(cache){mean[i]=mu;rstd[i]=rs;}
+            }
+        });
+    }
 };
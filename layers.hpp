@@ -1,9 +1,12 @@
 #pragma once
 #include "tensor.hpp"
+#include "quant.hpp"
+#include <string>
 
 struct Linear {
     Tensor W, b;
     Tensor x_cache;
+    QuantWeight qW;  // set by quantize(); W then keeps its shape but no storage
 
     Linear(int in, int out)
         : W(in, out), b(1, out) {
@@ -11,54 +14,66 @@ struct Linear {
         b.randomize();
     }
 
+    bool quantized() const { return !qW.empty(); }
+
+    // Switches to int8 weights and frees the fp32 copy (inference only).
+    void quantize() {
+        if (quantized()) return;
+        qW.quantize(W);
+        W.val = Buffer();
+        W.grad = Buffer();
+    }
+
     Tensor forward(const Tensor& x) {
-        x_cache = x;  // cache input for backward
-        Tensor y = Tensor::matmul(x, W);
+        if (quantized()) {
+            Tensor y = Tensor::uninit(x.rows, qW.out);
+            qW.forward(x.val.data(), x.rows, x.cols, y.val.data(), y.cols, b.val.data());
+            return y;
+        }
+        if (grad_enabled()) x_cache = x;  // cache input for backward
+        Tensor y = Tensor::uninit(x.rows, W.cols);
 
-        // add bias
+        // seed rows with the bias, then accumulate x*W on top
         for (int i = 0; i < y.rows; ++i)
-            for (int j = 0; j < y.cols; ++j)
-                y(i, j) += b.val[j];
+            std::copy(b.val.begin(), b.val.end(), y.val.begin() + (size_t)i * y.cols);
+        gemm(x.rows, W.cols, x.cols, x.val.data(), x.cols,
+             W.val.data(), W.cols, y.val.data(), y.cols, true);
 
         return y;
     }
 
     Tensor backward(const Tensor& grad_out) {
         // grad_out.val holds upstream gradient (dL/dY)
+        assert(!quantized() && "quantized Linear is inference-only");
+        const int n = x_cache.rows;
+        Tensor grad_in(n, W.rows);
 
-        Tensor grad_in(x_cache.rows, W.rows);
-
-        // dL/dW and dL/dX
-        for (int i = 0; i < x_cache.rows; ++i) {
-            for (int j = 0; j < W.cols; ++j) {
-                float go = grad_out.val[i * grad_out.cols + j];
-                for (int k = 0; k < W.rows; ++k) {
-                    W.grad[k * W.cols + j] += x_cache(i, k) * go;
-                    grad_in.val[i * W.rows + k] += go * W.val[k * W.cols + j];
-                }
-            }
-        }
+        // dL/dW += X^T * dY
+        gemm(true, false, W.rows, W.cols, n, x_cache.val.data(), x_cache.cols,
+             grad_out.val.data(), grad_out.cols, W.grad.data(), W.cols, true);
+
+        // dL/dX = dY * W^T
+        gemm(false, true, n, W.rows, W.cols, grad_out.val.data(), grad_out.cols,
+             W.val.data(), W.cols, grad_in.val.data(), grad_in.cols);
 
         // dL/db
-        for (int j = 0; j < b.cols; ++j) {
-            float sum = 0.0f;
-            for (int i = 0; i < grad_out.rows; ++i)
-                sum += grad_out.val[i * grad_out.cols + j];
-            b.grad[j] += sum;
-        }
+        colsum_accumulate(grad_out.rows, b.cols, grad_out.val.data(), grad_out.cols, b.grad.data());
 
         return grad_in;
     }
 
+    // Drops the input kept for backward.
+    void release() { x_cache = Tensor(); }
+
     void step(float lr) {
-        for (size_t i = 0; i < W.val.size(); ++i) {
-            W.val[i] -= lr * W.grad[i];
-            W.grad[i] = 0.0f;
-        }
-        for (size_t i = 0; i < b.val.size(); ++i) {
-            b.val[i] -= lr * b.grad[i];
-            b.grad[i] = 0.0f;
-        }
+        W.sgd_step(lr);
+        b.sgd_step(lr);
+    }
+
+    template <typename F>
+    void parameters(const std::string& prefix, F&& f) {
+        f(prefix + "W", W);
+        f(prefix + "b", b);
     }
 
     void save(std::ofstream& f) const {
@@ -0,0 +1,108 @@
+#pragma once
+#include "layers.hpp"
+#include <cmath>
+#include <limits>
+#include <vector>
+
+// ===== Fused LM-head cross-entropy =====
+// Mean next-token cross-entropy of head(x) against targets. Logits,
+// probabilities and their gradient share one [block x vocab] tile instead
+// of three [rows x vocab] tensors. Blocks are whole GEMM_KC panels of rows
+// (so the dW GEMM never runs a short K panel), as many as fit in
+// LM_LOSS_TILE floats, at least one. Each block's logits come out of the
+// lm_head GEMM once and are turned in place into the row losses and
+// dL/dlogits = (softmax - onehot) / rows, which feed head.W.grad +=
+// x^T * dlogits, head.b.grad and dL/dx before the next block reuses the
+// tile. The GEMM work is the same as the unfused path.
+constexpr size_t LM_LOSS_TILE = (size_t)1 << 25;  // 128 MB
+
+// Row helpers over [j, n): max(mx, x), sum + e^(x - m), and x = e^(x - m) * s.
+// The AVX2 versions do the 8-wide body and hand the tail to the scalar ones.
+inline float lm_row_max_scalar(const float* x, int j, int n, float mx) {
+    for (; j < n; ++j) mx = std::max(mx, x[j]);
+    return mx;
+}
+inline float lm_row_expsum_scalar(const float* x, int j, int n, float m, float sum) {
+    for (; j < n; ++j) sum += std::exp(x[j] - m);
+    return sum;
+}
+inline void lm_row_exp_scale_scalar(float* x, int j, int n, float m, float s) {
+    for (; j < n; ++j) x[j] = std::exp(x[j] - m) * s;
+}
+
+CARBON_AVX2 inline float lm_row_max_avx2(const float* x, int n) {
+    __m256 vmax = _mm256_set1_ps(-std::numeric_limits<float>::infinity());
+    int j = 0;
+    for (; j + 8 <= n; j += 8) vmax = _mm256_max_ps(vmax, _mm256_loadu_ps(x + j));
+    return lm_row_max_scalar(x, j, n, hmax256_ps(vmax));
+}
+CARBON_AVX2 inline float lm_row_expsum_avx2(const float* x, int n, float m) {
+    const __m256 vm = _mm256_set1_ps(m);
+    __m256 vsum = _mm256_setzero_ps();
+    int j = 0;
+    for (; j + 8 <= n; j += 8) vsum = _mm256_add_ps(vsum, exp256_ps(_mm256_sub_ps(_mm256_loadu_ps(x + j), vm)));
+    return lm_row_expsum_scalar(x, j, n, m, hsum256_ps(vsum));
+}
+CARBON_AVX2 inline void lm_row_exp_scale_avx2(float* x, int n, float m, float s) {
+    const __m256 vm = _mm256_set1_ps(m), vs = _mm256_set1_ps(s);
+    int j = 0;
+    for (; j + 8 <= n; j += 8)
+        _mm256_storeu_ps(x + j, _mm256_mul_ps(exp256_ps(_mm256_sub_ps(_mm256_loadu_ps(x + j), vm)), vs));
+    lm_row_exp_scale_scalar(x, j, n, m, s);
+}
+
+// grad_x, if given and grad is enabled, receives dL/dx in .val (the
+// upstream-gradient convention Linear::backward uses). block_rows = 0
+// sizes blocks from LM_LOSS_TILE.
+inline float lm_head_cross_entropy(const Tensor& x, Linear& head, const std::vector<int>& targets,
+                                   Tensor* grad_x = nullptr, int block_rows = 0) {
+    assert(!head.quantized() && "fused loss needs fp32 lm_head weights");
+    assert((int)targets.size() == x.rows && x.cols == head.W.rows);
+    const int S = x.rows, D = x.cols, V = head.W.cols;
+    for ([[maybe_unused]] int t : targets) assert(t >= 0 && t < V && "target id outside the vocab");
+    if (block_rows <= 0) block_rows = (int)std::max<size_t>(1, LM_LOSS_TILE / V / GEMM_KC) * GEMM_KC;
+    block_rows = std::max(1, std::min(block_rows, S));
+    const bool grad = grad_enabled();
+    const float* W = head.W.val.data();
+    const float* bias = head.b.val.data();
+    const float inv_rows = 1.0f / S;
+    const bool avx2 = has_avx2();
+
+    Buffer tile((size_t)block_rows * V, Buffer::Uninit{});
+    Buffer row_loss(S, 0.0f);
+    if (grad && grad_x) *grad_x = Tensor::uninit(S, D);
+
+    for (int r0 = 0; r0 < S; r0 += block_rows) {
+        const int n = std::min(block_rows, S - r0);
+        const float* xb = x.val.data() + (size_t)r0 * D;
+        // tile[n x V] = x[r0 : r0 + n] * W + b
+        for (int i = 0; i < n; ++i) std::copy(bias, bias + V, tile.data() + (size_t)i * V);
+        gemm(false, false, n, V, D, xb, D, W, V, tile.data(), V, true);
+
+        parallel_for(0, n, 1, [&](int i0, int i1) {
+            for (int i = i0; i < i1; ++i) {
+                float* row = tile.data() + (size_t)i * V;
+                const int t = targets[r0 + i];
+                const float mx = avx2 ? lm_row_max_avx2(row, V)
+                                      : lm_row_max_scalar(row, 0, V, -std::numeric_limits<float>::infinity());
+                const float sum = avx2 ? lm_row_expsum_avx2(row, V, mx) : lm_row_expsum_scalar(row, 0, V, mx, 0.0f);
+                const float lse = mx + std::log(sum);
+                row_loss[r0 + i] = lse - row[t];
+                if (!grad) continue;
+                if (avx2) lm_row_exp_scale_avx2(row, V, lse, inv_rows);
+                else lm_row_exp_scale_scalar(row, 0, V, lse, inv_rows);
+                row[t] -= inv_rows;
+            }
+        });
+        if (!grad) continue;
+
+        // dW += x_b^T * dlogits, db += colsum(dlogits), dx_b = dlogits * W^T
+        gemm(true, false, D, V, n, xb, D, tile.data(), V, head.W.grad.data(), V, true);
+        colsum_accumulate(n, V, tile.data(), V, head.b.grad.data());
+        if (grad_x) gemm(false, true, n, D, V, tile.data(), V, W, V, grad_x->val.data() + (size_t)r0 * D, D, false);
+    }
+
+    double loss = 0;
+    for (int i = 0; i < S; ++i) loss += row_loss[i];
+    return (float)(loss / S);
+}
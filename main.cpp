@@ -27,18 +27,17 @@ int main() {
     std::string text = "Hello world, this is a tiny GPT model.";
     std::vector<int> tokens = tokenizer.encode(text);
 
-    // Create dummy target: "next token" prediction
-    std::vector<int> target(tokens.size());
-    for (size_t i = 0; i < tokens.size(); i++)
-        target[i] = (tokens[i] + 1) % vocab;
+    // Next-token prediction: position i learns tokens[i + 1]
+    std::vector<int> target(tokens.begin() + 1, tokens.end());
+    tokens.pop_back();
 
     float lr = 1e-4f;
 
     // --- Training loop ---
     for (int epoch = 0; epoch < 50; epoch++) {
-        Tensor pred = model.forward(tokens);
-        Tensor grad(pred.rows, pred.cols);
-        float loss = cross_entropy(pred, target, grad);
+        Tensor grad_hidden;
+        float loss = model.loss(tokens, target, &grad_hidden);  // fused lm_head + cross-entropy
+        model.backward(std::move(grad_hidden));                 // blocks and embedding
         model.step(lr);
 
         if (epoch % 10 == 0)
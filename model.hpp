@@ -2,86 +2,381 @@
 #include "embedding.hpp"
 #include "transformer_block.hpp"
 #include "layers.hpp"
+#include "batch.hpp"
+#include "checkpoint.hpp"
+#include "loss.hpp"
+#include "optimizer.hpp"
+#include "sampler.hpp"
+#include "profiler.hpp"
+#include <functional>
+#include <memory>
 #include <fstream>
 #include <vector>
 #include <cmath>
 #include <algorithm>
 
-Tensor softmax(const Tensor& x) {
-    Tensor y(x.rows, x.cols);
-    for (int i = 0; i < x.rows; i++) {
-        float maxv = -1e9, sum = 0;
-        for (int j = 0; j < x.cols; j++) maxv = std::max(maxv, x(i, j));
-        for (int j = 0; j < x.cols; j++) { y(i, j) = exp(x(i, j) - maxv); sum += y(i, j); }
-        for (int j = 0; j < x.cols; j++) y(i, j) /= sum;
-    }
-    return y;
-}
-
-float cross_entropy(const Tensor& pred, const std::vector<int>& target, Tensor& grad_out) {
-    float loss = 0;
-    for (int i = 0; i < pred.rows; i++) {
-        int t = target[i];
-        for (int j = 0; j < pred.cols; j++) {
-            float p = pred(i, j);
-            grad_out.grad[i * pred.cols + j] = p - (j == t ? 1.0f : 0.0f);
-        }
-        loss += -log(std::max(pred(i, t), 1e-9f));
-    }
-    return loss / pred.rows;
+// Takes x by value so callers can move logits in and reuse their storage.
+// Row-wise, rows split across the thread pool.
+Tensor softmax(Tensor x) {
+    PROFILE_SCOPE("softmax", 5.0 * x.rows * x.cols, 8.0 * x.rows * x.cols);
+    parallel_for(0, x.rows, std::max(1, 16384 / std::max(1, x.cols)), [&](int r0, int r1) {
+        for (int i = r0; i < r1; i++) kernels().softmax_row(&x.val[(size_t)i * x.cols], x.cols);
+    });
+    return x;
 }
 
 struct Model {
     Embedding emb;
     std::vector<TransformerBlock> blocks;
     Linear lm_head;
+    std::vector<KVCache> kv;  // one per block, used by decode_step/generate
+    std::shared_ptr<MappedFile> mapping;  // backs weights loaded from a v2 checkpoint
+    ParamArena arena;  // backs every parameter once flatten() has run
 
-    Model(int vocab, int dim, int hidden, int layers, int heads)
+    // Activation checkpointing: with checkpoint_every = k > 0, a grad-enabled
+    // forward keeps only the input of every k-th block and runs the blocks
+    // without caching; backward() recomputes one k-block segment at a time
+    // and frees it again. Activation memory drops from every block's to one
+    // segment's plus layers / k block inputs, for about one extra forward.
+    int checkpoint_every = 0;
+    std::vector<Tensor> ckpt_inputs;  // input of each segment, first to last
+    std::vector<int> ckpt_offsets;
+    int ckpt_segment = 0;
+
+    Model(int vocab, int dim, int hidden, int layers, int heads, Activation act = Activation::ReLU)
         : emb(vocab, dim), lm_head(dim, vocab) {
-        for (int i = 0; i < layers; i++) blocks.emplace_back(dim, hidden, heads);
+        for (int i = 0; i < layers; i++) blocks.emplace_back(dim, hidden, heads, act);
     }
 
     Tensor forward(const std::vector<int>& tokens) {
-        Tensor x = emb.forward(tokens);
-        for (auto& b : blocks) x = b.forward(x);
-        Tensor logits = lm_head.forward(x);
-        return softmax(logits);
+        return softmax(head(hidden(tokens)));
+    }
+
+    // Batched forward over packed sequences: returns [batch.total() x vocab]
+    // probabilities, row batch.row(b, t) for position t of sequence b. Every
+    // weight matrix is read once per batch instead of once per sequence.
+    Tensor forward(const TokenBatch& batch) {
+        return softmax(head(hidden(batch)));
+    }
+
+    // Final hidden states (lm_head input), [tokens x dim].
+    Tensor hidden(const std::vector<int>& tokens) {
+        PROFILE_SCOPE("model.forward");
+        return run_blocks(embed(tokens), single_sequence(static_cast<int>(tokens.size())));
+    }
+
+    Tensor hidden(const TokenBatch& batch) {
+        PROFILE_SCOPE("model.forward");
+        return run_blocks(embed(batch.tokens), batch.offsets);
+    }
+
+    Tensor embed(const std::vector<int>& tokens) {
+        PROFILE_SCOPE("embedding", 0, 8.0 * tokens.size() * lm_head.W.rows);
+        return emb.forward(tokens);
+    }
+
+    // [tokens x vocab] logits.
+    Tensor head(const Tensor& x) {
+        PROFILE_SCOPE("lm_head", 2.0 * x.rows * x.cols * lm_head.W.cols,
+                      4.0 * ((double)x.rows * (x.cols + lm_head.W.cols) + (double)x.cols * lm_head.W.cols));
+        return lm_head.forward(x);
+    }
+
+    Tensor run_blocks(Tensor x, const std::vector<int>& offsets) {
+        ckpt_inputs.clear();
+        if (checkpoint_every <= 0 || !grad_enabled()) {
+            for (size_t l = 0; l < blocks.size(); l++) {
+                PROFILE_SCOPE("block.forward", 0, 0, (int)l);
+                x = blocks[l].forward(x, offsets);
+            }
+            return x;
+        }
+        ckpt_segment = checkpoint_every;
+        ckpt_offsets = offsets;
+        NoGradGuard no_cache;
+        for (size_t l = 0; l < blocks.size(); l++) {
+            if (l % ckpt_segment == 0) ckpt_inputs.push_back(x);
+            PROFILE_SCOPE("block.forward", 0, 0, (int)l);
+            x = blocks[l].forward(x, offsets);
+        }
+        return x;
+    }
+
+    // Mean cross-entropy of targets[i] as the token after position i, via
+    // the fused chunked lm_head loss (loss.hpp): no [tokens x vocab] buffer
+    // is ever allocated. With grad enabled, lm_head's W/b grads accumulate
+    // and grad_hidden (if given) receives dL/d(hidden) in .val.
+    float loss(const std::vector<int>& tokens, const std::vector<int>& targets, Tensor* grad_hidden = nullptr) {
+        return head_loss(hidden(tokens), targets, grad_hidden);
+    }
+
+    float loss(const TokenBatch& batch, const std::vector<int>& targets, Tensor* grad_hidden = nullptr) {
+        return head_loss(hidden(batch), targets, grad_hidden);
+    }
+
+    float head_loss(const Tensor& x, const std::vector<int>& targets, Tensor* grad_hidden) {
+        [[maybe_unused]] const double gemms = grad_enabled() ? (grad_hidden ? 3 : 2) : 1;
+        PROFILE_SCOPE("loss", gemms * 2.0 * x.rows * x.cols * lm_head.W.cols,
+                      4.0 * ((double)x.rows * x.cols * (grad_hidden ? 2 : 1) + (double)x.cols * lm_head.W.cols));
+        return lm_head_cross_entropy(x, lm_head, targets, grad_hidden);
+    }
+
+    // Backpropagates dL/d(hidden) (as loss() returns it) through the blocks
+    // into the embedding rows, accumulating every parameter's grad.
+    void backward(Tensor g) {
+        PROFILE_SCOPE("model.backward");
+        if (ckpt_inputs.empty()) {
+            for (size_t l = blocks.size(); l-- > 0;) {
+                PROFILE_SCOPE("block.backward", 0, 0, (int)l);
+                g = blocks[l].backward(g);
+            }
+        } else {
+            for (size_t s = ckpt_inputs.size(); s-- > 0;) {
+                const size_t first = s * ckpt_segment, last = std::min(blocks.size(), first + ckpt_segment);
+                Tensor x = std::move(ckpt_inputs[s]);
+                for (size_t l = first; l < last; l++) {
+                    PROFILE_SCOPE("block.recompute", 0, 0, (int)l);
+                    x = blocks[l].forward(x, ckpt_offsets);  // caches again
+                }
+                for (size_t l = last; l-- > first;) {
+                    PROFILE_SCOPE("block.backward", 0, 0, (int)l);
+                    g = blocks[l].backward(g);
+                    blocks[l].release();
+                }
+            }
+            ckpt_inputs.clear();
+        }
+        PROFILE_SCOPE("embedding.backward", 0, 8.0 * g.rows * g.cols);
+        emb.backward(g);
     }
 
     void step(float lr) {
+        PROFILE_SCOPE("model.step");
         emb.step(lr);
         for (auto& b : blocks) b.step(lr);
         lm_head.step(lr);
     }
 
-    void save(const std::string& path) {
-        std::ofstream f(path, std::ios::binary);
-        emb.save(f);
-        for (auto& b : blocks) b.save(f);
-        lm_head.save(f);
-        f.close();
+    // Visits every parameter as f(name, tensor), in checkpoint order.
+    template <typename F>
+    void parameters(F&& f) {
+        emb.parameters("emb.", f);
+        for (size_t l = 0; l < blocks.size(); l++) blocks[l].parameters("blocks." + std::to_string(l) + ".", f);
+        lm_head.parameters("lm_head.", f);
+    }
+
+    // Moves every parameter and gradient into one flat arena (see
+    // optimizer.hpp) and returns it for an Optimizer. Call it after loading
+    // weights; calling it again rebuilds the arena from the current values.
+    ParamArena& flatten() {
+        arena.build(*this);
+        return arena;
     }
 
-    void load(const std::string& path) {
+    Activation activation() const { return blocks.empty() ? Activation::ReLU : blocks[0].ff.act; }
+
+    // A data-parallel replica: same config, every parameter a view into
+    // this model's arena (flatten() first), private activations and grads.
+    // See DataParallelTrainer (trainer.hpp).
+    std::unique_ptr<Model> replica() {
+        std::unique_ptr<Model> r;
+        {
+            ShapeOnlyGuard shape_only;
+            r = std::make_unique<Model>(emb.table.rows, emb.table.cols, blocks.empty() ? 0 : blocks[0].ff.hidden,
+                                        static_cast<int>(blocks.size()), blocks.empty() ? 1 : blocks[0].attn.heads,
+                                        activation());
+        }
+        if (!r->arena.share(*r, arena)) return nullptr;
+        return r;
+    }
+
+    // Visits every parameter trained through a SparseRowGrad instead of
+    // its dense grad as f(name, tensor, sparse_grad): the embedding table.
+    template <typename F>
+    void sparse_parameters(F&& f) {
+        emb.sparse_parameters("emb.", f);
+    }
+
+    // Visits every Linear as f(name_prefix, linear).
+    template <typename F>
+    void linears(F&& f) {
+        for (size_t l = 0; l < blocks.size(); l++) blocks[l].linears("blocks." + std::to_string(l) + ".", f);
+        f("lm_head.", lm_head);
+    }
+
+    // Int8 weights for every Linear (inference only); see quant.hpp.
+    void quantize() {
+        linears([](const std::string&, Linear& l) { l.quantize(); });
+    }
+
+    // Writes a .cb v2 checkpoint (see checkpoint.hpp). Quantized Linears are
+    // stored as <prefix>W.q8 (int8 [out x in_pad]) + <prefix>W.scales.
+    // extra may add records of its own (training state such as the data
+    // cursor); Model::load ignores names it does not know.
+    bool save(const std::string& path, const std::function<void(CheckpointWriter&)>& extra = nullptr) {
+        CheckpointWriter w;
+        w.header.vocab = emb.table.rows;
+        w.header.dim = emb.table.cols;
+        w.header.hidden = blocks.empty() ? 0 : blocks[0].ff.hidden;
+        w.header.activation = static_cast<int32_t>(activation());
+        w.header.layers = static_cast<int>(blocks.size());
+        w.header.heads = blocks.empty() ? 0 : blocks[0].attn.heads;
+        parameters([&](const std::string& name, Tensor& t) {
+            if (!t.val.empty() || t.rows * t.cols == 0) w.add(name, t);
+        });
+        linears([&](const std::string& prefix, Linear& l) {
+            if (!l.quantized()) return;
+            const QuantWeight& q = l.qW;
+            w.add(prefix + "W.q8", CB_I8, q.out, q.in_pad, q.q, (uint64_t)q.out * q.in_pad);
+            w.add(prefix + "W.scales", CB_F32, q.out, q.groups, q.scales, (uint64_t)q.out * q.groups * sizeof(float));
+        });
+        if (extra) extra(w);
+        return w.write(path);
+    }
+
+    // v2 checkpoints are mmap'ed and the weights used in place; legacy v1
+    // streams are still read record by record.
+    bool load(const std::string& path) {
+        if (Checkpoint::is_v2(path)) {
+            Checkpoint ck;
+            return ck.open(path) && map_weights(ck);
+        }
         std::ifstream f(path, std::ios::binary);
+        if (!f) return false;
         emb.load(f);
         for (auto& b : blocks) b.load(f);
         lm_head.load(f);
         f.close();
+        return true;
     }
 
-    // Optional: inference helper
-    int predict_next(const std::vector<int>& tokens) {
-        Tensor probs = forward(tokens);
-        int last_row = probs.rows - 1;
-        float best = -1e9;
-        int idx = 0;
-        for (int j = 0; j < probs.cols; j++) {
-            if (probs(last_row, j) > best) {
-                best = probs(last_row, j);
-                idx = j;
+    // Builds a model straight from a v2 checkpoint: the config comes from the
+    // header, layers are created without storage and every weight is a view
+    // into the mapping, so nothing is allocated, randomized or copied.
+    static std::unique_ptr<Model> open(const std::string& path) {
+        Checkpoint ck;
+        if (!ck.open(path)) return nullptr;
+        const CheckpointHeader& h = ck.header;
+        if (h.vocab <= 0 || h.dim <= 0 || h.hidden <= 0 || h.layers < 0 || h.heads <= 0 || h.dim % h.heads != 0) {
+            std::cerr << "[CB] Error: invalid model config (vocab " << h.vocab << ", dim " << h.dim << ", hidden "
+                      << h.hidden << ", layers " << h.layers << ", heads " << h.heads << ") in " << path << "\n";
+            return nullptr;
+        }
+        if (h.activation < 0 || h.activation > static_cast<int32_t>(Activation::SwiGLU)) {
+            std::cerr << "[CB] Error: unknown activation " << h.activation << " in " << path << "\n";
+            return nullptr;
+        }
+        std::unique_ptr<Model> m;
+        {
+            ShapeOnlyGuard shape_only;
+            m = std::make_unique<Model>(h.vocab, h.dim, h.hidden, h.layers, h.heads, static_cast<Activation>(h.activation));
+        }
+        if (!m->map_weights(ck)) return nullptr;
+        return m;
+    }
+
+    // Points every parameter at its payload in ck; shapes must match.
+    bool map_weights(const Checkpoint& ck) {
+        bool ok = true;
+        parameters([&](const std::string& name, Tensor& t) {
+            if (!ck.find(name) && ck.find(name + ".q8")) return;  // mapped below
+            const CheckpointEntry* e = ck.find(name);
+            if (e && (e->rows != t.rows || e->cols != t.cols)) {
+                std::cerr << "[CB] Error: shape mismatch for " << name << "\n";
+                ok = false;
+                return;
+            }
+            ok = ck.view(name, t) && ok;
+        });
+        linears([&](const std::string& prefix, Linear& l) {
+            const CheckpointEntry* q = ck.find(prefix + "W.q8");
+            const CheckpointEntry* s = ck.find(prefix + "W.scales");
+            if (!q) return;
+            QuantWeight shape;
+            shape.set_shape(l.W.rows, l.W.cols);
+            if (!s || q->dtype != CB_I8 || s->dtype != CB_F32 || q->rows != shape.out || q->cols != shape.in_pad ||
+                s->rows != shape.out || s->cols != shape.groups || q->nbytes != (uint64_t)shape.out * shape.in_pad ||
+                s->nbytes != (uint64_t)shape.out * shape.groups * sizeof(float)) {
+                std::cerr << "[CB] Error: malformed quantized weights for " << prefix << "W\n";
+                ok = false;
+                return;
             }
+            l.qW.map(static_cast<const int8_t*>(ck.payload(*q)), static_cast<const float*>(ck.payload(*s)),
+                     l.W.rows, l.W.cols);
+            l.W.val = Buffer();
+            l.W.grad = Buffer();
+        });
+        emb.table.grad = Buffer();  // trained through emb.grad
+        if (ok) mapping = ck.file;
+        return ok;
+    }
+
+    // [1 x vocab] logits of the position after tokens; lm_head only runs
+    // on the last row.
+    Tensor next_logits(const std::vector<int>& tokens) {
+        NoGradGuard no_grad;
+        Tensor x = hidden(tokens);
+        Tensor last = Tensor::uninit(1, x.cols);
+        std::copy_n(&x.val[(size_t)(x.rows - 1) * x.cols], x.cols, last.val.begin());
+        return lm_head.forward(last);
+    }
+
+    int predict_next(const std::vector<int>& tokens) {
+        Tensor logits = next_logits(tokens);
+        return Sampler::argmax(logits.val.data(), logits.cols);
+    }
+
+    // ===== Incremental decoding =====
+    // Drops any cached context and preallocates room for max_seq positions.
+    void reset_cache(int max_seq) {
+        kv.resize(blocks.size());
+        for (size_t l = 0; l < blocks.size(); l++) {
+            const auto& a = blocks[l].attn;
+            kv[l].clear();
+            kv[l].reserve(a.heads, a.head_dim, max_seq);
         }
-        return idx;
+    }
+
+    int cached_len() const { return kv.empty() ? 0 : kv[0].len; }
+
+    // Appends tokens (a prompt chunk or a single sampled token) to the cache
+    // and returns the [1 x vocab] logits of the last one. Only the new
+    // positions are embedded, projected and run through the blocks. Call
+    // reset_cache(max_seq) first to size the cache once; without it the
+    // cache starts at this call's length and doubles whenever it fills.
+    Tensor decode_step(const std::vector<int>& tokens) {
+        NoGradGuard no_grad;
+        if (kv.size() != blocks.size()) reset_cache(static_cast<int>(tokens.size()));
+        Tensor x = emb.forward(tokens);
+        for (size_t l = 0; l < blocks.size(); l++) x = blocks[l].decode(x, kv[l]);
+        Tensor last = Tensor::uninit(1, x.cols);
+        std::copy_n(&x.val[(size_t)(x.rows - 1) * x.cols], x.cols, last.val.begin());
+        return lm_head.forward(last);
+    }
+
+    // Prefill the prompt once, then feed back one sampled token per step.
+    // Returns only the newly generated tokens; the sampler's history picks
+    // up the prompt and every sampled token (repetition penalty).
+    std::vector<int> generate(const std::vector<int>& prompt, int max_new_tokens, Sampler& sampler) {
+        reset_cache(static_cast<int>(prompt.size()) + max_new_tokens);
+        std::vector<int> out;
+        if (prompt.empty() || max_new_tokens <= 0) return out;
+        sampler.accept(prompt);
+        Tensor logits = decode_step(prompt);
+        for (int n = 0; n < max_new_tokens; n++) {
+            int next = sampler.sample(logits);
+            sampler.accept(next);
+            out.push_back(next);
+            if (n + 1 < max_new_tokens) logits = decode_step({next});
+        }
+        return out;
+    }
+
+    // Greedy generation.
+    std::vector<int> generate(const std::vector<int>& prompt, int max_new_tokens) {
+        SamplerConfig greedy;
+        greedy.temperature = 0.0f;
+        Sampler sampler(greedy);
+        return generate(prompt, max_new_tokens, sampler);
     }
 };
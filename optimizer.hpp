@@ -0,0 +1,362 @@
+#pragma once
+#include "tensor.hpp"
+#include "checkpoint.hpp"
+#include "threadpool.hpp"
+#include "profiler.hpp"
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <iostream>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+// ===== Parameter arena =====
+// Every parameter's val and grad moved into two flat 64-byte aligned
+// buffers, each tensor starting on a 16-float boundary; the tensors keep
+// working as before through Buffer views. Dense matrices (rows > 1: Linear
+// weights) come first and get weight decay, vectors (biases, LayerNorm
+// gains) after them, so the dense update is one sweep over two contiguous
+// ranges. Sparse parameters (the embedding table, see SparseRowGrad) go
+// last with values only: they have no dense grad and are updated row by
+// row. Padding stays zero in val, grad and state.
+struct ParamArena {
+    struct Param {
+        std::string name;
+        Tensor* t;
+        size_t offset, size;
+        SparseRowGrad* sparse;  // nullptr: dense grad at grad[offset]
+    };
+
+    Buffer val, grad;  // grad covers the dense parameters only
+    std::vector<Param> params;
+    size_t decay_end = 0;  // floats [0, decay_end) get weight decay
+
+    // Rebinds model.parameters() into the arena, copying the current
+    // values (weights loaded from a checkpoint included) and zeroing grads.
+    // Quantized Linears, whose W has no fp32 storage, are left out. The
+    // tensors borrow the arena, so it must outlive them (Model::flatten
+    // keeps it in the model), and a later load() re-points them at the
+    // mapping instead.
+    template <typename M>
+    void build(M& model) {
+        std::vector<Param> matrices, vectors, sparse;
+        model.sparse_parameters([&](const std::string& name, Tensor& t, SparseRowGrad& g) {
+            if (!t.val.empty()) sparse.push_back({name, &t, 0, t.val.size(), &g});
+        });
+        model.parameters([&](const std::string& name, Tensor& t) {
+            if (t.val.empty()) return;
+            for (const auto& p : sparse)
+                if (p.t == &t) return;
+            (t.rows > 1 ? matrices : vectors).push_back({name, &t, 0, t.val.size(), nullptr});
+        });
+        params = matrices;
+        params.insert(params.end(), vectors.begin(), vectors.end());
+        params.insert(params.end(), sparse.begin(), sparse.end());
+
+        size_t total = 0, dense = 0;
+        for (size_t i = 0; i < params.size(); ++i) {
+            if (i == matrices.size()) decay_end = total;
+            if (i == matrices.size() + vectors.size()) dense = total;
+            params[i].offset = total;
+            total += (params[i].size + 15) & ~size_t(15);
+        }
+        if (matrices.size() == params.size()) decay_end = total;
+        if (sparse.empty()) dense = total;
+
+        // new storage first: the tensors may still view an older arena
+        Buffer new_val(total, 0.0f), new_grad(dense, 0.0f);
+        for (auto& p : params) {
+            std::copy_n(p.t->val.data(), p.size, new_val.data() + p.offset);
+            p.t->val = Buffer::view(new_val.data() + p.offset, p.size);
+            if (p.sparse) {
+                p.t->grad = Buffer();
+                p.sparse->clear();
+            } else {
+                p.t->grad = Buffer::view(new_grad.data() + p.offset, p.size);
+            }
+        }
+        val = std::move(new_val);
+        grad = std::move(new_grad);
+    }
+
+    // Makes this the arena of a data-parallel replica of master's model
+    // (same config, built without storage): the replica's parameters view
+    // master's values, which only master's optimizer writes, while its
+    // gradients go to a private buffer laid out like master.grad, so the
+    // workers' grads reduce offset by offset. Sparse grads stay in the
+    // replica's own SparseRowGrads. Valid until master is rebuilt.
+    template <typename M>
+    bool share(M& replica, ParamArena& master) {
+        std::unordered_map<std::string, Tensor*> dense;
+        std::unordered_map<std::string, SparseRowGrad*> sparse;
+        replica.parameters([&](const std::string& name, Tensor& t) { dense[name] = &t; });
+        replica.sparse_parameters([&](const std::string& name, Tensor&, SparseRowGrad& g) { sparse[name] = &g; });
+
+        Buffer new_grad(master.grad.size(), 0.0f);
+        std::vector<Param> shared = master.params;
+        for (auto& p : shared) {
+            const auto t = dense.find(p.name);
+            if (t == dense.end() || (size_t)t->second->rows * t->second->cols != p.size ||
+                (p.sparse && !sparse.count(p.name))) {
+                std::cerr << "[OPT] Error: replica does not match the model at " << p.name << "\n";
+                return false;
+            }
+            p.t = t->second;
+            p.t->val = Buffer::view(master.val.data() + p.offset, p.size);
+            if (p.sparse) {
+                p.sparse = sparse[p.name];
+                p.sparse->clear();
+                p.t->grad = Buffer();
+            } else {
+                p.t->grad = Buffer::view(new_grad.data() + p.offset, p.size);
+            }
+        }
+        params = std::move(shared);
+        val = Buffer();
+        grad = std::move(new_grad);
+        decay_end = master.decay_end;
+        return true;
+    }
+
+    size_t size() const { return val.size(); }
+
+    void zero_grad() {
+        std::fill(grad.begin(), grad.end(), 0.0f);
+        for (auto& p : params)
+            if (p.sparse) p.sparse->clear();
+    }
+
+    // L2 norm of every gradient: a parallel reduction over the dense arena
+    // plus the touched rows of the sparse parameters.
+    double grad_norm() const {
+        constexpr size_t CHUNK = 1 << 15;
+        const int chunks = (int)((grad.size() + CHUNK - 1) / CHUNK);
+        std::vector<double> partial(chunks, 0.0);
+        parallel_for(0, chunks, 1, [&](int c0, int c1) {
+            for (int c = c0; c < c1; ++c)
+                partial[c] = sum_squares(grad.data() + (size_t)c * CHUNK, std::min(CHUNK, grad.size() - (size_t)c * CHUNK));
+        });
+        double s = 0;
+        for (double p : partial) s += p;
+        for (const auto& p : params)
+            if (p.sparse) s += sum_squares(p.sparse->grad.data(), p.sparse->grad.size());
+        return std::sqrt(s);
+    }
+
+private:
+    static double sum_squares(const float* g, size_t n) {
+        double s = 0.0;
+        const size_t i = has_avx2() ? sum_squares_avx2(g, n, s) : 0;
+        for (size_t j = i; j < n; ++j) s += (double)g[j] * g[j];
+        return s;
+    }
+    // The 8-wide body; returns where the scalar tail starts.
+    CARBON_AVX2 static size_t sum_squares_avx2(const float* g, size_t n, double& s) {
+        __m256 acc = _mm256_setzero_ps();
+        size_t i = 0;
+        for (; i + 8 <= n; i += 8) {
+            const __m256 v = _mm256_loadu_ps(g + i);
+            acc = _mm256_fmadd_ps(v, v, acc);
+        }
+        s = hsum256_ps(acc);
+        return i;
+    }
+};
+
+// ===== Learning-rate schedule =====
+// Linear warmup to peak over warmup steps, then cosine decay to min_lr at
+// decay_steps and flat after it. decay_steps = 0 keeps peak after warmup.
+struct LRSchedule {
+    float peak = 3e-4f, min_lr = 3e-5f;
+    int64_t warmup = 0, decay_steps = 0;
+
+    float operator()(int64_t step) const {
+        if (step < warmup) return peak * (float)(step + 1) / (float)warmup;
+        if (decay_steps <= warmup) return peak;
+        if (step >= decay_steps) return min_lr;
+        const double t = (double)(step - warmup) / (double)(decay_steps - warmup);
+        return min_lr + (float)(0.5 * (1.0 + std::cos(M_PI * t))) * (peak - min_lr);
+    }
+};
+
+// ===== Optimizer =====
+// AdamW (decoupled weight decay) or SGD with momentum over a ParamArena.
+// step() optionally clips the global gradient norm, then makes one fused
+// SIMD pass over the dense arena, split across the thread pool: read grad,
+// update the moment(s), update the weight, zero the grad. Sparse
+// parameters get the same update on their touched rows only.
+enum class OptimizerKind { AdamW, SGD };
+
+struct OptimizerConfig {
+    OptimizerKind kind = OptimizerKind::AdamW;
+    float beta1 = 0.9f, beta2 = 0.95f, eps = 1e-8f;  // AdamW
+    float momentum = 0.9f;                           // SGD
+    float weight_decay = 0.1f;                       // matrices only, scaled by lr
+    float clip_norm = 1.0f;                          // global grad-norm cap (0: off)
+};
+
+class Optimizer {
+public:
+    OptimizerConfig cfg;
+    LRSchedule schedule;
+    ParamArena& arena;
+    Buffer m, v;      // first / second moment (v: AdamW only)
+    uint64_t t = 0;   // completed steps
+    float last_norm = 0.0f;  // grad norm before clipping (only measured when clipping)
+
+    // Typically Optimizer opt(model.flatten(), cfg, schedule).
+    explicit Optimizer(ParamArena& a, const OptimizerConfig& c = OptimizerConfig(), const LRSchedule& s = LRSchedule())
+        : cfg(c), schedule(s), arena(a) {
+        m = Buffer(arena.size(), 0.0f);
+        if (cfg.kind == OptimizerKind::AdamW) v = Buffer(arena.size(), 0.0f);
+    }
+
+    float lr() const { return schedule((int64_t)t); }
+
+    // Applies the accumulated gradients at the scheduled learning rate and
+    // zeroes them. Returns last_norm.
+    float step() { return step(lr()); }
+
+    float step(float lr) {
+        // AdamW reads and writes w, g, m and v: about 10 flops and 32 bytes per float.
+        PROFILE_SCOPE("optimizer.step", 10.0 * arena.grad.size(), 32.0 * arena.grad.size());
+        float scale = 1.0f;
+        if (cfg.clip_norm > 0.0f) {
+            last_norm = (float)arena.grad_norm();
+            if (last_norm > cfg.clip_norm) scale = cfg.clip_norm / (last_norm + 1e-6f);
+        }
+        t++;
+        constexpr size_t CHUNK = 1 << 14;
+        const size_t n = arena.grad.size();
+        parallel_for(0, (int)((n + CHUNK - 1) / CHUNK), 1, [&](int c0, int c1) {
+            const size_t end = std::min(n, (size_t)c1 * CHUNK);
+            for (size_t lo = (size_t)c0 * CHUNK, hi; lo < end; lo = hi) {
+                // split the run at the decay boundary
+                hi = lo < arena.decay_end ? std::min(end, arena.decay_end) : end;
+                update(lo, arena.grad.data() + lo, hi - lo, lr, lo < arena.decay_end ? cfg.weight_decay : 0.0f, scale);
+            }
+        });
+
+        // Sparse parameters: lazy updates of the touched rows only. Rows a
+        // step does not touch keep their moments and skip weight decay
+        // until they appear again (bias correction still uses the global t).
+        for (auto& p : arena.params) {
+            if (!p.sparse) continue;
+            SparseRowGrad& sg = *p.sparse;
+            const int cols = p.t->cols;
+            const float wd = p.t->rows > 1 ? cfg.weight_decay : 0.0f;
+            parallel_for(0, (int)sg.size(), std::max(1, 16384 / cols), [&](int k0, int k1) {
+                for (int k = k0; k < k1; ++k)
+                    update(p.offset + (size_t)sg.ids[k] * cols, sg.grad.data() + (size_t)k * cols, cols, lr, wd, scale);
+            });
+            sg.clear();
+        }
+        return last_norm;
+    }
+
+    // Moments and step count as checkpoint records "opt.<param>.m/.v" and
+    // "opt.step", next to the weights (pass to Model::save's extra hook).
+    void save_state(CheckpointWriter& w) const {
+        w.add("opt.step", CB_U64, 1, 1, &t, sizeof(t));
+        for (const auto& p : arena.params) {
+            w.add("opt." + p.name + ".m", CB_F32, p.t->rows, p.t->cols, m.data() + p.offset, p.size * sizeof(float));
+            if (!v.empty())
+                w.add("opt." + p.name + ".v", CB_F32, p.t->rows, p.t->cols, v.data() + p.offset, p.size * sizeof(float));
+        }
+    }
+
+    bool load_state(const Checkpoint& ck) {
+        const CheckpointEntry* s = ck.find("opt.step");
+        if (!s || s->dtype != CB_U64 || s->nbytes != sizeof(t)) {
+            std::cerr << "[OPT] Error: checkpoint has no optimizer state\n";
+            return false;
+        }
+        auto copy = [&](const std::string& name, float* dst, size_t size) {
+            const CheckpointEntry* e = ck.find(name);
+            if (!e || e->dtype != CB_F32 || e->nbytes != size * sizeof(float)) {
+                std::cerr << "[OPT] Error: missing or malformed optimizer state: " << name << "\n";
+                return false;
+            }
+            std::memcpy(dst, ck.payload(*e), e->nbytes);
+            return true;
+        };
+        for (const auto& p : arena.params) {
+            if (!copy("opt." + p.name + ".m", m.data() + p.offset, p.size)) return false;
+            if (!v.empty() && !copy("opt." + p.name + ".v", v.data() + p.offset, p.size)) return false;
+        }
+        std::memcpy(&t, ck.payload(*s), sizeof(t));
+        return true;
+    }
+
+private:
+    // Arena floats [off, off + n) with gradient g[0, n), which is zeroed.
+    void update(size_t off, float* g, size_t n, float lr, float wd, float scale) {
+        if (cfg.kind == OptimizerKind::AdamW) adamw(arena.val.data() + off, g, m.data() + off, v.data() + off, n, lr, wd, scale);
+        else sgd(arena.val.data() + off, g, m.data() + off, n, lr, wd, scale);
+    }
+
+    // m = b1 m + (1 - b1) g;  v = b2 v + (1 - b2) g^2
+    // w -= lr (m / bc1) / (sqrt(v / bc2) + eps) + lr wd w
+    void adamw(float* w, float* g, float* mm, float* vv, size_t n, float lr, float wd, float scale) {
+        const float b1 = cfg.beta1, b2 = cfg.beta2;
+        const float step_size = lr / (1.0f - std::pow(b1, (float)t));
+        const float inv_bc2 = 1.0f / (1.0f - std::pow(b2, (float)t));
+        const float keep = 1.0f - lr * wd;
+        size_t i = has_avx2() ? adamw_avx2(w, g, mm, vv, n, b1, b2, scale, step_size, inv_bc2, cfg.eps, keep) : 0;
+        for (; i < n; ++i) {
+            const float gi = g[i] * scale;
+            mm[i] = b1 * mm[i] + (1.0f - b1) * gi;
+            vv[i] = b2 * vv[i] + (1.0f - b2) * gi * gi;
+            w[i] = w[i] * keep - step_size * mm[i] / (std::sqrt(vv[i] * inv_bc2) + cfg.eps);
+            g[i] = 0.0f;
+        }
+    }
+
+    // m = mu m + g;  w -= lr m + lr wd w
+    void sgd(float* w, float* g, float* mm, size_t n, float lr, float wd, float scale) {
+        const float mu = cfg.momentum, keep = 1.0f - lr * wd;
+        size_t i = has_avx2() ? sgd_avx2(w, g, mm, n, lr, mu, scale, keep) : 0;
+        for (; i < n; ++i) {
+            mm[i] = mu * mm[i] + g[i] * scale;
+            w[i] = w[i] * keep - lr * mm[i];
+            g[i] = 0.0f;
+        }
+    }
+
+    // 8-wide bodies of adamw / sgd; each returns where the scalar tail starts.
+    CARBON_AVX2 static size_t adamw_avx2(float* w, float* g, float* mm, float* vv, size_t n, float b1, float b2,
+                                         float scale, float step_size, float inv_bc2, float eps, float keep) {
+        const __m256 vb1 = _mm256_set1_ps(b1), vb2 = _mm256_set1_ps(b2), v1b1 = _mm256_set1_ps(1.0f - b1),
+                     v1b2 = _mm256_set1_ps(1.0f - b2), vscale = _mm256_set1_ps(scale), vstep = _mm256_set1_ps(step_size),
+                     vbc2 = _mm256_set1_ps(inv_bc2), veps = _mm256_set1_ps(eps), vkeep = _mm256_set1_ps(keep),
+                     zero = _mm256_setzero_ps();
+        size_t i = 0;
+        for (; i + 8 <= n; i += 8) {
+            const __m256 gi = _mm256_mul_ps(_mm256_loadu_ps(g + i), vscale);
+            const __m256 mi = _mm256_fmadd_ps(vb1, _mm256_loadu_ps(mm + i), _mm256_mul_ps(v1b1, gi));
+            const __m256 vi = _mm256_fmadd_ps(vb2, _mm256_loadu_ps(vv + i), _mm256_mul_ps(v1b2, _mm256_mul_ps(gi, gi)));
+            const __m256 denom = _mm256_add_ps(_mm256_sqrt_ps(_mm256_mul_ps(vi, vbc2)), veps);
+            const __m256 upd = _mm256_div_ps(_mm256_mul_ps(vstep, mi), denom);
+            _mm256_storeu_ps(w + i, _mm256_sub_ps(_mm256_mul_ps(_mm256_loadu_ps(w + i), vkeep), upd));
+            _mm256_storeu_ps(mm + i, mi);
+            _mm256_storeu_ps(vv + i, vi);
+            _mm256_storeu_ps(g + i, zero);
+        }
+        return i;
+    }
+
+    CARBON_AVX2 static size_t sgd_avx2(float* w, float* g, float* mm, size_t n, float lr, float mu, float scale,
+                                       float keep) {
+        const __m256 vmu = _mm256_set1_ps(mu), vscale = _mm256_set1_ps(scale), vnlr = _mm256_set1_ps(-lr),
+                     vkeep = _mm256_set1_ps(keep), zero = _mm256_setzero_ps();
+        size_t i = 0;
+        for (; i + 8 <= n; i += 8) {
+            const __m256 mi = _mm256_fmadd_ps(vmu, _mm256_loadu_ps(mm + i), _mm256_mul_ps(_mm256_loadu_ps(g + i), vscale));
+            _mm256_storeu_ps(w + i, _mm256_fmadd_ps(vnlr, mi, _mm256_mul_ps(_mm256_loadu_ps(w + i), vkeep)));
+            _mm256_storeu_ps(mm + i, mi);
+            _mm256_storeu_ps(g + i, zero);
+        }
+        return i;
+    }
+};
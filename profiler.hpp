@@ -0,0 +1,270 @@
+#pragma once
+#include "workspace.hpp"
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+// ===== Profiler =====
+// Scoped per-op instrumentation of forward, backward and the optimizer
+// step. It records wall time, estimated FLOPs, bytes touched and tensor
+// heap allocations, then prints per-op and per-layer tables or writes a
+// Chrome trace (chrome://tracing, Perfetto):
+//
+//   profiler().start();
+//   ... training steps ...
+//   profiler().stop();
+//   profiler().report(std::cout);
+//   profiler().write_chrome_trace("trace.json");
+//
+// Build with -DCARBON_PROFILE to enable it. Without it, PROFILE_SCOPE
+// expands to nothing (its FLOP/byte estimates are never evaluated) and
+// the Profiler calls are empty. With it, an inactive scope costs one
+// relaxed atomic load.
+//
+// Each thread appends to its own log, so scopes never lock. Work a
+// parallel_for hands to pool workers shows up on each worker's timeline
+// under the name of the op that launched it. Those worker spans are
+// listed as "worker ms" and are not counted in the op's own time.
+// start() and stop() go between steps, never while ops are running.
+
+#ifdef CARBON_PROFILE
+
+struct ProfileEvent {
+    const char* name;
+    int layer;  // -1 outside a block
+    bool worker;
+    uint64_t t0_ns, dur_ns, self_ns;
+    double flops, bytes;
+    uint64_t allocs;
+};
+
+class Profiler {
+public:
+    struct Frame {
+        const char* name;
+        int layer;
+        uint64_t child_ns;
+    };
+    struct ThreadLog {
+        int tid;
+        std::string label;
+        std::vector<ProfileEvent> events;
+        std::vector<Frame> stack;
+    };
+
+    bool active() const { return on.load(std::memory_order_relaxed); }
+
+    // Clears earlier recordings; the calling thread is labelled "main".
+    void start() {
+        name_thread("main");
+        std::lock_guard<std::mutex> lock(mutex);
+        for (auto& l : logs) {
+            l->events.clear();
+            l->stack.clear();
+        }
+        origin = clock::now();
+        on.store(true, std::memory_order_relaxed);
+    }
+
+    void stop() { on.store(false, std::memory_order_relaxed); }
+
+    uint64_t now_ns() const {
+        return (uint64_t)std::chrono::duration_cast<std::chrono::nanoseconds>(clock::now() - origin).count();
+    }
+
+    ThreadLog& thread_log() {
+        thread_local ThreadLog* mine = nullptr;
+        if (!mine) {
+            std::lock_guard<std::mutex> lock(mutex);
+            logs.push_back(std::make_unique<ThreadLog>());
+            mine = logs.back().get();
+            mine->tid = (int)logs.size() - 1;
+            mine->label = "thread " + std::to_string(mine->tid);
+        }
+        return *mine;
+    }
+
+    // Timeline label for the calling thread (the pool names its workers).
+    void name_thread(const std::string& label) { thread_log().label = label; }
+
+    // Innermost open scope on this thread, for parallel_for to tag its workers.
+    const char* current() {
+        if (!active()) return nullptr;
+        ThreadLog& l = thread_log();
+        return l.stack.empty() ? nullptr : l.stack.back().name;
+    }
+    int current_layer() {
+        if (!active()) return -1;
+        ThreadLog& l = thread_log();
+        return l.stack.empty() ? -1 : l.stack.back().layer;
+    }
+
+    // Every recorded event, thread by thread.
+    std::vector<ProfileEvent> events() {
+        std::lock_guard<std::mutex> lock(mutex);
+        std::vector<ProfileEvent> all;
+        for (auto& l : logs) all.insert(all.end(), l->events.begin(), l->events.end());
+        return all;
+    }
+
+    // Per-op table sorted by self time, then per-layer block totals.
+    void report(std::ostream& os) {
+        struct Row { uint64_t calls = 0, total = 0, self = 0, worker = 0, allocs = 0; double flops = 0, bytes = 0; };
+        std::map<std::string, Row> ops;
+        std::map<int, std::pair<uint64_t, uint64_t>> layers;  // forward, backward ns
+        uint64_t wall = 0;
+        std::lock_guard<std::mutex> lock(mutex);
+        for (auto& l : logs)
+            for (const ProfileEvent& e : l->events) {
+                Row& r = ops[e.name];
+                if (e.worker) {
+                    r.worker += e.dur_ns;
+                    continue;
+                }
+                r.calls++;
+                r.total += e.dur_ns;
+                r.self += e.self_ns;
+                r.flops += e.flops;
+                r.bytes += e.bytes;
+                r.allocs += e.allocs;
+                wall = std::max(wall, e.t0_ns + e.dur_ns);
+                const std::string name = e.name;
+                if (name == "block.forward" || name == "block.recompute") layers[e.layer].first += e.dur_ns;
+                if (name == "block.backward") layers[e.layer].second += e.dur_ns;
+            }
+        std::vector<std::pair<std::string, Row>> sorted(ops.begin(), ops.end());
+        std::sort(sorted.begin(), sorted.end(), [](const auto& a, const auto& b) { return a.second.self > b.second.self; });
+        os << "profiled " << std::fixed << std::setprecision(1) << wall * 1e-6 << " ms on " << logs.size()
+           << " thread(s)\n"
+           << std::left << std::setw(22) << "op" << std::right << std::setw(8) << "calls" << std::setw(12) << "total ms"
+           << std::setw(12) << "self ms" << std::setw(8) << "self%" << std::setw(10) << "GFLOP/s" << std::setw(9)
+           << "GB/s" << std::setw(9) << "allocs" << std::setw(12) << "worker ms" << "\n";
+        for (const auto& [name, r] : sorted) {
+            const double sec = r.total * 1e-9;
+            os << std::left << std::setw(22) << name << std::right << std::setw(8) << r.calls << std::setprecision(2)
+               << std::setw(12) << r.total * 1e-6 << std::setw(12) << r.self * 1e-6 << std::setprecision(1)
+               << std::setw(7) << (wall ? 100.0 * r.self / wall : 0.0) << "%" << std::setw(10)
+               << (sec > 0 && r.flops > 0 ? r.flops / sec * 1e-9 : 0.0) << std::setw(9)
+               << (sec > 0 && r.bytes > 0 ? r.bytes / sec * 1e-9 : 0.0) << std::setw(9) << r.allocs << std::setprecision(2)
+               << std::setw(12) << r.worker * 1e-6 << "\n";
+        }
+        if (!layers.empty()) {
+            os << std::left << std::setw(22) << "layer" << std::right << std::setw(14) << "forward ms" << std::setw(14)
+               << "backward ms" << "\n";
+            for (const auto& [layer, t] : layers)
+                os << std::left << std::setw(22) << ("block " + std::to_string(layer)) << std::right << std::setprecision(2)
+                   << std::setw(14) << t.first * 1e-6 << std::setw(14) << t.second * 1e-6 << "\n";
+        }
+        os << std::defaultfloat << std::setprecision(6);
+    }
+
+    // Chrome trace-event JSON: one complete ("X") event per scope, one
+    // timeline per thread.
+    bool write_chrome_trace(const std::string& path) {
+        std::ofstream f(path);
+        if (!f) {
+            std::cerr << "[PROF] Error: cannot write " << path << "\n";
+            return false;
+        }
+        std::lock_guard<std::mutex> lock(mutex);
+        f << std::fixed << std::setprecision(3) << "{\"displayTimeUnit\": \"ms\", \"traceEvents\": [\n";
+        bool first = true;
+        auto sep = [&] {
+            if (!first) f << ",\n";
+            first = false;
+        };
+        for (auto& l : logs) {
+            sep();
+            f << "{\"name\": \"thread_name\", \"ph\": \"M\", \"pid\": 1, \"tid\": " << l->tid
+              << ", \"args\": {\"name\": \"" << l->label << "\"}}";
+            for (const ProfileEvent& e : l->events) {
+                sep();
+                f << "{\"name\": \"" << e.name << "\", \"cat\": \"" << (e.worker ? "worker" : "op")
+                  << "\", \"ph\": \"X\", \"pid\": 1, \"tid\": " << l->tid << ", \"ts\": " << e.t0_ns * 1e-3
+                  << ", \"dur\": " << e.dur_ns * 1e-3 << ", \"args\": {\"layer\": " << e.layer << ", \"flops\": "
+                  << std::setprecision(0) << e.flops << ", \"bytes\": " << e.bytes << ", \"allocs\": " << e.allocs
+                  << std::setprecision(3) << "}}";
+            }
+        }
+        f << "\n]}\n";
+        return static_cast<bool>(f);
+    }
+
+private:
+    using clock = std::chrono::steady_clock;
+    std::atomic<bool> on{false};
+    std::mutex mutex;
+    std::vector<std::unique_ptr<ThreadLog>> logs;  // live for the process; threads keep pointers
+    clock::time_point origin = clock::now();
+};
+
+inline Profiler& profiler() {
+    static Profiler p;
+    return p;
+}
+
+// flops / bytes: estimates for this call; layer -1 inherits the enclosing
+// scope's. worker marks a pool worker's share of another thread's op.
+class ProfileScope {
+public:
+    explicit ProfileScope(const char* name, double flops = 0, double bytes = 0, int layer = -1, bool worker = false) {
+        Profiler& p = profiler();
+        if (!name || !p.active()) return;
+        log = &p.thread_log();
+        if (layer < 0) layer = p.current_layer();
+        ev = {name, layer, worker, 0, 0, 0, flops, bytes, buffer_heap_allocs()};
+        log->stack.push_back({name, layer, 0});
+        ev.t0_ns = p.now_ns();
+    }
+    ~ProfileScope() {
+        if (!log) return;
+        ev.dur_ns = profiler().now_ns() - ev.t0_ns;
+        ev.allocs = buffer_heap_allocs() - ev.allocs;
+        ev.self_ns = ev.dur_ns - std::min(ev.dur_ns, log->stack.back().child_ns);
+        log->stack.pop_back();
+        if (!log->stack.empty()) log->stack.back().child_ns += ev.dur_ns;
+        log->events.push_back(ev);
+    }
+    ProfileScope(const ProfileScope&) = delete;
+    ProfileScope& operator=(const ProfileScope&) = delete;
+
+private:
+    Profiler::ThreadLog* log = nullptr;
+    ProfileEvent ev{};
+};
+
+#define CARBON_PROFILE_CAT2(a, b) a##b
+#define CARBON_PROFILE_CAT(a, b) CARBON_PROFILE_CAT2(a, b)
+#define PROFILE_SCOPE(...) ProfileScope CARBON_PROFILE_CAT(profile_scope_, __LINE__)(__VA_ARGS__)
+
+#else
+
+class Profiler {
+public:
+    bool active() const { return false; }
+    void start() {}
+    void stop() {}
+    void name_thread(const std::string&) {}
+    const char* current() { return nullptr; }
+    int current_layer() { return -1; }
+    void report(std::ostream& os) { os << "profiling is compiled out; build with -DCARBON_PROFILE\n"; }
+    bool write_chrome_trace(const std::string&) { return false; }
+};
+
+inline Profiler& profiler() {
+    static Profiler p;
+    return p;
+}
+
+#define PROFILE_SCOPE(...) do {} while (0)
+
+#endif
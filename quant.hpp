@@ -0,0 +1,164 @@
+#pragma once
+#include "tensor.hpp"
+#include <cstdint>
+
+// ===== Int8 weight quantization =====
+// Symmetric, group-wise int8 for Linear weights. W [in x out] is stored
+// transposed as q [out x in_pad] so each output channel's weights are
+// contiguous, with one fp32 scale per output channel per QUANT_GROUP inputs
+// (in is zero-padded to a whole number of groups). Activations are quantized
+// on the fly with the same grouping, each group's int8 x int8 dot product is
+// computed with maddubs/madd into int32 (plain int32 sums without AVX2),
+// and the result is scaled into fp32 accumulators.
+constexpr int QUANT_GROUP = 32;
+
+struct QuantWeight {
+    int in = 0, out = 0, in_pad = 0, groups = 0;
+    std::vector<int8_t> q_store;  // owned storage, unless mapped from a checkpoint
+    std::vector<float> s_store;
+    const int8_t* q = nullptr;
+    const float* scales = nullptr;
+
+    bool empty() const { return q == nullptr; }
+    size_t bytes() const { return (size_t)out * in_pad + (size_t)out * groups * sizeof(float); }
+
+    void set_shape(int in_, int out_) {
+        in = in_;
+        out = out_;
+        groups = (in + QUANT_GROUP - 1) / QUANT_GROUP;
+        in_pad = groups * QUANT_GROUP;
+    }
+
+    void quantize(const Tensor& W) {
+        set_shape(W.rows, W.cols);
+        q_store.assign((size_t)out * in_pad, 0);
+        s_store.assign((size_t)out * groups, 0.0f);
+        for (int j = 0; j < out; j++)
+            for (int g = 0; g < groups; g++) {
+                const int k0 = g * QUANT_GROUP, k1 = std::min(in, k0 + QUANT_GROUP);
+                float amax = 0;
+                for (int k = k0; k < k1; k++) amax = std::max(amax, std::fabs(W(k, j)));
+                const float s = amax / 127.0f, inv = s > 0 ? 1.0f / s : 0.0f;
+                s_store[(size_t)j * groups + g] = s;
+                for (int k = k0; k < k1; k++)
+                    q_store[(size_t)j * in_pad + k] = static_cast<int8_t>(std::lrint(W(k, j) * inv));
+            }
+        q = q_store.data();
+        scales = s_store.data();
+    }
+
+    // Uses externally owned storage (e.g. a mapped checkpoint) in place.
+    void map(const int8_t* qp, const float* sp, int in_, int out_) {
+        set_shape(in_, out_);
+        q_store.clear();
+        s_store.clear();
+        q = qp;
+        scales = sp;
+    }
+
+    Tensor dequantize() const {
+        Tensor W(in, out);
+        for (int j = 0; j < out; j++)
+            for (int k = 0; k < in; k++)
+                W(k, j) = q[(size_t)j * in_pad + k] * scales[(size_t)j * groups + k / QUANT_GROUP];
+        return W;
+    }
+
+    // y[M x out] = x[M x in] * W + bias (bias may be null).
+    void forward(const float* x, int M, int ldx, float* y, int ldy, const float* bias) const {
+        thread_local std::vector<int8_t> xq;
+        thread_local std::vector<float> xs;
+        xq.assign((size_t)M * in_pad, 0);
+        xs.resize((size_t)M * groups);
+        int8_t* xqp = xq.data();
+        float* xsp = xs.data();
+        parallel_for(0, M, std::max(1, 16384 / std::max(1, in)), [&](int i0, int i1) {
+            for (int i = i0; i < i1; i++) quantize_row(x + (size_t)i * ldx, xqp + (size_t)i * in_pad, xsp + (size_t)i * groups);
+        });
+
+        // ~2.5e5 MACs per chunk, so decode-sized calls still spread out
+        const int grain = (int)std::max(8.0, std::min<double>(out, 2.5e5 / std::max(1.0, (double)M * in)));
+        const bool avx2 = has_avx2();
+        parallel_for(0, out, grain, [&](int j0, int j1) {
+            for (int j = j0; j < j1; j++) {
+                const int8_t* w = q + (size_t)j * in_pad;
+                const float* ws = scales + (size_t)j * groups;
+                const float bj = bias ? bias[j] : 0.0f;
+                int i = 0;
+                if (avx2)
+                    for (; i + 4 <= M; i += 4) {
+                        float r[4];
+                        dot4_avx2(xqp + (size_t)i * in_pad, xsp + (size_t)i * groups, w, ws, r);
+                        for (int t = 0; t < 4; t++) y[(size_t)(i + t) * ldy + j] = r[t] + bj;
+                    }
+                for (; i < M; i++) {
+                    const int8_t* a = xqp + (size_t)i * in_pad;
+                    const float* as = xsp + (size_t)i * groups;
+                    y[(size_t)i * ldy + j] = (avx2 ? dot_avx2(a, as, w, ws) : dot_scalar(a, as, w, ws)) + bj;
+                }
+            }
+        });
+    }
+
+private:
+    void quantize_row(const float* x, int8_t* xq, float* xs) const {
+        for (int g = 0; g < groups; g++) {
+            const int k0 = g * QUANT_GROUP, k1 = std::min(in, k0 + QUANT_GROUP);
+            float amax = 0;
+            for (int k = k0; k < k1; k++) amax = std::max(amax, std::fabs(x[k]));
+            const float s = amax / 127.0f, inv = s > 0 ? 1.0f / s : 0.0f;
+            xs[g] = s;
+            for (int k = k0; k < k1; k++) xq[k] = static_cast<int8_t>(std::lrint(x[k] * inv));
+        }
+    }
+
+    // |a| * (w with a's sign) keeps maddubs' unsigned x signed contract;
+    // 2 * 127 * 127 fits in int16 without saturating.
+    CARBON_AVX2 static inline __m256 group_dot(__m256i va, __m256i vw) {
+        const __m256i p16 = _mm256_maddubs_epi16(_mm256_sign_epi8(va, va), _mm256_sign_epi8(vw, va));
+        return _mm256_cvtepi32_ps(_mm256_madd_epi16(p16, _mm256_set1_epi16(1)));
+    }
+
+    float dot_scalar(const int8_t* a, const float* sa, const int8_t* w, const float* sw) const {
+        float acc = 0.0f;
+        for (int g = 0; g < groups; g++) {
+            int32_t s = 0;
+            for (int k = g * QUANT_GROUP; k < (g + 1) * QUANT_GROUP; k++) s += (int32_t)a[k] * w[k];
+            acc += (float)s * (sa[g] * sw[g]);
+        }
+        return acc;
+    }
+
+    CARBON_AVX2 float dot_avx2(const int8_t* a, const float* sa, const int8_t* w, const float* sw) const {
+        __m256 acc = _mm256_setzero_ps();
+        for (int g = 0; g < groups; g++) {
+            const __m256i va = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(a + g * QUANT_GROUP));
+            const __m256i vw = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(w + g * QUANT_GROUP));
+            acc = _mm256_fmadd_ps(group_dot(va, vw), _mm256_set1_ps(sa[g] * sw[g]), acc);
+        }
+        return hsum256_ps(acc);
+    }
+
+    // Four activation rows against one weight row: each weight group is
+    // loaded once and reused.
+    CARBON_AVX2 void dot4_avx2(const int8_t* a, const float* sa, const int8_t* w, const float* sw, float* r) const {
+        __m256 acc0 = _mm256_setzero_ps(), acc1 = acc0, acc2 = acc0, acc3 = acc0;
+        for (int g = 0; g < groups; g++) {
+            const __m256i vw = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(w + g * QUANT_GROUP));
+            const int8_t* ag = a + g * QUANT_GROUP;
+            const float s = sw[g];
+            acc0 = _mm256_fmadd_ps(group_dot(_mm256_loadu_si256(reinterpret_cast<const __m256i*>(ag)), vw),
+                              _mm256_set1_ps(sa[g] * s), acc0);
+            acc1 = _mm256_fmadd_ps(group_dot(_mm256_loadu_si256(reinterpret_cast<const __m256i*>(ag + in_pad)), vw),
+                              _mm256_set1_ps(sa[groups + g] * s), acc1);
+            acc2 = _mm256_fmadd_ps(group_dot(_mm256_loadu_si256(reinterpret_cast<const __m256i*>(ag + 2 * in_pad)), vw),
+                              _mm256_set1_ps(sa[2 * groups + g] * s), acc2);
+            acc3 = _mm256_fmadd_ps(group_dot(_mm256_loadu_si256(reinterpret_cast<const __m256i*>(ag + 3 * in_pad)), vw),
+                              _mm256_set1_ps(sa[3 * groups + g] * s), acc3);
+        }
+        r[0] = hsum256_ps(acc0);
+        r[1] = hsum256_ps(acc1);
+        r[2] = hsum256_ps(acc2);
+        r[3] = hsum256_ps(acc3);
+    }
+};
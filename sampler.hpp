@@ -0,0 +1,230 @@
+#pragma once
+#include "tensor.hpp"
+#include "kernels.hpp"
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <functional>
+#include <limits>
+#include <random>
+#include <utility>
+#include <vector>
+
+// ===== Token sampler =====
+// Picks the next token from one row of logits. The work is proportional
+// to the candidate set, not the vocab: top-k is one SIMD threshold scan
+// (one compare per 8 logits) that keeps only logits that can still make
+// the top k, and top-p only sorts and exponentiates those candidates. Without
+// top-k, top-p draws from the SAMPLER_CANDIDATES best logits, falling back
+// to an exact full-vocab normalizer only when the mass outside them could
+// matter. Repetition penalty rescales just the tokens in the recent
+// history (divide positive logits, multiply negative ones).
+constexpr int SAMPLER_CANDIDATES = 1024;
+
+struct SamplerConfig {
+    float temperature = 1.0f;         // <= 0: greedy
+    int top_k = 0;                    // 0: off
+    float top_p = 1.0f;               // 1: off
+    float repetition_penalty = 1.0f;  // 1: off
+    int penalty_window = 64;          // most recent tokens penalized (0: all)
+    uint64_t seed = 0;
+};
+
+struct Sampler {
+    SamplerConfig cfg;
+    std::mt19937_64 rng;
+    std::vector<int> history;  // tokens seen so far, for the repetition penalty
+
+    explicit Sampler(const SamplerConfig& c = SamplerConfig()) : cfg(c), rng(c.seed) {}
+
+    void reset(uint64_t seed) {
+        rng.seed(seed);
+        history.clear();
+    }
+
+    // Records tokens (prompt or sampled) for the repetition penalty.
+    void accept(int token) { history.push_back(token); }
+    void accept(const std::vector<int>& tokens) { history.insert(history.end(), tokens.begin(), tokens.end()); }
+
+    // Samples from logits[0, n). The logits are modified in place (penalty).
+    int sample(float* logits, int n) {
+        apply_penalty(logits, n);
+        if (cfg.temperature <= 0.0f || cfg.top_k == 1) return argmax(logits, n);
+
+        const float inv_t = 1.0f / cfg.temperature;
+        const bool nucleus = cfg.top_p < 1.0f;
+        if (cfg.top_k <= 0 && !nucleus) return sample_full(logits, n, inv_t);
+
+        const int k = std::min(n, cfg.top_k > 0 ? cfg.top_k : SAMPLER_CANDIDATES);
+        select_top(logits, n, k);
+        std::sort(cand.begin(), cand.end(), std::greater<std::pair<float, int>>());
+
+        // weights relative to the best candidate
+        const float mx = cand[0].first;
+        weight.resize(cand.size());
+        double cand_mass = 0;
+        for (size_t i = 0; i < cand.size(); ++i) cand_mass += weight[i] = std::exp((cand[i].first - mx) * inv_t);
+
+        size_t keep = cand.size();
+        if (nucleus) {
+            // With top-k the distribution is already truncated to the k
+            // candidates. Without it, the (n - k) tokens below the threshold
+            // carry at most (n - k) * w_min of mass; use the exact
+            // normalizer when that could move the cutoff.
+            double total = cand_mass;
+            if (cfg.top_k <= 0 && k < n && (n - k) * weight.back() > 1e-4 * cand_mass)
+                total = full_mass(logits, n, mx, inv_t);
+            const double target = cfg.top_p * total;
+            double cum = 0;
+            for (keep = 0; keep < cand.size();) {
+                cum += weight[keep++];
+                if (cum >= target) break;
+            }
+        }
+
+        double kept = 0;
+        for (size_t i = 0; i < keep; ++i) kept += weight[i];
+        double u = uniform() * kept;
+        for (size_t i = 0; i < keep; ++i)
+            if ((u -= weight[i]) < 0) return cand[i].second;
+        return cand[keep - 1].second;
+    }
+
+    int sample(Tensor& logits) { return sample(logits.val.data(), logits.cols); }
+
+    // Index of the largest logit (first on ties).
+    static int argmax(const float* x, int n) { return has_avx2() ? argmax_avx2(x, n) : argmax_scalar(x, n); }
+
+    static int argmax_scalar(const float* x, int n) {
+        int best = 0;
+        for (int j = 1; j < n; ++j)
+            if (x[j] > x[best]) best = j;
+        return best;
+    }
+
+    CARBON_AVX2 static int argmax_avx2(const float* x, int n) {
+        int j = 0;
+        __m256 m0 = _mm256_set1_ps(-std::numeric_limits<float>::infinity()), m1 = m0, m2 = m0, m3 = m0;
+        for (; j + 32 <= n; j += 32) {
+            m0 = _mm256_max_ps(m0, _mm256_loadu_ps(x + j));
+            m1 = _mm256_max_ps(m1, _mm256_loadu_ps(x + j + 8));
+            m2 = _mm256_max_ps(m2, _mm256_loadu_ps(x + j + 16));
+            m3 = _mm256_max_ps(m3, _mm256_loadu_ps(x + j + 24));
+        }
+        for (; j + 8 <= n; j += 8) m0 = _mm256_max_ps(m0, _mm256_loadu_ps(x + j));
+        float best = hmax256_ps(_mm256_max_ps(_mm256_max_ps(m0, m1), _mm256_max_ps(m2, m3)));
+        for (; j < n; ++j) best = std::max(best, x[j]);
+
+        const __m256 vb = _mm256_set1_ps(best);
+        for (j = 0; j + 8 <= n; j += 8)
+            if (int mask = _mm256_movemask_ps(_mm256_cmp_ps(_mm256_loadu_ps(x + j), vb, _CMP_EQ_OQ)))
+                return j + __builtin_ctz(mask);
+        for (; j < n; ++j)
+            if (x[j] == best) return j;
+        return 0;
+    }
+
+private:
+    std::vector<std::pair<float, int>> cand;  // (logit, token), sorted once selected
+    std::vector<double> weight;
+    std::vector<int> penalized;
+
+    // 24 random bits -> [0, 1); the same on every platform for a seed.
+    double uniform() { return (rng() >> 40) * (1.0 / (1 << 24)); }
+
+    void apply_penalty(float* logits, int n) {
+        if (cfg.repetition_penalty == 1.0f || history.empty()) return;
+        const size_t from = cfg.penalty_window > 0 && history.size() > (size_t)cfg.penalty_window
+                                ? history.size() - cfg.penalty_window : 0;
+        penalized.assign(history.begin() + from, history.end());
+        std::sort(penalized.begin(), penalized.end());
+        penalized.erase(std::unique(penalized.begin(), penalized.end()), penalized.end());
+        for (int t : penalized) {
+            if (t < 0 || t >= n) continue;
+            logits[t] = logits[t] > 0 ? logits[t] / cfg.repetition_penalty : logits[t] * cfg.repetition_penalty;
+        }
+    }
+
+    // cand = the k largest (logit, token) pairs, unordered. Logits above a
+    // running threshold are appended; whenever 2k have piled up they are cut
+    // back to the best k and the threshold rises to the k-th.
+    void select_top(const float* x, int n, int k) {
+        cand.clear();
+        auto gt = std::greater<std::pair<float, int>>();
+        float thr = -std::numeric_limits<float>::infinity();
+        auto compact = [&] {
+            std::nth_element(cand.begin(), cand.begin() + (k - 1), cand.end(), gt);
+            cand.resize(k);
+            thr = cand[k - 1].first;
+        };
+        const bool avx2 = has_avx2();
+        int j = 0;
+        for (; j + 8 <= n; j += 8) {
+            int mask = avx2 ? gt_mask8_avx2(x + j, thr) : gt_mask8_scalar(x + j, thr);
+            while (mask) {
+                const int t = j + __builtin_ctz(mask);
+                cand.emplace_back(x[t], t);
+                mask &= mask - 1;
+            }
+            if ((int)cand.size() >= 2 * k) compact();
+        }
+        for (; j < n; ++j)
+            if (x[j] > thr) cand.emplace_back(x[j], j);
+        if ((int)cand.size() > k) compact();
+    }
+
+    // Bit i set if x[i] > thr, for i in [0, 8).
+    static int gt_mask8_scalar(const float* x, float thr) {
+        int mask = 0;
+        for (int i = 0; i < 8; ++i) mask |= (x[i] > thr) << i;
+        return mask;
+    }
+    CARBON_AVX2 static int gt_mask8_avx2(const float* x, float thr) {
+        return _mm256_movemask_ps(_mm256_cmp_ps(_mm256_loadu_ps(x), _mm256_set1_ps(thr), _CMP_GT_OQ));
+    }
+
+    // w[i] = exp((x[i] - mx) * inv_t), for i in [0, 8).
+    static void exp8_scalar(const float* x, float mx, float inv_t, float* w) {
+        for (int i = 0; i < 8; ++i) w[i] = std::exp((x[i] - mx) * inv_t);
+    }
+    CARBON_AVX2 static void exp8_avx2(const float* x, float mx, float inv_t, float* w) {
+        _mm256_store_ps(w, exp256_ps(_mm256_mul_ps(_mm256_sub_ps(_mm256_loadu_ps(x), _mm256_set1_ps(mx)),
+                                                   _mm256_set1_ps(inv_t))));
+    }
+
+    // sum_j exp((x[j] - mx) * inv_t) over the whole row.
+    static double full_mass(const float* x, int n, float mx, float inv_t) {
+        double sum = 0.0;
+        int j = has_avx2() ? full_mass_avx2(x, n, mx, inv_t, sum) : 0;
+        for (; j < n; ++j) sum += std::exp((x[j] - mx) * inv_t);
+        return sum;
+    }
+    // The 8-wide body; returns where the scalar tail starts.
+    CARBON_AVX2 static int full_mass_avx2(const float* x, int n, float mx, float inv_t, double& sum) {
+        const __m256 vm = _mm256_set1_ps(mx), vt = _mm256_set1_ps(inv_t);
+        __m256 acc = _mm256_setzero_ps();
+        int j = 0;
+        for (; j + 8 <= n; j += 8) acc = _mm256_add_ps(acc, exp256_ps(_mm256_mul_ps(_mm256_sub_ps(_mm256_loadu_ps(x + j), vm), vt)));
+        sum = hsum256_ps(acc);
+        return j;
+    }
+
+    // Plain temperature sampling needs the whole distribution: one pass
+    // for the mass, one to find where the draw lands.
+    int sample_full(const float* x, int n, float inv_t) {
+        const float mx = x[argmax(x, n)];
+        double u = uniform() * full_mass(x, n, mx, inv_t);
+        const bool avx2 = has_avx2();
+        alignas(32) float w[8];
+        int j = 0;
+        for (; j + 8 <= n; j += 8) {
+            if (avx2) exp8_avx2(x + j, mx, inv_t, w);
+            else exp8_scalar(x + j, mx, inv_t, w);
+            for (int i = 0; i < 8; ++i)
+                if ((u -= w[i]) < 0) return j + i;
+        }
+        for (; j < n; ++j)
+            if ((u -= std::exp((x[j] - mx) * inv_t)) < 0) return j;
+        return n - 1;
+    }
+};
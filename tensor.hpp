@@ -6,13 +6,74 @@
 #include <immintrin.h>
 #include <fstream>
 #include <random>
+#include "gemm.hpp"
+#include "workspace.hpp"
+
+// ===== SGD update =====
+// w[i] -= lr * g[i], then g[i] = 0, for i in [0, n).
+inline void sgd_update_scalar(float* w, float* g, float lr, size_t n) {
+    for (size_t i = 0; i < n; ++i) {
+        w[i] -= lr * g[i];
+        g[i] = 0.0f;
+    }
+}
+
+CARBON_AVX2 inline void sgd_update_avx2(float* w, float* g, float lr, size_t n) {
+    const __m256 vnlr = _mm256_set1_ps(-lr), zero = _mm256_setzero_ps();
+    size_t i = 0;
+    for (; i + 8 <= n; i += 8) {
+        _mm256_storeu_ps(w + i, _mm256_fmadd_ps(vnlr, _mm256_loadu_ps(g + i), _mm256_loadu_ps(w + i)));
+        _mm256_storeu_ps(g + i, zero);
+    }
+    sgd_update_scalar(w + i, g + i, lr, n - i);
+}
+
+// ===== Grad Mode =====
+// While a NoGradGuard is alive, new Tensors get no grad storage and layers
+// skip caching activations for backward (inference / serving).
+inline bool& grad_enabled() {
+    thread_local bool on = true;
+    return on;
+}
+
+struct NoGradGuard {
+    bool prev;
+    NoGradGuard() : prev(grad_enabled()) { grad_enabled() = false; }
+    ~NoGradGuard() { grad_enabled() = prev; }
+    NoGradGuard(const NoGradGuard&) = delete;
+    NoGradGuard& operator=(const NoGradGuard&) = delete;
+};
+
+// While a ShapeOnlyGuard is alive, new Tensors record their shape but get
+// no storage. Used to build a model skeleton whose weights are then mapped
+// in from a checkpoint instead of being allocated and randomized.
+inline bool& shape_only() {
+    thread_local bool on = false;
+    return on;
+}
+
+struct ShapeOnlyGuard {
+    bool prev;
+    ShapeOnlyGuard() : prev(shape_only()) { shape_only() = true; }
+    ~ShapeOnlyGuard() { shape_only() = prev; }
+    ShapeOnlyGuard(const ShapeOnlyGuard&) = delete;
+    ShapeOnlyGuard& operator=(const ShapeOnlyGuard&) = delete;
+};
 
 struct Tensor {
     int rows, cols;
-    std::vector<float> val, grad;
+    Buffer val, grad;  // heap, active Workspace, or a view (see workspace.hpp)
 
     Tensor(int r = 0, int c = 0)
-        : rows(r), cols(c), val(r * c, 0.0f), grad(r * c, 0.0f) {}
+        : rows(r), cols(c), val(storage_size(r, c), 0.0f), grad(grad_enabled() ? storage_size(r, c) : 0, 0.0f) {}
+
+    // val is left uninitialized; for outputs that are fully overwritten.
+    Tensor(int r, int c, Buffer::Uninit u)
+        : rows(r), cols(c), val(storage_size(r, c), u), grad(grad_enabled() ? storage_size(r, c) : 0, 0.0f) {}
+
+    static size_t storage_size(int r, int c) { return shape_only() ? 0 : (size_t)r * c; }
+
+    static Tensor uninit(int r, int c) { return Tensor(r, c, Buffer::Uninit{}); }
 
     inline float& operator()(int i, int j) {
         assert(i >= 0 && i < rows && j >= 0 && j < cols);
@@ -28,38 +89,27 @@ struct Tensor {
         std::fill(grad.begin(), grad.end(), 0.0f);
     }
 
+    // Plain SGD: val -= lr * grad, then grad = 0. Split across the thread pool.
+    void sgd_step(float lr) {
+        constexpr int CHUNK = 1 << 15;
+        const size_t n = std::min(val.size(), grad.size());
+        float* w = val.data();
+        float* g = grad.data();
+        const bool avx2 = has_avx2();
+        parallel_for(0, (int)((n + CHUNK - 1) / CHUNK), 1, [&](int c0, int c1) {
+            const size_t i = (size_t)c0 * CHUNK, end = std::min(n, (size_t)c1 * CHUNK);
+            if (avx2) sgd_update_avx2(w + i, g + i, lr, end - i);
+            else sgd_update_scalar(w + i, g + i, lr, end - i);
+        });
+    }
+
     void randomize(float s = 0.02f) {
         static std::mt19937 gen(std::random_device{}());
         std::uniform_real_distribution<float> d(-s, s);
         for (auto& x : val) x = d(gen);
     }
 
-    static float dot_simd(const float* a, const float* b, int n) {
-        __m256 acc = _mm256_setzero_ps();
-        int i = 0;
-
-        for (; i + 8 <= n; i += 8) {
-            __m256 va = _mm256_loadu_ps(a + i);
-            __m256 vb = _mm256_loadu_ps(b + i);
-        #ifdef __FMA__
-            acc = _mm256_fmadd_ps(va, vb, acc);
-        #else
-            acc = _mm256_add_ps(acc, _mm256_mul_ps(va, vb));
-        #endif
-        }
-
-        alignas(32) float tmp[8];
-        _mm256_store_ps(tmp, acc);
-
-        float sum =
-            tmp[0] + tmp[1] + tmp[2] + tmp[3] +
-            tmp[4] + tmp[5] + tmp[6] + tmp[7];
-
-        for (; i < n; ++i)
-            sum += a[i] * b[i];
-
-        return sum;
-    }
+    static float dot_simd(const float* a, const float* b, int n) { return kernels().dot(a, b, n); }
 
     static Tensor transpose(const Tensor& t) {
         Tensor out(t.cols, t.rows);
@@ -71,18 +121,9 @@ struct Tensor {
 
     static Tensor matmul(const Tensor& A, const Tensor& B) {
         assert(A.cols == B.rows);
-
-        Tensor Bt = transpose(B);
-        Tensor C(A.rows, B.cols);
-
-        for (int i = 0; i < A.rows; ++i) {
-            const float* arow = &A.val[i * A.cols];
-            for (int j = 0; j < B.cols; ++j) {
-                const float* brow = &Bt.val[j * Bt.cols];
-                C(i, j) = dot_simd(arow, brow, A.cols);
-            }
-        }
-
+        Tensor C = uninit(A.rows, B.cols);
+        gemm(A.rows, B.cols, A.cols, A.val.data(), A.cols,
+             B.val.data(), B.cols, C.val.data(), C.cols);
         return C;
     }
 
@@ -97,8 +138,44 @@ struct Tensor {
         f.read(reinterpret_cast<char*>(&rows), sizeof(int));
         f.read(reinterpret_cast<char*>(&cols), sizeof(int));
         val.resize(rows * cols);
-        grad.assign(rows * cols, 0.0f);
+        grad.assign(grad_enabled() ? rows * cols : 0, 0.0f);
         f.read(reinterpret_cast<char*>(val.data()),
                val.size() * sizeof(float));
     }
 };
+
+// ===== Sparse row gradient =====
+// Gradient of a [n_rows x cols] table of which a step only touches a few
+// rows (the embedding table): one dense row per touched row id, in first-
+// touch order, instead of a table-sized buffer. Always heap storage, since
+// it outlives any workspace step.
+struct SparseRowGrad {
+    int n_rows = 0, cols = 0;
+    std::vector<int> ids;     // touched row ids
+    std::vector<float> grad;  // [ids.size() x cols], row k belongs to ids[k]
+    std::vector<int> slot;    // row id -> k, or -1 if untouched (sized on first use)
+
+    SparseRowGrad(int r = 0, int c = 0) : n_rows(r), cols(c) {}
+
+    // Gradient row of id, added (zeroed) on first touch. Invalidated by
+    // the next call that adds a row.
+    float* row(int id) {
+        assert(id >= 0 && id < n_rows);
+        if (slot.empty()) slot.assign(n_rows, -1);
+        int& k = slot[id];
+        if (k < 0) {
+            k = static_cast<int>(ids.size());
+            ids.push_back(id);
+            grad.resize(ids.size() * (size_t)cols, 0.0f);
+        }
+        return grad.data() + (size_t)k * cols;
+    }
+
+    size_t size() const { return ids.size(); }
+
+    void clear() {
+        for (int id : ids) slot[id] = -1;
+        ids.clear();
+        grad.clear();
+    }
+};
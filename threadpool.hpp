@@ -0,0 +1,229 @@
+#pragma once
+#include "profiler.hpp"
+#include <immintrin.h>
+#include <pthread.h>
+#include <sched.h>
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <cstdlib>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+// ===== Thread pool =====
+// Persistent workers shared by every parallel loop (GEMM, attention,
+// LayerNorm, softmax, optimizer steps). parallel_for splits [begin, end)
+// into grain-sized chunks and deals each participant a contiguous run of
+// them; a participant that runs dry steals the back half of the busiest-
+// looking victim's run, so uneven chunks (causal attention blocks, ragged
+// batches) still balance. Each run is one packed (lo, hi) atomic, so
+// popping and stealing are single CASes and a call allocates nothing.
+//
+// Nested calls (a GEMM inside an attention unit) and calls racing in from
+// a second thread run serially on the calling thread. Under
+// CARBON_PROFILE each worker's share of a call is recorded on its own
+// timeline under the caller's innermost profile scope.
+class ThreadPool {
+public:
+    // threads counts the calling thread; 0 = every hardware thread.
+    // With pin, participant t is bound to core t.
+    explicit ThreadPool(int threads = 0, bool pin = false) {
+        if (threads <= 0) threads = std::max(1u, std::thread::hardware_concurrency());
+        slots = std::unique_ptr<Slot[]>(new Slot[threads]);
+        n = threads;
+        if (pin) pin_to_core(0);
+        workers.reserve(threads - 1);
+        for (int t = 1; t < threads; ++t)
+            workers.emplace_back([this, t, pin] {
+                if (pin) pin_to_core(t);
+                worker_loop(t);
+            });
+    }
+
+    ~ThreadPool() {
+        {
+            std::lock_guard<std::mutex> lock(wake_mutex);
+            stop = true;
+        }
+        wake.notify_all();
+        for (auto& w : workers) w.join();
+    }
+    ThreadPool(const ThreadPool&) = delete;
+    ThreadPool& operator=(const ThreadPool&) = delete;
+
+    int size() const { return n; }
+
+    // fn(lo, hi) over grain-sized pieces of [begin, end).
+    template <typename F>
+    void parallel_for(int begin, int end, int grain, F&& fn) {
+        if (end <= begin) return;
+        grain = std::max(grain, 1);
+        const int chunks = (end - begin + grain - 1) / grain;
+        std::unique_lock<std::mutex> busy(run_mutex, std::try_to_lock);
+        if (n == 1 || chunks == 1 || in_worker() || !busy.owns_lock()) {
+            fn(begin, end);
+            return;
+        }
+
+        using Fn = typename std::remove_reference<F>::type;
+        job.ctx = const_cast<void*>(static_cast<const void*>(&fn));
+        job.call = [](void* ctx, int lo, int hi) { (*static_cast<Fn*>(ctx))(lo, hi); };
+        job.begin = begin;
+        job.end = end;
+        job.grain = grain;
+        job.scope = profiler().current();
+        job.layer = profiler().current_layer();
+        const int parts = std::min(n, chunks);
+        for (int t = 0; t < n; ++t) {
+            const int lo = t < parts ? (int)((long long)chunks * t / parts) : 0;
+            const int hi = t < parts ? (int)((long long)chunks * (t + 1) / parts) : 0;
+            slots[t].range.store(pack(lo, hi), std::memory_order_relaxed);
+        }
+        active.store(n - 1, std::memory_order_relaxed);
+        {
+            std::lock_guard<std::mutex> lock(wake_mutex);
+            generation.fetch_add(1, std::memory_order_release);
+        }
+        wake.notify_all();
+
+        in_worker() = true;
+        run(0);
+        in_worker() = false;
+        // Workers touch job/slots until they check out, so the next call
+        // (and fn's lifetime) must wait for all of them.
+        for (int spins = 0; active.load(std::memory_order_acquire) != 0; ++spins)
+            if (spins > 64) std::this_thread::yield(); else _mm_pause();
+    }
+
+private:
+    struct alignas(64) Slot { std::atomic<uint64_t> range{0}; };
+    struct Job {
+        void (*call)(void*, int, int) = nullptr;
+        void* ctx = nullptr;
+        int begin = 0, end = 0, grain = 1;
+        const char* scope = nullptr;  // caller's profile scope, if recording
+        int layer = -1;
+    };
+
+    int n = 1;
+    std::unique_ptr<Slot[]> slots;
+    std::vector<std::thread> workers;
+    Job job;
+    std::mutex run_mutex, wake_mutex;
+    std::condition_variable wake;
+    std::atomic<uint64_t> generation{0};
+    std::atomic<int> active{0};
+    bool stop = false;
+
+    static uint64_t pack(int lo, int hi) { return (uint64_t)(uint32_t)lo << 32 | (uint32_t)hi; }
+    static int lo_of(uint64_t r) { return (int)(r >> 32); }
+    static int hi_of(uint64_t r) { return (int)(uint32_t)r; }
+
+    static bool& in_worker() {
+        thread_local bool w = false;
+        return w;
+    }
+
+    static void pin_to_core(int t) {
+        const int cores = std::max(1u, std::thread::hardware_concurrency());
+        cpu_set_t set;
+        CPU_ZERO(&set);
+        CPU_SET(t % cores, &set);
+        pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+    }
+
+    // Owner side: take the front chunk of its own run.
+    bool pop(int t, int& chunk) {
+        uint64_t r = slots[t].range.load(std::memory_order_acquire);
+        while (lo_of(r) < hi_of(r))
+            if (slots[t].range.compare_exchange_weak(r, pack(lo_of(r) + 1, hi_of(r)), std::memory_order_acq_rel)) {
+                chunk = lo_of(r);
+                return true;
+            }
+        return false;
+    }
+
+    // Thief side: move the back half of some victim's run into slot t.
+    bool steal(int t) {
+        for (int k = 1; k < n; ++k) {
+            Slot& v = slots[(t + k) % n];
+            uint64_t r = v.range.load(std::memory_order_acquire);
+            while (lo_of(r) < hi_of(r)) {
+                const int lo = lo_of(r), hi = hi_of(r), mid = lo + (hi - lo) / 2;
+                if (v.range.compare_exchange_weak(r, pack(lo, mid), std::memory_order_acq_rel)) {
+                    slots[t].range.store(pack(mid, hi), std::memory_order_release);
+                    return true;
+                }
+            }
+        }
+        return false;
+    }
+
+    void run(int t) {
+        int chunk;
+        for (;;) {
+            while (pop(t, chunk)) {
+                const int lo = job.begin + chunk * job.grain;
+                job.call(job.ctx, lo, std::min(job.end, lo + job.grain));
+            }
+            if (!steal(t)) return;
+        }
+    }
+
+    void worker_loop(int t) {
+        in_worker() = true;
+        profiler().name_thread("pool worker " + std::to_string(t));
+        uint64_t seen = 0;
+        for (;;) {
+            // Back-to-back calls (layer after layer) rarely reach the wait.
+            for (int spins = 0; generation.load(std::memory_order_acquire) == seen && spins < 2000; ++spins)
+                if (spins > 64) std::this_thread::yield(); else _mm_pause();
+            {
+                std::unique_lock<std::mutex> lock(wake_mutex);
+                wake.wait(lock, [&] { return stop || generation.load(std::memory_order_acquire) != seen; });
+                if (stop) return;
+            }
+            seen = generation.load(std::memory_order_acquire);
+            {
+                PROFILE_SCOPE(job.scope, 0, 0, job.layer, true);
+                run(t);
+            }
+            active.fetch_sub(1, std::memory_order_release);
+        }
+    }
+};
+
+// ===== Process-wide pool =====
+// Sized from CARBON_THREADS (default: every hardware thread), pinned if
+// CARBON_PIN=1. set_num_threads rebuilds it; call it between steps, never
+// while a parallel loop is running.
+inline std::unique_ptr<ThreadPool>& thread_pool_instance() {
+    static std::unique_ptr<ThreadPool> pool;
+    return pool;
+}
+
+inline ThreadPool& thread_pool() {
+    auto& pool = thread_pool_instance();
+    if (!pool) {
+        const char* threads = std::getenv("CARBON_THREADS");
+        const char* pin = std::getenv("CARBON_PIN");
+        pool.reset(new ThreadPool(threads ? std::atoi(threads) : 0, pin && *pin == '1'));
+    }
+    return *pool;
+}
+
+inline void set_num_threads(int threads, bool pin = false) {
+    thread_pool_instance().reset();
+    thread_pool_instance().reset(new ThreadPool(threads, pin));
+}
+
+inline int num_threads() { return thread_pool().size(); }
+
+template <typename F>
+inline void parallel_for(int begin, int end, int grain, F&& fn) {
+    thread_pool().parallel_for(begin, end, grain, std::forward<F>(fn));
+}
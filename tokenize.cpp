@@ -0,0 +1,31 @@
+#include "corpus.hpp"
+#include <chrono>
+#include <iostream>
+#include <string>
+
+// Tokenizes a text corpus into binary token shards (see corpus.hpp).
+// usage: cb_tokenize <tokenizer.model> <corpus.txt> <out_prefix> [chunk_kb] [shard_mtokens]
+// Threads come from CARBON_THREADS.
+int main(int argc, char** argv) {
+    if (argc < 4 || argc > 6) {
+        std::cerr << "usage: " << argv[0] << " <tokenizer.model> <corpus.txt> <out_prefix> [chunk_kb] [shard_mtokens]\n";
+        return 1;
+    }
+    BPETokenizer tok;
+    tok.load_token(argv[1]);
+    if (tok.rev_vocab.empty()) return 1;
+
+    CorpusOptions opt;
+    if (argc > 4) opt.chunk_bytes = std::stoul(argv[4]) << 10;
+    if (argc > 5) opt.shard_tokens = std::stoull(argv[5]) * 1000000ull;
+
+    CorpusStats st;
+    auto t0 = std::chrono::steady_clock::now();
+    if (!tokenize_corpus(tok, argv[2], argv[3], opt, &st)) return 1;
+    double s = std::chrono::duration<double>(std::chrono::steady_clock::now() - t0).count();
+
+    std::cout << "Wrote " << st.tokens << " tokens in " << st.shards.size() << " shard(s) from " << st.bytes
+              << " bytes (" << st.bytes / 1e6 / s << " MB/s, " << num_threads() << " threads)\n";
+    for (const auto& p : st.shards) std::cout << "  " << p << "\n";
+    return 0;
+}
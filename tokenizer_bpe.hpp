@@ -1,5 +1,6 @@
 #pragma once
 #include <string>
+#include <cstdint>
 #include <vector>
 #include <unordered_map>
 #include <map>
@@ -10,6 +11,44 @@
 #include <set>
 #include <iomanip>
 #include <iterator>
+#include <list>
+#include <string_view>
+#include <atomic>
+#include <cctype>
+
+// ===== Word Cache =====
+// Bounded LRU map from a whitespace-delimited word to its token ids. Keys
+// are views into the list nodes, which never move.
+struct WordCache {
+    size_t capacity;
+    uint64_t owner = 0;  // BPETokenizer::rank_generation the entries belong to
+    std::list<std::pair<std::string, std::vector<int>>> items;  // most recent first
+    std::unordered_map<std::string_view, decltype(items)::iterator> index;
+
+    explicit WordCache(size_t cap = 1 << 16) : capacity(cap) {}
+
+    const std::vector<int>* get(std::string_view word) {
+        auto it = index.find(word);
+        if (it == index.end()) return nullptr;
+        items.splice(items.begin(), items, it->second);
+        return &it->second->second;
+    }
+
+    void put(std::string_view word, const std::vector<int>& ids) {
+        if (capacity == 0) return;
+        if (items.size() >= capacity) {
+            index.erase(items.back().first);
+            items.pop_back();
+        }
+        items.emplace_front(std::string(word), ids);
+        index.emplace(items.front().first, items.begin());
+    }
+
+    void clear() {
+        index.clear();
+        items.clear();
+    }
+};
 
 struct BPETokenizer {
     // ===== Core Data =====
@@ -19,6 +58,19 @@ struct BPETokenizer {
     std::vector<std::pair<std::string, std::string>> merges;
     std::unordered_map<std::string, int> freq;
 
+    // ===== Merge Ranks (built by build_ranks) =====
+    // Every string that takes part in a merge is interned to a symbol id.
+    // first_rank maps a symbol-id pair to the first merge index using it;
+    // next_rank chains any later merge of the same pair.
+    std::unordered_map<std::string, int> sym_id;
+    std::vector<int> sym_token;    // symbol id -> vocab id (or <unk>)
+    std::unordered_map<uint64_t, int> first_rank;
+    std::vector<int> next_rank;
+    std::vector<int> merge_sym;    // merge index -> merged symbol id
+    int byte_sym[128];             // ASCII char -> symbol id, or -1
+    int unk_id = 0;
+    uint64_t rank_generation = 0;  // invalidates thread-local word caches; 0 = never built
+
     // ===== Special Tokens =====
     const std::vector<std::string> special_tokens = {"<unk>", "<pad>", "<bos>", "<eos>"};
 
@@ -100,14 +152,32 @@ struct BPETokenizer {
         while (f >> word)
             freq["▁" + word]++;
 
-        std::vector<std::vector<std::string>> corpus;
-        corpus.reserve(freq.size());
-        for (const auto& [w, _] : freq)
-            corpus.push_back(split_chars(w));
+        train_from_counts(vocab_size, verbose);
+    }
+
+    // Same as train(), on in-memory text.
+    void train_from_string(const std::string& text, int vocab_size = 50000, bool verbose = true) {
+        freq.clear();
+        std::istringstream iss(text);
+        std::string word;
+        while (iss >> word)
+            freq["▁" + word]++;
+
+        train_from_counts(vocab_size, verbose);
+    }
 
+    // Learns merges from the word counts in freq. Incremental: symbols are
+    // interned ids and words are id arrays; pair counts and a pair -> words
+    // index are built once, and each merge only recounts the words that
+    // contain the merged pair. The next merge comes off a lazy max-heap
+    // (stale entries are skipped when popped) ordered by count, then by the
+    // pair's strings, so ties resolve exactly as most_frequent_pair() does
+    // and the merge list matches the full-recount loop.
+    void train_from_counts(int vocab_size = 50000, bool verbose = true) {
         // ===== Initialize Vocab =====
         vocab.clear();
         rev_vocab.clear();
+        merges.clear();
         for (const auto& t : special_tokens) {
             vocab[t] = static_cast<int>(vocab.size());
             rev_vocab.push_back(t);
@@ -123,22 +193,120 @@ struct BPETokenizer {
             rev_vocab.push_back(s);
         }
 
+        // ===== Interned corpus =====
+        std::vector<std::string> sym;
+        std::unordered_map<std::string, int> sym_id;
+        auto intern = [&](const std::string& s) {
+            auto [it, added] = sym_id.emplace(s, static_cast<int>(sym.size()));
+            if (added) sym.push_back(s);
+            return it->second;
+        };
+        std::vector<std::vector<int>> words;
+        std::vector<long long> weight;
+        words.reserve(freq.size());
+        weight.reserve(freq.size());
+        for (const auto& [w, n] : freq) {
+            std::vector<int> ids;
+            for (const auto& c : split_chars(w)) ids.push_back(intern(c));
+            words.push_back(std::move(ids));
+            weight.push_back(n);
+        }
+
+        auto key = [](int a, int b) { return (static_cast<uint64_t>(static_cast<uint32_t>(a)) << 32) | static_cast<uint32_t>(b); };
+        std::unordered_map<uint64_t, long long> pair_count;
+        std::unordered_map<uint64_t, std::vector<int>> pair_words;  // may list a word more than once, or stale
+        for (int w = 0; w < static_cast<int>(words.size()); ++w)
+            for (size_t i = 0; i + 1 < words[w].size(); ++i) {
+                const uint64_t k = key(words[w][i], words[w][i + 1]);
+                pair_count[k] += weight[w];
+                pair_words[k].push_back(w);
+            }
+
+        // ===== Lazy max-heap =====
+        struct Entry { long long count; int a, b; };
+        auto lower = [&](const Entry& x, const Entry& y) {  // x pops after y
+            if (x.count != y.count) return x.count < y.count;
+            if (x.a != y.a) return sym[x.a] > sym[y.a];
+            return sym[x.b] > sym[y.b];
+        };
+        std::vector<Entry> heap;
+        heap.reserve(pair_count.size());
+        for (const auto& [k, n] : pair_count)
+            heap.push_back({n, static_cast<int>(k >> 32), static_cast<int>(static_cast<uint32_t>(k))});
+        std::make_heap(heap.begin(), heap.end(), lower);
+
+        std::vector<int> stamp(words.size(), -1), merged_word;
+        std::vector<uint64_t> touched;
+
         // ===== BPE Merging Loop =====
-        while (static_cast<int>(vocab.size()) < vocab_size) {
-            count_pairs(corpus);
-            auto best_pair = most_frequent_pair();
-            if (pair_freq.empty() || pair_freq[best_pair] < 2) break;
+        for (int step = 0; static_cast<int>(vocab.size()) < vocab_size; ++step) {
+            Entry best{};
+            bool found = false;
+            while (!heap.empty()) {
+                std::pop_heap(heap.begin(), heap.end(), lower);
+                best = heap.back();
+                heap.pop_back();
+                auto it = pair_count.find(key(best.a, best.b));
+                if (it != pair_count.end() && it->second == best.count) { found = true; break; }
+            }
+            if (!found || best.count < 2) break;
+
+            const std::string merged = sym[best.a] + sym[best.b];
+            const int c = intern(merged);
+            const uint64_t best_key = key(best.a, best.b);
+            std::vector<int> occurrences = std::move(pair_words[best_key]);
+            pair_words.erase(best_key);
+            touched.clear();
+
+            for (int w : occurrences) {
+                if (stamp[w] == step) continue;
+                stamp[w] = step;
+                std::vector<int>& ids = words[w];
+                bool has = false;
+                for (size_t i = 0; i + 1 < ids.size() && !has; ++i) has = ids[i] == best.a && ids[i + 1] == best.b;
+                if (!has) continue;
+
+                for (size_t i = 0; i + 1 < ids.size(); ++i) {
+                    const uint64_t k = key(ids[i], ids[i + 1]);
+                    if ((pair_count[k] -= weight[w]) == 0) pair_count.erase(k);
+                    touched.push_back(k);
+                }
+                merged_word.clear();
+                for (size_t i = 0; i < ids.size();) {
+                    if (i + 1 < ids.size() && ids[i] == best.a && ids[i + 1] == best.b) {
+                        merged_word.push_back(c);
+                        i += 2;
+                    } else {
+                        merged_word.push_back(ids[i++]);
+                    }
+                }
+                ids.assign(merged_word.begin(), merged_word.end());
+                for (size_t i = 0; i + 1 < ids.size(); ++i) {
+                    const uint64_t k = key(ids[i], ids[i + 1]);
+                    pair_count[k] += weight[w];
+                    touched.push_back(k);
+                    if (ids[i] == c || ids[i + 1] == c) pair_words[k].push_back(w);
+                }
+            }
+
+            std::sort(touched.begin(), touched.end());
+            touched.erase(std::unique(touched.begin(), touched.end()), touched.end());
+            for (uint64_t k : touched) {
+                auto it = pair_count.find(k);
+                if (it == pair_count.end()) continue;
+                heap.push_back({it->second, static_cast<int>(k >> 32), static_cast<int>(static_cast<uint32_t>(k))});
+                std::push_heap(heap.begin(), heap.end(), lower);
+            }
 
-            merge_pair(corpus, best_pair);
-            const std::string merged = best_pair.first + best_pair.second;
             vocab[merged] = static_cast<int>(vocab.size());
             rev_vocab.push_back(merged);
-            merges.push_back(best_pair);
+            merges.emplace_back(sym[best.a], sym[best.b]);
 
             if (verbose && vocab.size() % 1000 == 0)
                 std::cout << "[BPE] Merges: " << vocab.size() << "\n";
         }
 
+        build_ranks();
         if (verbose)
             std::cout << "[BPE] Training complete. Final vocab size = " << vocab.size() << "\n";
     }
@@ -156,22 +324,165 @@ struct BPETokenizer {
         return tokens;
     }
 
+    // ===== Rank-Based Encoding =====
+    static uint64_t pair_key(int a, int b) {
+        return (static_cast<uint64_t>(static_cast<uint32_t>(a)) << 32) | static_cast<uint32_t>(b);
+    }
+
+    // Rebuilds the rank tables from merges; train and load_token call it.
+    void build_ranks() {
+        static std::atomic<uint64_t> generations{0};
+        sym_id.clear();
+        sym_token.clear();
+        first_rank.clear();
+        next_rank.assign(merges.size(), -1);
+        merge_sym.assign(merges.size(), -1);
+        const auto unk = vocab.find("<unk>");
+        unk_id = unk != vocab.end() ? unk->second : 0;
+        auto intern = [&](const std::string& s) {
+            auto [it, added] = sym_id.emplace(s, static_cast<int>(sym_token.size()));
+            if (added) {
+                auto v = vocab.find(s);
+                sym_token.push_back(v != vocab.end() ? v->second : unk_id);
+            }
+            return it->second;
+        };
+        for (const auto& [tok, _] : vocab) intern(tok);
+        std::unordered_map<uint64_t, int> last_rank;
+        for (size_t r = 0; r < merges.size(); ++r) {
+            const uint64_t k = pair_key(intern(merges[r].first), intern(merges[r].second));
+            merge_sym[r] = intern(merges[r].first + merges[r].second);
+            auto [it, added] = last_rank.emplace(k, static_cast<int>(r));
+            if (added) first_rank.emplace(k, static_cast<int>(r));
+            else {
+                next_rank[it->second] = static_cast<int>(r);
+                it->second = static_cast<int>(r);
+            }
+        }
+        for (int c = 0; c < 128; ++c) {
+            auto it = sym_id.find(std::string(1, static_cast<char>(c)));
+            byte_sym[c] = it != sym_id.end() ? it->second : -1;
+        }
+        rank_generation = ++generations;
+    }
+
+    // Token ids of one word ("▁" + word) by repeatedly merging the adjacent
+    // pair with the lowest rank. A pair's rank is the first merge of that
+    // pair at or after the last applied one, which is exactly when
+    // apply_bpe's merge-by-merge sweep would reach it; equal ranks merge
+    // leftmost first, as its left-to-right scan does.
+    void encode_word(std::string_view word, std::vector<int>& out) const {
+        thread_local std::vector<int> syms, ranks;
+        thread_local std::string ch;
+        syms.clear();
+        auto push_char = [&](std::string_view c) {  // -1: not in the vocab
+            if (c.size() == 1 && static_cast<unsigned char>(c[0]) < 128) {
+                syms.push_back(byte_sym[static_cast<unsigned char>(c[0])]);
+                return;
+            }
+            ch.assign(c);
+            auto it = sym_id.find(ch);
+            syms.push_back(it != sym_id.end() ? it->second : -1);
+        };
+        push_char("▁");
+        for (size_t i = 0; i < word.size();) {
+            const unsigned char c = static_cast<unsigned char>(word[i]);
+            size_t len = 1;
+            if      ((c & 0xE0) == 0xC0) len = 2;
+            else if ((c & 0xF0) == 0xE0) len = 3;
+            else if ((c & 0xF8) == 0xF0) len = 4;
+            push_char(word.substr(i, len));
+            i += len;
+        }
+
+        int cursor = 0;
+        auto rank_at = [&](size_t i) {
+            if (syms[i] < 0 || syms[i + 1] < 0) return -1;
+            auto it = first_rank.find(pair_key(syms[i], syms[i + 1]));
+            int r = it == first_rank.end() ? -1 : it->second;
+            while (r >= 0 && r < cursor) r = next_rank[r];
+            return r;
+        };
+        ranks.resize(syms.size() > 1 ? syms.size() - 1 : 0);
+        for (size_t i = 0; i < ranks.size(); ++i) ranks[i] = rank_at(i);
+
+        for (;;) {
+            size_t best = ranks.size();
+            for (size_t i = 0; i < ranks.size(); ++i)
+                if (ranks[i] >= 0 && (best == ranks.size() || ranks[i] < ranks[best])) best = i;
+            if (best == ranks.size()) break;
+            if (ranks[best] < cursor) {  // cached before the cursor moved past it
+                ranks[best] = rank_at(best);
+                continue;
+            }
+            cursor = ranks[best];
+            syms[best] = merge_sym[cursor];
+            syms.erase(syms.begin() + best + 1);
+            ranks.erase(ranks.begin() + best);
+            if (best > 0) ranks[best - 1] = rank_at(best - 1);
+            if (best < ranks.size()) ranks[best] = rank_at(best);
+        }
+        for (int s : syms) out.push_back(s >= 0 ? sym_token[s] : unk_id);
+    }
+
     // ===== Encode / Decode =====
+    // Same ids as apply_bpe over every word. Words go through a bounded
+    // LRU cache: the calling thread's own unless one is passed in (pass
+    // nullptr to disable caching).
     [[nodiscard]] std::vector<int> encode(const std::string& text) const {
-        std::istringstream iss(text);
-        std::string word;
+        return encode(text, &thread_cache());
+    }
+
+    [[nodiscard]] std::vector<int> encode(const std::string& text, WordCache* cache) const {
         std::vector<int> out;
-        while (iss >> word) {
-            auto chars = split_chars("▁" + word);
-            auto merged = apply_bpe(std::move(chars));
-            for (const auto& t : merged) {
-                if (auto it = vocab.find(t); it != vocab.end())
-                    out.push_back(it->second);
-                else
-                    out.push_back(vocab.at("<unk>"));
+        encode_into(text, out, cache);
+        return out;
+    }
+
+    static WordCache& thread_cache() {
+        thread_local WordCache cache;
+        return cache;
+    }
+
+    // Appends the ids of text to out.
+    void encode_into(std::string_view text, std::vector<int>& out, WordCache* cache) const {
+        if (rank_generation == 0 || merge_sym.size() != merges.size()) {  // rank tables not built
+            std::istringstream iss{std::string(text)};
+            std::string word;
+            while (iss >> word) {
+                auto merged = apply_bpe(split_chars("▁" + word));
+                for (const auto& t : merged) {
+                    if (auto it = vocab.find(t); it != vocab.end())
+                        out.push_back(it->second);
+                    else
+                        out.push_back(vocab.at("<unk>"));
+                }
             }
+            return;
+        }
+        if (cache && cache->owner != rank_generation) {
+            cache->clear();
+            cache->owner = rank_generation;
+        }
+        thread_local std::vector<int> ids;
+        for (size_t i = 0; i < text.size();) {
+            while (i < text.size() && std::isspace(static_cast<unsigned char>(text[i]))) ++i;
+            size_t j = i;
+            while (j < text.size() && !std::isspace(static_cast<unsigned char>(text[j]))) ++j;
+            if (j == i) break;
+            const std::string_view word = text.substr(i, j - i);
+            i = j;
+            if (cache) {
+                if (const std::vector<int>* hit = cache->get(word)) {
+                    out.insert(out.end(), hit->begin(), hit->end());
+                    continue;
+                }
+            }
+            ids.clear();
+            encode_word(word, ids);
+            if (cache) cache->put(word, ids);
+            out.insert(out.end(), ids.begin(), ids.end());
         }
-        return out;
     }
 
     [[nodiscard]] std::string decode(const std::vector<int>& tokens) const {
@@ -180,7 +491,10 @@ struct BPETokenizer {
             if (t >= 0 && t < static_cast<int>(rev_vocab.size()))
                 out += rev_vocab[t];
         }
-        std::replace(out.begin(), out.end(), '▁', ' ');
+        // "▁" is three bytes in UTF-8, so it has to be replaced as a string
+        const std::string marker = "▁";
+        for (size_t pos = 0; (pos = out.find(marker, pos)) != std::string::npos; ++pos)
+            out.replace(pos, marker.size(), " ");
         return out;
     }
 
@@ -234,5 +548,6 @@ struct BPETokenizer {
                 }
             }
         }
+        build_ranks();
     }
 };
@@ -0,0 +1,139 @@
+#pragma once
+#include "model.hpp"
+#include "threadpool.hpp"
+#include <cassert>
+#include <iostream>
+#include <memory>
+#include <vector>
+
+// ===== Data-parallel trainer =====
+// Splits a batch across N workers that share one copy of the weights.
+// Worker 0 is the model itself. Workers 1..N-1 are Model::replica()s:
+// their parameters view the model's arena, and each keeps its own
+// activations and a private gradient buffer laid out like arena.grad.
+// Each worker runs forward, the fused loss and backward on its own
+// micro-batches. Every worker is one task on the thread pool, so the
+// GEMMs and attention inside it run serially on that thread. The
+// gradients are then reduced into the model's arena, and the caller
+// steps the optimizer as usual:
+//
+//   DataParallelTrainer trainer(model);  // after model.flatten()
+//   float loss = trainer.accumulate(b.batch, b.targets, accum);
+//   opt.step();
+//
+// The reduction is a pairwise tree per chunk of CHUNK floats. All tree
+// levels of a chunk run while it is hot in cache, and the chunks are
+// spread over the pool. The replica grads are zeroed in the same pass.
+// The summation order depends only on N, so results do not change with
+// the thread count.
+class DataParallelTrainer {
+public:
+    static constexpr size_t CHUNK = 1 << 14;
+
+    // workers = 0: one per pool thread. Falls back to a single worker if
+    // a replica cannot be built.
+    explicit DataParallelTrainer(Model& model, int workers = 0) : master(model) {
+        if (master.arena.params.empty()) master.flatten();
+        const int n = workers > 0 ? workers : num_threads();
+        for (int w = 1; w < n; ++w) {
+            std::unique_ptr<Model> r = master.replica();
+            if (!r) {
+                std::cerr << "[DP] Error: cannot build replica " << w << ", training on one worker\n";
+                replicas.clear();
+                break;
+            }
+            replicas.push_back(std::move(r));
+        }
+        scratch.resize(replicas.size() + 1);
+    }
+
+    int workers() const { return static_cast<int>(replicas.size()) + 1; }
+
+    // Mean loss over the batch. The model's gradients become the mean
+    // gradient of workers() x accum equal micro-batches of whole sequences
+    // (micro-batch a * workers() + w runs on worker w), which is exactly
+    // the full-batch gradient when the sequences have equal length, as
+    // TokenDataset windows do. The batch's sequence count must split
+    // evenly. Grads must be zero on entry, which the optimizer step
+    // leaves them.
+    float accumulate(const TokenBatch& batch, const std::vector<int>& targets, int accum = 1) {
+        const int n = workers(), parts = n * accum;
+        assert(accum >= 1 && batch.size() % parts == 0 && (int)targets.size() == batch.total());
+        const int per = batch.size() / parts;
+        auto run = [&](int w) {
+            PROFILE_SCOPE("dp.worker");
+            Model& m = w == 0 ? master : *replicas[w - 1];
+            m.checkpoint_every = master.checkpoint_every;
+            Micro& mb = scratch[w];
+            mb.loss = 0.0;
+            for (int a = 0; a < accum; ++a) {
+                slice(batch, targets, (a * n + w) * per, per, mb);
+                Tensor g;
+                mb.loss += m.loss(mb.batch, mb.targets, &g);
+                m.backward(std::move(g));
+            }
+        };
+        if (n == 1) run(0);  // the model's own layers use the whole pool
+        else parallel_for(0, n, 1, [&](int w0, int w1) { for (int w = w0; w < w1; ++w) run(w); });
+
+        reduce(1.0f / parts);
+        double loss = 0.0;
+        for (const Micro& mb : scratch) loss += mb.loss;
+        return static_cast<float>(loss / parts);
+    }
+
+private:
+    struct Micro {
+        TokenBatch batch;
+        std::vector<int> targets;
+        double loss = 0.0;
+    };
+
+    Model& master;
+    std::vector<std::unique_ptr<Model>> replicas;
+    std::vector<Micro> scratch;  // per worker
+
+    // Sequences [first, first + count) of batch, rebased to row 0.
+    static void slice(const TokenBatch& batch, const std::vector<int>& targets, int first, int count, Micro& out) {
+        const int r0 = batch.offsets[first], r1 = batch.offsets[first + count];
+        out.batch.tokens.assign(batch.tokens.begin() + r0, batch.tokens.begin() + r1);
+        out.targets.assign(targets.begin() + r0, targets.begin() + r1);
+        out.batch.offsets.resize(count + 1);
+        for (int b = 0; b <= count; ++b) out.batch.offsets[b] = batch.offsets[first + b] - r0;
+    }
+
+    // master grad = scale * sum of every worker's grad; replica grads = 0.
+    void reduce(float scale) {
+        const int n = workers();
+        PROFILE_SCOPE("dp.reduce", (double)n * master.arena.grad.size(), 8.0 * n * master.arena.grad.size());
+        std::vector<float*> g(n);
+        g[0] = master.arena.grad.data();
+        for (int w = 1; w < n; ++w) g[w] = replicas[w - 1]->arena.grad.data();
+        const size_t size = master.arena.grad.size();
+        const int chunks = (int)((size + CHUNK - 1) / CHUNK);
+        const Kernels& k = kernels();
+        parallel_for(0, chunks, 1, [&](int c0, int c1) {
+            for (int c = c0; c < c1; ++c) {
+                const size_t off = (size_t)c * CHUNK, len = std::min(CHUNK, size - off);
+                for (int stride = 1; stride < n; stride *= 2)
+                    for (int w = 0; w + stride < n; w += 2 * stride) k.add(g[w] + off, g[w + stride] + off, len);
+                k.scale(g[0] + off, scale, len);
+                for (int w = 1; w < n; ++w) std::fill_n(g[w] + off, len, 0.0f);
+            }
+        });
+
+        // sparse rows (the embedding table): few, merged in worker order
+        auto& params = master.arena.params;
+        for (size_t p = 0; p < params.size(); ++p) {
+            SparseRowGrad* dst = params[p].sparse;
+            if (!dst) continue;
+            for (int w = 1; w < n; ++w) {
+                SparseRowGrad& src = *replicas[w - 1]->arena.params[p].sparse;
+                for (size_t r = 0; r < src.size(); ++r)
+                    k.add(dst->row(src.ids[r]), src.grad.data() + r * src.cols, src.cols);
+                src.clear();
+            }
+            k.scale(dst->grad.data(), scale, dst->grad.size());
+        }
+    }
+};
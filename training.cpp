@@ -1,4 +1,7 @@
 #include "model.hpp"
+#include "dataset.hpp"
+#include "optimizer.hpp"
+#include "trainer.hpp"
 #include "tokenizer_bpe.hpp"
 #include <iostream>
 #include <random>
@@ -14,39 +17,79 @@ int main() {
     // Option B: Load pre-trained tokenizer
     tokenizer.load_token("tokenizer.model");
 
+    // --- Token data ---
+    // Shards written once by: cb_tokenize tokenizer.model data/corpus.txt data/train
+    DatasetOptions data_opt;
+    data_opt.seq = 256;
+    data_opt.seed = 1234;
+    TokenDataset dataset;
+    if (!dataset.open("data/train", data_opt)) return 1;
+
     // --- Initialize model ---
     const int vocab = tokenizer.vocab.size(), dim = 1024, hidden = 4096, layers = 24, heads = 16;
     Model model(vocab, dim, hidden, layers, heads);
 
-    // --- Example text input ---
-    std::string text = "Hello world, this is a small GPT model.";
-    std::vector<int> tokens = tokenizer.encode(text);
+    // --- Resume weights from the last run, if any ---
+    const std::string ckpt = "./models/CarbonLLM_250M.cb";
+    Checkpoint ck;
+    const bool resume = Checkpoint::is_v2(ckpt) && ck.open(ckpt) && model.load(ckpt);
+
+    // --- Optimizer: AdamW over one flat parameter arena ---
+    const int steps = 100;
+    LRSchedule schedule;
+    schedule.peak = 3e-4f;
+    schedule.min_lr = 3e-5f;
+    schedule.warmup = 10;
+    schedule.decay_steps = steps;
+    Optimizer opt(model.flatten(), OptimizerConfig(), schedule);  // after load: the arena copies the weights in
 
-    // For demonstration, set the target as "next token"
-    std::vector<int> target(tokens.size());
-    for (size_t i = 0; i < tokens.size(); i++)
-        target[i] = (tokens[i] + 1) % vocab;
+    // --- Data parallelism: one worker per pool thread, sharing the weights ---
+    DataParallelTrainer trainer(model);
+    model.checkpoint_every = 4;  // keep every 4th block input, recompute the rest in backward
+    const int accum = 2, batch = 2 * trainer.workers() * accum;  // 2 sequences per micro-batch
 
-    float lr = 1e-4f;
+    // --- ...and the optimizer state and data position ---
+    DatasetCursor start;
+    if (resume && opt.load_state(ck) && dataset.load_cursor(ck, start))
+        std::cout << "Resumed at step " << opt.t << ", epoch " << start.epoch << ", window " << start.position << "\n";
 
     // --- Training loop ---
-    for (int epoch = 0; epoch < 100; epoch++) {
-        Tensor pred = model.forward(tokens);
-        Tensor grad(pred.rows, pred.cols);
-        float loss = cross_entropy(pred, target, grad);
-        model.step(lr);
-
-        if (epoch % 10 == 0)
-            std::cout << "Epoch " << epoch << " | Loss=" << loss << "\n";
+    // Batches of (seq inputs, seq next-token targets) are assembled on a
+    // background thread while the step runs.
+    // With -DCARBON_PROFILE, three steps after warm-up are profiled into a
+    // per-op table and carbon_trace.json (open in chrome://tracing).
+    [[maybe_unused]] const int profile_from = 10, profile_steps = 3;
+    DataLoader loader(dataset, batch, start);
+    for (int step = 0; step < steps; step++) {
+        if (step == profile_from) profiler().start();
+        const DataBatch& b = loader.next();
+        float loss = trainer.accumulate(b.batch, b.targets, accum);  // forward + backward on every worker, grads reduced
+        const float lr = opt.lr();
+        const float norm = opt.step();  // clip, AdamW update, zero grads
+#ifdef CARBON_PROFILE
+        if (step == profile_from + profile_steps - 1) {
+            profiler().stop();
+            profiler().report(std::cout);
+            if (profiler().write_chrome_trace("carbon_trace.json")) std::cout << "Wrote carbon_trace.json\n";
+        }
+#endif
+
+        if (step % 10 == 0)
+            std::cout << "Step " << step << " | Loss=" << loss << " | lr=" << lr << " | grad norm=" << norm << "\n";
     }
 
-    model.save("./models/CarbonLLM_250M.cb");
-    std::cout << "Saved weights to CarbonLLM_250M.cb\n";
+    model.save(ckpt, [&](CheckpointWriter& w) {
+        opt.save_state(w);
+        dataset.save_cursor(w, loader.cursor());
+    });
+    std::cout << "Saved weights, optimizer state and data cursor to CarbonLLM_250M.cb\n";
 
     // --- Decode some output for fun ---
-    std::string decoded = tokenizer.decode(tokens);
-    std::cout << "Decoded tokens: " << decoded << "\n";
+    std::vector<int> sample(dataset.opt.seq);
+    std::vector<int> unused(dataset.opt.seq);
+    dataset.window(0, sample.data(), unused.data());
+    std::string decoded = tokenizer.decode(sample);
+    std::cout << "Decoded tokens: " << decoded.substr(0, 200) << "\n";
 
     return 0;
 }
-
@@ -2,22 +2,63 @@
 #include "layernorm.hpp"
 #include "attention.hpp"
 #include "feedforward.hpp"
+#include "profiler.hpp"
 
 struct TransformerBlock {
     LayerNorm ln1,ln2; MultiHeadAttention attn; FeedForward ff;
-    TransformerBlock(int d,int h,int heads):ln1(d),ln2(d),attn(d,heads),ff(d,h){}
-    Tensor forward(const Tensor&x){
+    Tensor x_cache,res_cache;  // ln1 and ln2 inputs, kept for backward
+    TransformerBlock(int d,int h,int heads,Activation act=Activation::ReLU):ln1(d),ln2(d),attn(d,heads),ff(d,h,act){}
+    Tensor forward(const Tensor&x){return forward(x,single_sequence(x.rows));}
+    // The first residual add is fused into ln2 (forward_residual).
+    Tensor forward(const Tensor&x,const std::vector<int>&offsets){
+        [[maybe_unused]] const double n=x.rows,d=x.cols;
+        Tensor norm1,res1,norm2,out;
+        {PROFILE_SCOPE("ln1",8*n*d,8*n*d);norm1=ln1.forward(x);}
+        {PROFILE_SCOPE("attn",attn_flops(d,offsets),4*(6*n*d+4*d*d));res1=attn.forward(norm1,offsets);}
+        {PROFILE_SCOPE("ln2",9*n*d,12*n*d);norm2=ln2.forward_residual(res1,x);}
+        {PROFILE_SCOPE("ffn",ffn_flops(n,d),4*(2*n*d+2*n*ff.hidden+(d+ff.l1.W.cols)*ff.hidden));out=ff.forward(norm2);}
+        {PROFILE_SCOPE("residual",n*d,12*n*d);add_inplace(out,res1);}
+        if(grad_enabled()){x_cache=x;res_cache=std::move(res1);}
+        return out;
+    }
+    Tensor decode(const Tensor&x,KVCache&cache){
         Tensor norm1=ln1.forward(x);
-        Tensor attn_out=attn.forward(norm1);
-        Tensor res1(x.rows,x.cols);
-        for(size_t i=0;i<res1.val.size();i++) res1.val[i]=x.val[i]+attn_out.val[i];
-        Tensor norm2=ln2.forward(res1);
-        Tensor ff_out=ff.forward(norm2);
-        Tensor out(res1.rows,res1.cols);
-        for(size_t i=0;i<out.val.size();i++) out.val[i]=res1.val[i]+ff_out.val[i];
+        Tensor res1=attn.decode(norm1,cache);
+        Tensor norm2=ln2.forward_residual(res1,x);
+        Tensor out=ff.forward(norm2);
+        add_inplace(out,res1);
         return out;
     }
+    static void add_inplace(Tensor&a,const Tensor&b){kernels().add(a.val.data(),b.val.data(),a.val.size());}
+    // Profiler estimates. Attention: Q/K/V/O projections plus QK^T and PV
+    // over each packed sequence; FFN: both GEMMs. Backward costs about 2x.
+    static double attn_flops(double d,const std::vector<int>&offsets){
+        double f=8*(double)offsets.back()*d*d;
+        for(size_t b=0;b+1<offsets.size();b++){double s=offsets[b+1]-offsets[b];f+=2*d*s*s;}
+        return f;
+    }
+    double ffn_flops(double n,double d)const{return 2*n*d*ff.l1.W.cols+2*n*ff.hidden*d;}
+    // Through both residual branches of the last grad-enabled forward;
+    // upstream gradient in .val.
+    Tensor backward(const Tensor&grad_out){
+        [[maybe_unused]] const double n=grad_out.rows,d=grad_out.cols;
+        Tensor gf,g1,ga,g0;
+        {PROFILE_SCOPE("ffn.backward",2*ffn_flops(n,d)+2*n*d*ff.l1.W.cols,4*(4*n*d+3*n*ff.hidden+2*(d+ff.l1.W.cols)*ff.hidden));gf=ff.backward(grad_out);}
+        {PROFILE_SCOPE("ln2.backward",12*n*d,12*n*d);g1=ln2.backward(gf,res_cache);}
+        {PROFILE_SCOPE("residual.backward",n*d,12*n*d);add_inplace(g1,grad_out);}
+        {PROFILE_SCOPE("attn.backward",2*attn_flops(d,attn.offsets_cache),4*(12*n*d+8*d*d));ga=attn.backward(g1);}
+        {PROFILE_SCOPE("ln1.backward",12*n*d,12*n*d);g0=ln1.backward(ga,x_cache);}
+        {PROFILE_SCOPE("residual.backward",n*d,12*n*d);add_inplace(g0,g1);}
+        return g0;
+    }
+    // Frees every activation kept for backward (activation checkpointing).
+    void release(){ln1.release();ln2.release();attn.release();ff.release();x_cache=Tensor();res_cache=Tensor();}
     void step(float lr){ln1.step(lr);ln2.step(lr);attn.step(lr);ff.step(lr);}
+    template<typename F> void parameters(const std::string&prefix,F&&f){
+        ln1.parameters(prefix+"ln1.",f);ln2.parameters(prefix+"ln2.",f);
+        attn.parameters(prefix+"attn.",f);ff.parameters(prefix+"ff.",f);
+    }
+    template<typename F> void linears(const std::string&prefix,F&&f){attn.linears(prefix+"attn.",f);ff.linears(prefix+"ff.",f);}
     void save(std::ofstream&f)const{ln1.save(f);ln2.save(f);attn.save(f);ff.save(f);}
     void load(std::ifstream&f){ln1.load(f);ln2.load(f);attn.load(f);ff.load(f);}
 };
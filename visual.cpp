@@ -1,10 +1,33 @@
+#include "checkpoint.hpp"
 #include <fstream>
 #include <iostream>
 #include <vector>
 using namespace std;
 
-int main() {
-    ifstream f("MiniLLM_v9.cb", ios::binary);
+static void print_tensor(const float* vals, int rows, int cols) {
+    for (int i = 0; i < rows; i++) {
+        for (int j = 0; j < cols; j++) {
+            cout << vals[i * cols + j] << " ";
+        }
+        cout << "\n";
+    }
+    cout << "----------------------------\n";
+}
+
+int main(int argc, char** argv) {
+    string path = argc > 1 ? argv[1] : "MiniLLM_v9.cb";
+
+    if (Checkpoint::is_v2(path)) {
+        Checkpoint ck;
+        if (!ck.open(path)) return 1;
+        for (const auto& e : ck.entries) {
+            cout << e.name << " (" << e.rows << "x" << e.cols << "):\n";
+            if (e.dtype == CB_F32) print_tensor(static_cast<const float*>(ck.payload(e)), e.rows, e.cols);
+        }
+        return 0;
+    }
+
+    ifstream f(path, ios::binary);
     if (!f) {
         cerr << "Cannot open file\n";
         return 1;
@@ -19,13 +42,7 @@ int main() {
         f.read((char*)vals.data(), vals.size() * sizeof(float));
 
         cout << "Tensor (" << rows << "x" << cols << "):\n";
-        for (int i = 0; i < rows; i++) {
-            for (int j = 0; j < cols; j++) {
-                cout << vals[i * cols + j] << " ";
-            }
-            cout << "\n";
-        }
-        cout << "----------------------------\n";
+        print_tensor(vals.data(), rows, cols);
     }
     return 0;
 }
@@ -0,0 +1,193 @@
+#pragma once
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <new>
+#include <vector>
+
+// ===== Workspace =====
+// Bump arena for the activations and scratch of one forward/backward step.
+// alloc() hands out 64-byte aligned slices and reset() recycles all of them
+// at once. If a step outgrew the first block, reset() swaps the blocks for
+// a single one sized to the high-water mark, so once warmed up a step
+// performs no heap allocations at all.
+struct Workspace {
+    struct Block { char* base; size_t size; };
+    std::vector<Block> blocks;
+    size_t used = 0;        // bytes used in blocks.back()
+    size_t step_bytes = 0;  // bytes handed out since the last reset
+    size_t high_water = 0;
+
+    explicit Workspace(size_t initial_bytes = 0) {
+        if (initial_bytes) add_block(initial_bytes);
+    }
+    ~Workspace() { release(); }
+    Workspace(const Workspace&) = delete;
+    Workspace& operator=(const Workspace&) = delete;
+
+    void* alloc_bytes(size_t bytes) {
+        bytes = (bytes + 63) & ~size_t(63);
+        if (blocks.empty() || used + bytes > blocks.back().size)
+            add_block(std::max(bytes, blocks.empty() ? size_t(1) << 20 : blocks.back().size * 2));
+        void* p = blocks.back().base + used;
+        used += bytes;
+        step_bytes += bytes;
+        high_water = std::max(high_water, step_bytes);
+        return p;
+    }
+
+    float* alloc(size_t n) { return static_cast<float*>(alloc_bytes(n * sizeof(float))); }
+
+    // Everything handed out since the previous reset becomes invalid.
+    void reset() {
+        if (blocks.size() > 1) {
+            release();
+            add_block(high_water);
+        }
+        used = 0;
+        step_bytes = 0;
+    }
+
+    size_t capacity() const {
+        size_t n = 0;
+        for (const auto& b : blocks) n += b.size;
+        return n;
+    }
+
+private:
+    void add_block(size_t size) {
+        blocks.push_back({static_cast<char*>(::operator new(size, std::align_val_t(64))), size});
+        used = 0;
+    }
+    void release() {
+        for (auto& b : blocks) ::operator delete(b.base, std::align_val_t(64));
+        blocks.clear();
+        used = 0;
+    }
+};
+
+// Workspace new Buffers draw from on this thread (nullptr = heap).
+inline Workspace*& active_workspace() {
+    thread_local Workspace* ws = nullptr;
+    return ws;
+}
+
+#ifdef CARBON_PROFILE
+// Heap-backed Buffer allocations made on this thread, for the profiler.
+inline uint64_t& buffer_heap_allocs() {
+    thread_local uint64_t count = 0;
+    return count;
+}
+#endif
+
+// Routes Tensor allocations on this thread into ws for the scope's lifetime.
+// Tensors created inside must not be used after ws.reset().
+struct WorkspaceScope {
+    Workspace* prev;
+    explicit WorkspaceScope(Workspace& ws) : prev(active_workspace()) { active_workspace() = &ws; }
+    ~WorkspaceScope() { active_workspace() = prev; }
+    WorkspaceScope(const WorkspaceScope&) = delete;
+    WorkspaceScope& operator=(const WorkspaceScope&) = delete;
+};
+
+// ===== Buffer =====
+// Float storage behind Tensor::val/grad with a std::vector-like surface.
+// A Buffer either owns 64-byte aligned heap memory, borrows a slice of the
+// active Workspace (freed by reset, never individually), or views memory
+// owned elsewhere. Copies always allocate from the current source; copying
+// into a view of the same size writes through it.
+struct Buffer {
+    enum Kind : unsigned char { Heap, Arena, View };
+    struct Uninit {};
+
+    float* ptr = nullptr;
+    size_t n = 0, cap = 0;
+    Kind kind = Heap;
+
+    Buffer() = default;
+    explicit Buffer(size_t count, float v = 0.0f) { allocate(count); std::fill_n(ptr, n, v); }
+    Buffer(size_t count, Uninit) { allocate(count); }
+    Buffer(const Buffer& o) { allocate(o.n); std::copy_n(o.ptr, o.n, ptr); }
+    Buffer(Buffer&& o) noexcept : ptr(o.ptr), n(o.n), cap(o.cap), kind(o.kind) { o.forget(); }
+    ~Buffer() { release(); }
+
+    static Buffer view(float* p, size_t count) {
+        Buffer b;
+        b.ptr = p;
+        b.n = b.cap = count;
+        b.kind = View;
+        return b;
+    }
+
+    Buffer& operator=(const Buffer& o) {
+        if (this != &o) {
+            discard_to(o.n);
+            std::copy_n(o.ptr, o.n, ptr);
+        }
+        return *this;
+    }
+    Buffer& operator=(Buffer&& o) noexcept {
+        if (this != &o) {
+            release();
+            ptr = o.ptr; n = o.n; cap = o.cap; kind = o.kind;
+            o.forget();
+        }
+        return *this;
+    }
+
+    size_t size() const { return n; }
+    bool empty() const { return n == 0; }
+    float* data() { return ptr; }
+    const float* data() const { return ptr; }
+    float* begin() { return ptr; }
+    float* end() { return ptr + n; }
+    const float* begin() const { return ptr; }
+    const float* end() const { return ptr + n; }
+    float& operator[](size_t i) { return ptr[i]; }
+    const float& operator[](size_t i) const { return ptr[i]; }
+
+    void assign(size_t count, float v) {
+        discard_to(count);
+        std::fill_n(ptr, n, v);
+    }
+
+    void resize(size_t count, float v = 0.0f) {
+        if (count > cap) {
+            Buffer grown(count, Uninit{});
+            std::copy_n(ptr, n, grown.ptr);
+            std::fill(grown.ptr + n, grown.ptr + count, v);
+            *this = std::move(grown);
+            return;
+        }
+        if (count > n) std::fill(ptr + n, ptr + count, v);
+        n = count;
+    }
+
+private:
+    void allocate(size_t count) {
+        n = cap = count;
+        if (Workspace* ws = active_workspace()) {
+            kind = Arena;
+            ptr = ws->alloc(count);
+        } else {
+            kind = Heap;
+#ifdef CARBON_PROFILE
+            if (count) ++buffer_heap_allocs();
+#endif
+            ptr = count ? static_cast<float*>(::operator new(count * sizeof(float), std::align_val_t(64))) : nullptr;
+        }
+    }
+    // Make room for count elements without preserving contents. Heap and
+    // view storage is reused when large enough; arena slices never are,
+    // since they may belong to a workspace generation that was reset.
+    void discard_to(size_t count) {
+        if (kind != Arena && count <= cap) { n = count; return; }
+        release();
+        allocate(count);
+    }
+    void release() {
+        if (kind == Heap && ptr) ::operator delete(ptr, std::align_val_t(64));
+        forget();
+    }
+    void forget() { ptr = nullptr; n = cap = 0; kind = Heap; }
+};